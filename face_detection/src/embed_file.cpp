@@ -0,0 +1,59 @@
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+// Build-time helper: turns a file into a header holding its bytes as an
+// array, so face_detection can carry its cascade instead of finding it on
+// disk at startup.
+//
+//   embed_file <input> <output.h> <symbol>
+//
+// defines <symbol>[] and <symbol>_size.
+int main(int argc, char *argv[])
+{
+    if (argc != 4)
+    {
+        std::cerr << "Usage: " << argv[0] << " <input> <output.h> <symbol>\n";
+        return -1;
+    }
+    const std::string symbol = argv[3];
+
+    std::ifstream in(argv[1], std::ios::binary);
+    if (!in)
+    {
+        std::cerr << "Could not open input file: " << argv[1] << std::endl;
+        return -1;
+    }
+    std::vector<unsigned char> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    std::ofstream out(argv[2], std::ios::trunc);
+    out << "// Generated from " << argv[1] << " by embed_file; do not edit\n"
+        << "#pragma once\n"
+        << "#include <cstddef>\n\n"
+        << "static const unsigned char " << symbol << "[] = {\n";
+    static const char digits[] = "0123456789abcdef";
+    std::string line;
+    for (size_t i = 0; i < bytes.size(); ++i)
+    {
+        line += "0x";
+        line += digits[bytes[i] >> 4];
+        line += digits[bytes[i] & 0xF];
+        line += ',';
+        if (i % 16 == 15 || i + 1 == bytes.size())
+        {
+            out << line << "\n";
+            line.clear();
+        }
+    }
+    out << "};\n"
+        << "static const size_t " << symbol << "_size = sizeof(" << symbol << ");\n";
+
+    if (!out.flush())
+    {
+        std::cerr << "Could not write output file: " << argv[2] << std::endl;
+        return -1;
+    }
+    return 0;
+}
@@ -2,10 +2,286 @@
 #include <filesystem>
 #include <opencv2/opencv.hpp>
 #include <opencv2/objdetect.hpp>
+#include <opencv2/dnn.hpp>
+#include <opencv2/core/hal/intrin.hpp>
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <getopt.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#ifdef FACE_DETECTION_EMBEDDED_CASCADE
+#include "embedded_cascade.h" // Generated by meson from the compact cascade
+#endif
 
 namespace fs = std::filesystem;
 
+// How results are written: human-readable text, one JSON object per image,
+// or CSV with one row per face
+enum class OutputFormat
+{
+    Text,
+    Jsonl,
+    Csv
+};
+
+const std::string csv_header = "path,image_width,image_height,scale,x,y,width,height";
+
+// Settings for one run, filled from the command line
+struct DetectionOptions
+{
+    unsigned jobs = std::max(1u, std::thread::hardware_concurrency()); // Threads per pool stage
+    bool batch = false;                                               // Never open a window or wait for keys
+    OutputFormat format = OutputFormat::Text;
+    fs::path output_path;                                             // Results file; empty for stdout
+    fs::path save_dir;                                                // Annotated images; empty to skip
+    fs::path cache_path;                                              // Detection cache; empty to disable
+    fs::path manifest_path;                                           // File list to scan instead of walking; "-" for stdin
+    unsigned shard_index = 0;                                         // This node's share of the input...
+    unsigned shard_count = 1;                                         // ...out of this many
+    bool profile = false;                                             // Report per-stage timings at the end
+};
+
+// Per-image latencies gathered by --profile, in microseconds. Each pipeline
+// thread fills its own and merges it into the run's when it finishes, so
+// profiling adds no locking to the per-image path.
+struct StageTimings
+{
+    std::vector<double> decode;
+    std::vector<double> preprocess;
+    std::vector<double> detect;
+    std::vector<double> output;
+    uint64_t pyramid_levels = 0; // Cascade scales evaluated, summed over images
+
+    static double micros(std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end)
+    {
+        return std::chrono::duration<double, std::micro>(end - start).count();
+    }
+
+    void merge(const StageTimings &other)
+    {
+        decode.insert(decode.end(), other.decode.begin(), other.decode.end());
+        preprocess.insert(preprocess.end(), other.preprocess.begin(), other.preprocess.end());
+        detect.insert(detect.end(), other.detect.begin(), other.detect.end());
+        output.insert(output.end(), other.output.begin(), other.output.end());
+        pyramid_levels += other.pyramid_levels;
+    }
+};
+
+// Parameters that decide what the detector finds; cached results are only
+// valid for the settings they were computed with
+struct DetectionParams
+{
+    double scale_factor = 1.1; // Smaller value for more accurate scaling
+    int min_neighbors = 10;    // Increased to reduce false positives
+    int min_size = 60;         // Increased to ignore smaller detections
+    int max_height = 960;      // Input taller than this is scaled down first
+};
+
+// The grid --sweep times on a labeled sample set; -s, -n and --min-size
+// replace an axis with their own comma-separated values
+struct SweepConfig
+{
+    fs::path labels_path;                               // Empty unless sweeping
+    std::vector<double> scale_factors = {1.05, 1.1, 1.2, 1.3};
+    std::vector<int> min_neighbors = {3, 5, 7, 10};
+    std::vector<int> min_sizes = {30, 60, 90};
+    double target_recall = 0.9;                         // Recall the suggested setting must reach
+};
+
+enum class DetectorBackend
+{
+    Cascade, // Haar cascade on the CPU
+    Dnn      // cv::dnn single-shot detector, on the CPU or an accelerator
+};
+
+enum class DnnTarget
+{
+    Cpu,
+    OpenCL,
+    Cuda
+};
+
+// Which detector to run and what it loads
+struct DetectorConfig
+{
+    DetectorBackend backend = DetectorBackend::Cascade;
+    std::string cascade_path;          // Resolved Haar cascade file
+    std::shared_ptr<const std::string> cascade_text; // Compact cascade held in memory; loaded in preference
+    std::string model_path;            // DNN weights (.caffemodel, .onnx, .pb, ...)
+    std::string model_config;          // DNN network description, for formats that have one
+    DnnTarget target = DnnTarget::Cpu;
+    float confidence = 0.5f;           // DNN detections scoring lower are dropped
+    int input_size = 300;              // Side of the square DNN input; res10 SSD expects 300
+    unsigned batch_size = 8;           // Images per DNN forward pass
+    DetectionParams params;
+};
+
+// What identifies a file's contents to the detection cache
+struct FileKey
+{
+    uint64_t inode = 0;
+    uint64_t size = 0;
+    int64_t mtime_ns = 0;
+
+    bool operator==(const FileKey &other) const
+    {
+        return inode == other.inode && size == other.size && mtime_ns == other.mtime_ns;
+    }
+};
+
+struct FileKeyHash
+{
+    size_t operator()(const FileKey &key) const
+    {
+        uint64_t h = key.inode * 0x9E3779B97F4A7C15ULL;
+        h ^= key.size + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+        h ^= static_cast<uint64_t>(key.mtime_ns) + 0x9E3779B97F4A7C15ULL + (h << 6) + (h >> 2);
+        return static_cast<size_t>(h);
+    }
+};
+
+// Function to read the cache key of a file; false if it can't be stat'ed
+bool read_file_key(const fs::path &file_path, FileKey &key)
+{
+    struct stat st;
+    if (::stat(file_path.c_str(), &st) != 0)
+    {
+        return false;
+    }
+    key.inode = static_cast<uint64_t>(st.st_ino);
+    key.size = static_cast<uint64_t>(st.st_size);
+    key.mtime_ns = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    return true;
+}
+
+// A detection result as kept in the cache
+struct CachedDetection
+{
+    cv::Size source_size;
+    double scale = 1.0;
+    std::vector<cv::Rect> faces;
+    bool used = false; // Looked up during this run; only the walker sets it
+};
+
+// Fixed-capacity queue between two pipeline stages. push blocks while the
+// queue is full, so a fast stage cannot run ahead of a slow one and memory
+// stays bounded; pop returns false once the queue is closed and drained.
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity) : capacity_(std::max<size_t>(capacity, 1)) {}
+
+    void push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [this] { return items_.size() < capacity_; });
+        items_.push_back(std::move(item));
+        lock.unlock();
+        not_empty_.notify_one();
+    }
+
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return !items_.empty() || closed_; });
+        if (items_.empty())
+        {
+            return false;
+        }
+        item = std::move(items_.front());
+        items_.pop_front();
+        lock.unlock();
+        not_full_.notify_one();
+        return true;
+    }
+
+    // Function to take up to max_items at once: waits for the first, then takes
+    // whatever else is already queued; false once closed and drained
+    bool pop_batch(std::vector<T> &items, size_t max_items)
+    {
+        items.clear();
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return !items_.empty() || closed_; });
+        while (!items_.empty() && items.size() < std::max<size_t>(max_items, 1))
+        {
+            items.push_back(std::move(items_.front()));
+            items_.pop_front();
+        }
+        lock.unlock();
+        not_full_.notify_all();
+        return !items.empty();
+    }
+
+    // No more pushes; wakes every waiting consumer
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        not_empty_.notify_all();
+    }
+
+private:
+    size_t capacity_;
+    std::deque<T> items_;
+    bool closed_ = false;
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+};
+
+// A file found by the walker. A cache hit that still needs its pixels (to be
+// shown or saved) carries the cached result and skips only detection.
+struct ScanItem
+{
+    fs::path path;
+    FileKey key;
+    const CachedDetection *cached = nullptr;
+};
+
+// An image on its way from the decode stage to the detection stage
+struct DecodedImage
+{
+    fs::path path;
+    cv::Mat image;
+    cv::Size source_size; // Dimensions of the file itself
+    double scale = 1.0;   // Source pixels per decoded pixel
+    FileKey key;
+    const CachedDetection *cached = nullptr;
+};
+
+// Detection output for one image, handed to the writer. Faces are in the
+// coordinates of the decoded image; multiply by scale for the source file.
+struct DetectionResult
+{
+    fs::path path;
+    cv::Mat image;
+    cv::Size source_size;
+    double scale = 1.0;
+    std::vector<cv::Rect> faces;
+    FileKey key;
+    bool from_cache = false; // Already recorded; nothing new for the cache
+};
+
 // Function to check if the file is an image based on its extension (case-insensitive)
 bool is_image(const fs::path &file_path)
 {
@@ -51,150 +327,2506 @@ cv::Mat resize_image_with_max_height(const cv::Mat &image, int max_height)
     }
 }
 
-void detect_faces(const cv::Mat &image, cv::CascadeClassifier &face_cascade, std::vector<cv::Rect> &faces)
+// Height images are decoded and scaled down to before detection
+constexpr int detection_max_height = 600;
+
+// Function to read the pixel dimensions from a JPEG header without decoding
+// it. Walks the marker segments up to the first start-of-frame; returns false
+// for anything that isn't a readable baseline/progressive JPEG.
+bool read_jpeg_size(const fs::path &file_path, cv::Size &size)
+{
+    std::ifstream in(file_path, std::ios::binary);
+    unsigned char header[2];
+    if (!in.read(reinterpret_cast<char *>(header), 2) || header[0] != 0xFF || header[1] != 0xD8)
+    {
+        return false;
+    }
+    for (;;)
+    {
+        int byte = in.get();
+        if (byte != 0xFF)
+        {
+            return false;
+        }
+        int marker;
+        do
+        {
+            marker = in.get(); // 0xFF may be repeated as fill
+        } while (marker == 0xFF);
+        if (marker == EOF || marker == 0xD9 || marker == 0xDA)
+        {
+            return false; // End of image or start of scan before any frame header
+        }
+        if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+        {
+            continue; // Standalone markers carry no length
+        }
+        unsigned char length_bytes[2];
+        if (!in.read(reinterpret_cast<char *>(length_bytes), 2))
+        {
+            return false;
+        }
+        int length = (length_bytes[0] << 8) | length_bytes[1];
+        if (length < 2)
+        {
+            return false;
+        }
+        // SOF0..SOF15, except DHT (C4), JPG (C8) and DAC (CC)
+        if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+        {
+            unsigned char frame[5];
+            if (length < 7 || !in.read(reinterpret_cast<char *>(frame), 5))
+            {
+                return false;
+            }
+            size = cv::Size((frame[3] << 8) | frame[4], (frame[1] << 8) | frame[2]);
+            return size.width > 0 && size.height > 0;
+        }
+        in.seekg(length - 2, std::ios::cur);
+    }
+}
+
+// Function to load an image in grayscale, which is all detection uses. A JPEG
+// much taller than max_height is decoded at 1/2, 1/4 or 1/8 scale straight
+// from the DCT coefficients, which skips most of the decode work; the
+// reduction is chosen from the shorter side so an EXIF rotation can't leave
+// the image below max_height. The result still goes through the usual resize.
+// source_size receives the dimensions of the file as stored.
+cv::Mat decode_image(const fs::path &file_path, int max_height, cv::Size &source_size)
+{
+    int flags = cv::IMREAD_GRAYSCALE;
+    cv::Size size;
+    const bool have_header = read_jpeg_size(file_path, size);
+    if (have_header)
+    {
+        const int shortest = std::min(size.width, size.height);
+        if (shortest >= max_height * 8)
+        {
+            flags = cv::IMREAD_REDUCED_GRAYSCALE_8;
+        }
+        else if (shortest >= max_height * 4)
+        {
+            flags = cv::IMREAD_REDUCED_GRAYSCALE_4;
+        }
+        else if (shortest >= max_height * 2)
+        {
+            flags = cv::IMREAD_REDUCED_GRAYSCALE_2;
+        }
+    }
+    cv::Mat image = cv::imread(file_path.string(), flags);
+    if (image.empty())
+    {
+        return image;
+    }
+    source_size = image.size();
+    if (have_header)
+    {
+        // The header predates any EXIF rotation imread applied
+        const bool rotated = (size.width > size.height) != (image.cols > image.rows);
+        source_size = rotated ? cv::Size(size.height, size.width) : size;
+    }
+    return resize_image_with_max_height(image, max_height);
+}
+
+// Per-thread buffers for preprocess_for_detection; they grow to the largest
+// image seen and are then reused, so steady-state frames allocate nothing
+struct PreprocessScratch
+{
+    cv::Mat gray;                   // Colour input converted
+    cv::Mat resized;                // Input above the height cap, scaled down
+    cv::Mat output;                 // Blurred and equalized result
+    std::vector<uint8_t> padded;    // One source row with a two-pixel border each side
+    std::vector<uint16_t> rows;     // Ring of five horizontally blurred rows
+    int row_tags[5] = {-1, -1, -1, -1, -1}; // Source row held by each ring slot
+};
+
+// Index of row or column i in [0, n) under OpenCV's default BORDER_REFLECT_101
+static inline int reflect_101(int i, int n)
+{
+    return i < 0 ? -i : (i >= n ? 2 * n - 2 - i : i);
+}
+
+// Function to blur one source row horizontally with the 1-4-6-4-1 kernel
+static void blur_row_horizontal(const uint8_t *src, int width, PreprocessScratch &scratch, uint16_t *dst)
+{
+    uint8_t *p = scratch.padded.data();
+    p[0] = src[reflect_101(-2, width)];
+    p[1] = src[reflect_101(-1, width)];
+    std::memcpy(p + 2, src, width);
+    p[width + 2] = src[reflect_101(width, width)];
+    p[width + 3] = src[reflect_101(width + 1, width)];
+
+    int x = 0;
+#if CV_SIMD
+    constexpr int lanes = CV_SIMD_WIDTH / 2;
+    for (; x + lanes <= width; x += lanes)
+    {
+        cv::v_uint16 a = cv::vx_load_expand(p + x);
+        cv::v_uint16 b = cv::vx_load_expand(p + x + 1);
+        cv::v_uint16 c = cv::vx_load_expand(p + x + 2);
+        cv::v_uint16 d = cv::vx_load_expand(p + x + 3);
+        cv::v_uint16 e = cv::vx_load_expand(p + x + 4);
+        cv::v_store(dst + x, a + e + cv::v_shl<2>(b + d) + cv::v_shl<2>(c) + cv::v_shl<1>(c));
+    }
+#endif
+    for (; x < width; ++x)
+    {
+        dst[x] = static_cast<uint16_t>(p[x] + 4 * (p[x + 1] + p[x + 3]) + 6 * p[x + 2] + p[x + 4]);
+    }
+}
+
+// Function to run the 5x5 Gaussian blur and the histogram in one pass and then
+// equalize in place. Matches cv::GaussianBlur(ksize 5, sigma 0), whose 8-bit
+// kernel is exactly the binomial 1-4-6-4-1 / 16, followed by
+// cv::equalizeHist. Each output row is the vertical sum of five cached
+// horizontal passes, so every source pixel is read once; sums peak at
+// 255 * 256 and stay in 16 bits.
+static void blur_and_equalize(const cv::Mat &gray, PreprocessScratch &scratch)
+{
+    const int width = gray.cols;
+    const int height = gray.rows;
+    scratch.output.create(height, width, CV_8UC1);
+    scratch.padded.resize(width + 4);
+    scratch.rows.resize(static_cast<size_t>(width) * 5);
+    std::fill(std::begin(scratch.row_tags), std::end(scratch.row_tags), -1);
+
+    auto horizontal = [&](int row) -> const uint16_t * {
+        uint16_t *slot = scratch.rows.data() + static_cast<size_t>(row % 5) * width;
+        if (scratch.row_tags[row % 5] != row)
+        {
+            blur_row_horizontal(gray.ptr<uint8_t>(row), width, scratch, slot);
+            scratch.row_tags[row % 5] = row;
+        }
+        return slot;
+    };
+
+    int hist[256] = {0};
+    for (int y = 0; y < height; ++y)
+    {
+        // Rows y-2..y+2 are five consecutive source rows (or reflections of
+        // them), so they never collide in the ring
+        const uint16_t *r0 = horizontal(reflect_101(y - 2, height));
+        const uint16_t *r1 = horizontal(reflect_101(y - 1, height));
+        const uint16_t *r2 = horizontal(y);
+        const uint16_t *r3 = horizontal(reflect_101(y + 1, height));
+        const uint16_t *r4 = horizontal(reflect_101(y + 2, height));
+        uint8_t *out = scratch.output.ptr<uint8_t>(y);
+
+        int x = 0;
+#if CV_SIMD
+        constexpr int lanes = CV_SIMD_WIDTH / 2;
+        for (; x + 2 * lanes <= width; x += 2 * lanes)
+        {
+            cv::v_uint16 sums[2];
+            for (int half = 0; half < 2; ++half)
+            {
+                const int i = x + half * lanes;
+                cv::v_uint16 c = cv::vx_load(r2 + i);
+                sums[half] = cv::vx_load(r0 + i) + cv::vx_load(r4 + i) +
+                             cv::v_shl<2>(cv::vx_load(r1 + i) + cv::vx_load(r3 + i)) +
+                             cv::v_shl<2>(c) + cv::v_shl<1>(c);
+            }
+            cv::v_store(out + x, cv::v_rshr_pack<8>(sums[0], sums[1]));
+        }
+#endif
+        for (; x < width; ++x)
+        {
+            unsigned sum = r0[x] + 4u * (r1[x] + r3[x]) + 6u * r2[x] + r4[x];
+            out[x] = static_cast<uint8_t>((sum + 128) >> 8);
+        }
+        for (x = 0; x < width; ++x)
+        {
+            ++hist[out[x]];
+        }
+    }
+#if CV_SIMD
+    cv::vx_cleanup();
+#endif
+
+    // Same mapping cv::equalizeHist builds from the histogram
+    const int total = width * height;
+    int first = 0;
+    while (hist[first] == 0)
+    {
+        ++first;
+    }
+    uint8_t lut[256];
+    if (hist[first] == total)
+    {
+        std::fill(std::begin(lut), std::end(lut), static_cast<uint8_t>(first));
+    }
+    else
+    {
+        const float scale = 255.0f / (total - hist[first]);
+        int sum = 0;
+        for (int i = 0; i <= first; ++i)
+        {
+            lut[i] = 0;
+        }
+        for (int i = first + 1; i < 256; ++i)
+        {
+            sum += hist[i];
+            lut[i] = cv::saturate_cast<uint8_t>(sum * scale);
+        }
+    }
+    for (int y = 0; y < height; ++y)
+    {
+        uint8_t *row = scratch.output.ptr<uint8_t>(y);
+        for (int x = 0; x < width; ++x)
+        {
+            row[x] = lut[row[x]];
+        }
+    }
+}
+
+// Function to turn any decoded image into the detector's input: grayscale,
+// at most max_height tall, blurred and equalized. Returns a view of a scratch
+// buffer valid until the next call on this thread; scale is input pixels per
+// output pixel, for mapping detections back.
+const cv::Mat &preprocess_for_detection(const cv::Mat &image, int max_height, PreprocessScratch &scratch,
+                                        double &scale)
 {
-    // Convert image to grayscale for face detection
-    cv::Mat gray;
-    gray = resize_image_with_max_height(gray, 960);
-    cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+    const cv::Mat *gray = &image;
+    if (image.channels() != 1)
+    {
+        cv::cvtColor(image, scratch.gray, cv::COLOR_BGR2GRAY);
+        gray = &scratch.gray;
+    }
+
+    scale = 1.0;
+    if (gray->rows > max_height)
+    {
+        scale = static_cast<double>(gray->rows) / max_height;
+        int new_width = std::max(1, static_cast<int>(gray->cols / scale));
+        cv::resize(*gray, scratch.resized, cv::Size(new_width, max_height));
+        gray = &scratch.resized;
+    }
 
-    // Apply Gaussian Blur to reduce noise and improve detection accuracy
-    cv::GaussianBlur(gray, gray, cv::Size(5, 5), 0);
+    if (gray->rows < 3 || gray->cols < 3)
+    {
+        // Too small for the two-pixel reflected border; such an image can't
+        // hold a face anyway, but keep the original chain's behaviour
+        cv::GaussianBlur(*gray, scratch.output, cv::Size(5, 5), 0);
+        cv::equalizeHist(scratch.output, scratch.output);
+    }
+    else
+    {
+        blur_and_equalize(*gray, scratch);
+    }
+    return scratch.output;
+}
 
-    // Equalize the histogram of the image to improve detection in varying lighting conditions
-    cv::equalizeHist(gray, gray);
+// Function to count the pyramid levels detectMultiScale evaluates with
+// CASCADE_SCALE_IMAGE, following its own loop: scales grow by scale_factor
+// until the scaled image no longer holds the cascade window, and scales whose
+// window is below min_size are skipped
+int count_pyramid_levels(const cv::Size &image_size, const cv::Size &window, double scale_factor, int min_size)
+{
+    int levels = 0;
+    for (double factor = 1; scale_factor > 1; factor *= scale_factor)
+    {
+        const int window_width = cvRound(window.width * factor);
+        const int window_height = cvRound(window.height * factor);
+        const int scaled_width = cvRound(image_size.width / factor);
+        const int scaled_height = cvRound(image_size.height / factor);
+        if (scaled_width - window.width + 1 <= 0 || scaled_height - window.height + 1 <= 0 ||
+            window_width > image_size.width || window_height > image_size.height)
+        {
+            break;
+        }
+        if (window_width < min_size || window_height < min_size)
+        {
+            continue;
+        }
+        ++levels;
+    }
+    return levels;
+}
 
-    // cv::resize(gray, resized_image, cv::Size(960, 540));
+void detect_faces(const cv::Mat &image, cv::CascadeClassifier &face_cascade, const DetectionParams &params,
+                  std::vector<cv::Rect> &faces, StageTimings *timings = nullptr)
+{
+    // Convert image to grayscale, cap its height, blur it to reduce noise and
+    // equalize its histogram for varying lighting, in reused buffers
+    thread_local PreprocessScratch scratch;
+    double scale;
+    auto start = std::chrono::steady_clock::now();
+    const cv::Mat &gray = preprocess_for_detection(image, params.max_height, scratch, scale);
+    auto preprocessed = std::chrono::steady_clock::now();
 
     // Detect faces in the image using adjusted parameters
     face_cascade.detectMultiScale(
         gray,
         faces,
-        1.1,                         // scaleFactor: smaller value for more accurate scaling
-        10,                          // minNeighbors: increased to reduce false positives
+        params.scale_factor,
+        params.min_neighbors,
         0 | cv::CASCADE_SCALE_IMAGE, // flags
-        cv::Size(60, 60)             // minSize: increased to ignore smaller detections
+        cv::Size(params.min_size, params.min_size)
     );
-}
 
-// Recursive function to process files in a directory
-void process_directory(const fs::path &dir_path, cv::CascadeClassifier &face_cascade, const fs::path &save_dir)
-{
-    try
+    if (timings)
     {
-        for (const auto &entry : fs::recursive_directory_iterator(dir_path))
-        {
-            if (fs::is_regular_file(entry))
-            {
-                const fs::path &file_path = entry.path();
+        timings->preprocess.push_back(StageTimings::micros(start, preprocessed));
+        timings->detect.push_back(StageTimings::micros(preprocessed, std::chrono::steady_clock::now()));
+        timings->pyramid_levels += count_pyramid_levels(gray.size(), face_cascade.getOriginalWindowSize(),
+                                                        params.scale_factor, params.min_size);
+    }
 
-                // Check if the file is an image
-                if (is_image(file_path))
-                {
-                    std::cout << "Processing image: " << file_path << std::endl;
+    // Report rectangles in the coordinates of the image we were given
+    if (scale != 1.0)
+    {
+        for (auto &face : faces)
+        {
+            face = cv::Rect(cvRound(face.x * scale), cvRound(face.y * scale),
+                            cvRound(face.width * scale), cvRound(face.height * scale));
+        }
+    }
+}
 
-                    // Load the image
-                    cv::Mat image = cv::imread(file_path.string());
-                    image = resize_image_with_max_height(image, 600);
-                    if (image.empty())
-                    {
-                        std::cerr << "Could not open or find the image: " << file_path << std::endl;
-                        continue;
-                    }
+// A face detector as the detection stage sees it. Every detection thread owns
+// its own instance. detect() takes a batch so a backend on an accelerator can
+// cover it in one forward pass; rectangles are in each image's own pixels.
+class FaceDetector
+{
+public:
+    virtual ~FaceDetector() = default;
 
-                    // Detect faces in the image
-                    std::vector<cv::Rect> faces;
-                    detect_faces(image, face_cascade, faces);
+    // Most images a single detect() call should be given
+    virtual size_t batch_size() const { return 1; }
 
-                    // Draw rectangles around detected faces
-                    for (const auto &face : faces)
-                    {
-                        cv::rectangle(image, face, cv::Scalar(255, 0, 0), 2);
-                    }
+    virtual void detect(const std::vector<cv::Mat> &images, std::vector<std::vector<cv::Rect>> &faces) = 0;
 
-                    // Output the results
-                    if (!faces.empty())
-                    {
-                        std::cout << "Faces detected: " << faces.size() << std::endl;
-                        for (const auto &face : faces)
-                        {
-                            std::cout << "Face at: x=" << face.x << ", y=" << face.y
-                                      << ", width=" << face.width << ", height=" << face.height << std::endl;
-                        }
-                        // cv::Mat resized_image;
-                        // cv::resize(image, resized_image, cv::Size(960, 540));
-                        // cv::imshow("Detected Faces", resized_image);
-                        cv::imshow("Detected Faces", image);
+    // Where detect() records its preprocess/detect latencies; null when not profiling
+    StageTimings *timings = nullptr;
+};
 
-                        std::cout << "Press any key to continue to the next image...\n";
-                        cv::waitKey(0); // Wait for a key press
-                    }
-                    else
-                    {
-                        std::cout << "No faces detected.\n";
-                    }
+// The Haar cascade, one image at a time on the calling thread
+class CascadeDetector : public FaceDetector
+{
+public:
+    explicit CascadeDetector(const DetectionParams &params) : params_(params) {}
 
-                    // Display the image with detected faces
-
-                    // Optional: Save the image with detected faces to the save directory
-                    /*
-                    if (!faces.empty()) {
-                        fs::create_directories(save_dir); // Create the directory if it doesn't exist
-                        fs::path save_path = save_dir / file_path.filename();
-                        if (!cv::imwrite(save_path.string(), image)) {
-                            std::cerr << "Failed to save the image to: " << save_path << std::endl;
-                        } else {
-                            std::cout << "Saved processed image to: " << save_path << std::endl;
-                        }
-                    }
-                    */
+    // Function to load the cascade, from memory when the config holds a
+    // compact one (no file lookup, and a fraction of the XML to parse)
+    bool load(const DetectorConfig &config)
+    {
+        if (config.cascade_text)
+        {
+            try
+            {
+                cv::FileStorage storage(*config.cascade_text,
+                                        cv::FileStorage::READ | cv::FileStorage::MEMORY | cv::FileStorage::FORMAT_XML);
+                if (storage.isOpened() && face_cascade_.read(storage.getFirstTopLevelNode()))
+                {
+                    return true;
                 }
             }
+            catch (const cv::Exception &e)
+            {
+                std::cerr << e.what() << std::endl;
+            }
         }
+        return !config.cascade_path.empty() && face_cascade_.load(config.cascade_path);
     }
-    catch (const std::exception &e)
+
+    void detect(const std::vector<cv::Mat> &images, std::vector<std::vector<cv::Rect>> &faces) override
     {
-        std::cerr << "Error processing directory: " << e.what() << std::endl;
+        faces.resize(images.size());
+        for (size_t i = 0; i < images.size(); ++i)
+        {
+            detect_faces(images[i], face_cascade_, params_, faces[i], timings);
+        }
     }
-}
 
-int main(int argc, char *argv[])
+private:
+    cv::CascadeClassifier face_cascade_; // Not thread-safe, hence one per detector
+    DetectionParams params_;
+};
+
+// A single-shot detector of the kind OpenCV ships for faces (res10 SSD): a
+// batch is packed into one blob, and the single output holds rows of
+// (image, class, score, x1, y1, x2, y2) with corners relative to the image
+class DnnDetector : public FaceDetector
 {
-    // Check if the directory path is provided as a command-line argument
-    if (argc < 2)
+public:
+    explicit DnnDetector(const DetectorConfig &config) : config_(config) {}
+
+    bool load()
     {
-        std::cerr << "Usage: " << argv[0] << " <directory_path> [<save_directory>]\n";
-        return -1;
+        try
+        {
+            net_ = cv::dnn::readNet(config_.model_path, config_.model_config);
+        }
+        catch (const cv::Exception &e)
+        {
+            std::cerr << e.what() << std::endl;
+            return false;
+        }
+        if (net_.empty())
+        {
+            return false;
+        }
+        switch (config_.target)
+        {
+        case DnnTarget::Cpu:
+            net_.setPreferableBackend(cv::dnn::DNN_BACKEND_OPENCV);
+            net_.setPreferableTarget(cv::dnn::DNN_TARGET_CPU);
+            break;
+        case DnnTarget::OpenCL:
+            net_.setPreferableBackend(cv::dnn::DNN_BACKEND_OPENCV);
+            net_.setPreferableTarget(cv::dnn::DNN_TARGET_OPENCL);
+            break;
+        case DnnTarget::Cuda:
+            net_.setPreferableBackend(cv::dnn::DNN_BACKEND_CUDA);
+            net_.setPreferableTarget(cv::dnn::DNN_TARGET_CUDA);
+            break;
+        }
+        return true;
     }
 
-    fs::path dir_path = argv[1];
-    fs::path save_dir;
+    size_t batch_size() const override { return std::max(1u, config_.batch_size); }
 
-    // Optional: Specify a directory to save processed images
-    if (argc >= 3)
+    void detect(const std::vector<cv::Mat> &images, std::vector<std::vector<cv::Rect>> &faces) override
     {
-        save_dir = argv[2];
+        faces.assign(images.size(), {});
+        if (images.empty())
+        {
+            return;
+        }
+
+        // The network wants three channels, and decode gives us gray
+        auto start = std::chrono::steady_clock::now();
+        colour_.resize(images.size());
+        for (size_t i = 0; i < images.size(); ++i)
+        {
+            if (images[i].channels() == 1)
+            {
+                cv::cvtColor(images[i], colour_[i], cv::COLOR_GRAY2BGR);
+            }
+            else
+            {
+                colour_[i] = images[i];
+            }
+        }
+        cv::dnn::blobFromImages(colour_, blob_, 1.0, cv::Size(config_.input_size, config_.input_size),
+                                cv::Scalar(104.0, 177.0, 123.0), false, false);
+        auto packed = std::chrono::steady_clock::now();
+        net_.setInput(blob_);
+        cv::Mat output = net_.forward();
+        if (timings)
+        {
+            // A batch is one forward pass; each image is charged its share
+            const double per_image = 1.0 / images.size();
+            const double preprocess = StageTimings::micros(start, packed) * per_image;
+            const double detect = StageTimings::micros(packed, std::chrono::steady_clock::now()) * per_image;
+            timings->preprocess.insert(timings->preprocess.end(), images.size(), preprocess);
+            timings->detect.insert(timings->detect.end(), images.size(), detect);
+        }
+        if (output.dims != 4 || output.size[3] != 7)
+        {
+            return; // Not an SSD-style detection output
+        }
+
+        cv::Mat rows(output.size[2], output.size[3], CV_32F, output.ptr<float>());
+        for (int r = 0; r < rows.rows; ++r)
+        {
+            const float *row = rows.ptr<float>(r);
+            const int index = static_cast<int>(row[0]);
+            if (index < 0 || index >= static_cast<int>(images.size()) || row[2] < config_.confidence)
+            {
+                continue;
+            }
+            const cv::Mat &image = images[index];
+            int x1 = std::clamp(cvRound(row[3] * image.cols), 0, image.cols);
+            int y1 = std::clamp(cvRound(row[4] * image.rows), 0, image.rows);
+            int x2 = std::clamp(cvRound(row[5] * image.cols), 0, image.cols);
+            int y2 = std::clamp(cvRound(row[6] * image.rows), 0, image.rows);
+            if (x2 - x1 < config_.params.min_size || y2 - y1 < config_.params.min_size)
+            {
+                continue;
+            }
+            faces[index].emplace_back(x1, y1, x2 - x1, y2 - y1);
+        }
     }
 
-    // Check if the directory exists
-    if (!fs::exists(dir_path) || !fs::is_directory(dir_path))
+private:
+    DetectorConfig config_;
+    cv::dnn::Net net_;
+    std::vector<cv::Mat> colour_; // Reused between batches
+    cv::Mat blob_;
+};
+
+// Function to create and load the configured detector; reports the problem
+// and returns null if it can't be loaded
+std::unique_ptr<FaceDetector> make_detector(const DetectorConfig &config)
+{
+    if (config.backend == DetectorBackend::Dnn)
     {
-        std::cerr << "The provided path is not a valid directory.\n";
-        return -1;
+        auto detector = std::make_unique<DnnDetector>(config);
+        if (!detector->load())
+        {
+            std::cerr << "Error loading face detection model from: " << config.model_path << std::endl;
+            return nullptr;
+        }
+        return detector;
     }
-
-    // Load the pre-trained Haar Cascade classifier for face detection
-    cv::CascadeClassifier face_cascade;
-    std::string cascade_path = "haarcascade_frontalface_default.xml"; // Adjust the path if necessary
-    if (!face_cascade.load(cv::samples::findFile(cascade_path)))
+    auto detector = std::make_unique<CascadeDetector>(config.params);
+    if (!detector->load(config))
     {
-        std::cerr << "Error loading face cascade from: " << cascade_path << std::endl;
-        return -1;
+        std::cerr << "Error loading face cascade from: "
+                  << (config.cascade_path.empty() ? "the embedded cascade" : config.cascade_path) << std::endl;
+        return nullptr;
     }
+    return detector;
+}
 
-    // Start processing the directory
-    process_directory(dir_path, face_cascade, save_dir);
-
-    std::cout << "Processing completed.\n";
+// Function to read a whole file into memory
+bool read_file(const fs::path &file_path, std::string &contents)
+{
+    std::ifstream in(file_path, std::ios::binary);
+    if (!in)
+    {
+        return false;
+    }
+    std::ostringstream buffer;
+    buffer << in.rdbuf();
+    contents = buffer.str();
+    return static_cast<bool>(in);
+}
+
+// True for the pre-2.4 layout haarcascade_*.xml files still ship in, which
+// CascadeClassifier::read can't take and load() converts on every start
+bool is_old_format_cascade(const std::string &text)
+{
+    return text.find("opencv-haar-classifier") != std::string::npos;
+}
+
+// Function to strip an XML document down to what FileStorage reads: comments
+// go, whitespace between tags goes, and any other run of whitespace becomes a
+// single space
+std::string minify_xml(const std::string &text)
+{
+    std::string out;
+    out.reserve(text.size() / 2);
+    bool pending_space = false;
+    for (size_t i = 0; i < text.size(); ++i)
+    {
+        if (text.compare(i, 4, "<!--") == 0)
+        {
+            size_t end = text.find("-->", i + 4);
+            i = end == std::string::npos ? text.size() : end + 2;
+            continue;
+        }
+        const char c = text[i];
+        if (std::isspace(static_cast<unsigned char>(c)))
+        {
+            pending_space = true;
+            continue;
+        }
+        if (pending_space && !out.empty() && out.back() != '>' && c != '<')
+        {
+            out += ' ';
+        }
+        pending_space = false;
+        out += c;
+    }
+    out += '\n';
+    return out;
+}
+
+// Function to write the compact form of a cascade: converted to the current
+// layout if it is an old one, minified, and checked to load from memory. This
+// is what meson embeds, and what --cascade loads fastest.
+bool compile_cascade(const std::string &source_path, const fs::path &output_path)
+{
+    std::string text;
+    if (!read_file(source_path, text))
+    {
+        std::cerr << "Could not read cascade: " << source_path << std::endl;
+        return false;
+    }
+    if (is_old_format_cascade(text))
+    {
+        fs::path converted = output_path;
+        converted += ".converting.xml";
+        bool ok = cv::CascadeClassifier::convert(source_path, converted.string()) && read_file(converted, text);
+        std::error_code ec;
+        fs::remove(converted, ec);
+        if (!ok)
+        {
+            std::cerr << "Could not convert cascade: " << source_path << std::endl;
+            return false;
+        }
+    }
+
+    DetectorConfig config;
+    config.cascade_text = std::make_shared<const std::string>(minify_xml(text));
+    CascadeDetector check(config.params);
+    if (!check.load(config))
+    {
+        std::cerr << "The compacted cascade does not load: " << source_path << std::endl;
+        return false;
+    }
+
+    std::ofstream out(output_path, std::ios::binary | std::ios::trunc);
+    out << *config.cascade_text;
+    if (!out.flush())
+    {
+        std::cerr << "Could not write compact cascade: " << output_path << std::endl;
+        return false;
+    }
+    std::cout << "Wrote compact cascade (" << config.cascade_text->size() << " of " << text.size()
+              << " bytes) to: " << output_path << "\n";
+    return true;
+}
+
+// Function to append a path to a JSON document as a quoted string
+void append_json_string(std::string &out, const std::string &value)
+{
+    out += '"';
+    for (char c : value)
+    {
+        switch (c)
+        {
+        case '"':
+            out += "\\\"";
+            break;
+        case '\\':
+            out += "\\\\";
+            break;
+        case '\n':
+            out += "\\n";
+            break;
+        case '\t':
+            out += "\\t";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20)
+            {
+                char escaped[8];
+                std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned char>(c));
+                out += escaped;
+            }
+            else
+            {
+                out += c;
+            }
+        }
+    }
+    out += '"';
+}
+
+// Function to append a CSV field, quoting it only when it needs quoting
+void append_csv_field(std::string &out, const std::string &value)
+{
+    if (value.find_first_of(",\"\r\n") == std::string::npos)
+    {
+        out += value;
+        return;
+    }
+    out += '"';
+    for (char c : value)
+    {
+        if (c == '"')
+        {
+            out += '"';
+        }
+        out += c;
+    }
+    out += '"';
+}
+
+// Function to format a scale factor compactly (1, 0.5, 6.72)
+std::string format_scale(double scale)
+{
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), "%.4g", scale);
+    return buffer;
+}
+
+// A face rectangle mapped from decoded to source coordinates
+cv::Rect to_source(const cv::Rect &face, double scale)
+{
+    return cv::Rect(cvRound(face.x * scale), cvRound(face.y * scale),
+                    cvRound(face.width * scale), cvRound(face.height * scale));
+}
+
+// Function to append one result as a record in the chosen format. Sizes and
+// rectangles are reported in the source image's own pixels.
+void format_result(const DetectionResult &result, OutputFormat format, std::string &out)
+{
+    const std::string path = result.path.string();
+    const std::string width = std::to_string(result.source_size.width);
+    const std::string height = std::to_string(result.source_size.height);
+    switch (format)
+    {
+    case OutputFormat::Text:
+    {
+        std::ostringstream text;
+        text << "Processing image: " << result.path << "\n";
+        if (!result.faces.empty())
+        {
+            text << "Faces detected: " << result.faces.size() << "\n";
+            for (const auto &face : result.faces)
+            {
+                cv::Rect rect = to_source(face, result.scale);
+                text << "Face at: x=" << rect.x << ", y=" << rect.y
+                     << ", width=" << rect.width << ", height=" << rect.height << "\n";
+            }
+        }
+        else
+        {
+            text << "No faces detected.\n";
+        }
+        out += text.str();
+        break;
+    }
+    case OutputFormat::Jsonl:
+    {
+        out += "{\"path\":";
+        append_json_string(out, path);
+        out += ",\"width\":" + width + ",\"height\":" + height + ",\"scale\":" + format_scale(result.scale) + ",\"faces\":[";
+        for (size_t i = 0; i < result.faces.size(); ++i)
+        {
+            cv::Rect rect = to_source(result.faces[i], result.scale);
+            out += i == 0 ? "{" : ",{";
+            out += "\"x\":" + std::to_string(rect.x) + ",\"y\":" + std::to_string(rect.y) +
+                   ",\"width\":" + std::to_string(rect.width) + ",\"height\":" + std::to_string(rect.height) + "}";
+        }
+        out += "]}\n";
+        break;
+    }
+    case OutputFormat::Csv:
+    {
+        // An image with no faces still gets a row, with the face columns empty
+        std::string prefix;
+        append_csv_field(prefix, path);
+        prefix += "," + width + "," + height + "," + format_scale(result.scale) + ",";
+        if (result.faces.empty())
+        {
+            out += prefix + ",,,\n";
+        }
+        for (const auto &face : result.faces)
+        {
+            cv::Rect rect = to_source(face, result.scale);
+            out += prefix + std::to_string(rect.x) + "," + std::to_string(rect.y) + "," +
+                   std::to_string(rect.width) + "," + std::to_string(rect.height) + "\n";
+        }
+        break;
+    }
+    }
+}
+
+// Buffered sink for the results stream. Records are formatted into a local
+// buffer that is handed over in large chunks to one output thread, so the
+// reporting thread never waits on the disk or terminal and no line is flushed
+// on its own.
+class ResultSink
+{
+public:
+    ResultSink(OutputFormat format, const fs::path &output_path) : format_(format)
+    {
+        if (!output_path.empty())
+        {
+            file_.open(output_path, std::ios::binary | std::ios::trunc);
+            if (!file_)
+            {
+                std::cerr << "Could not open results file: " << output_path << std::endl;
+                return;
+            }
+            out_ = &file_;
+        }
+        if (format_ == OutputFormat::Csv)
+        {
+            pending_ = csv_header + "\n";
+        }
+        thread_ = std::thread([this] { run(); });
+    }
+
+    ~ResultSink() { close(); }
+
+    bool is_open() const { return thread_.joinable(); }
+
+    void write(const DetectionResult &result)
+    {
+        format_result(result, format_, pending_);
+        if (pending_.size() >= chunk_size)
+        {
+            hand_over();
+        }
+    }
+
+    // Function to write and flush everything so far before returning; only
+    // needed before blocking on the user
+    void sync()
+    {
+        if (!is_open())
+        {
+            return;
+        }
+        hand_over();
+        size_t target;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            target = ++handed_;
+        }
+        chunks_.push(std::string()); // An empty chunk asks for a flush
+        std::unique_lock<std::mutex> lock(mutex_);
+        written_cv_.wait(lock, [&] { return written_ >= target; });
+    }
+
+    void close()
+    {
+        if (!is_open())
+        {
+            return;
+        }
+        hand_over();
+        chunks_.close();
+        thread_.join();
+        out_->flush();
+        if (!*out_)
+        {
+            std::cerr << "Error writing results" << std::endl;
+        }
+    }
+
+private:
+    static constexpr size_t chunk_size = 1 << 16;
+
+    void hand_over()
+    {
+        if (pending_.empty())
+        {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++handed_;
+        }
+        chunks_.push(std::move(pending_));
+        pending_.clear();
+        pending_.reserve(chunk_size + 4096);
+    }
+
+    void run()
+    {
+        std::string chunk;
+        while (chunks_.pop(chunk))
+        {
+            if (chunk.empty())
+            {
+                out_->flush();
+            }
+            else
+            {
+                out_->write(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ++written_;
+            }
+            written_cv_.notify_all();
+        }
+    }
+
+    OutputFormat format_;
+    std::ofstream file_;
+    std::ostream *out_ = &std::cout;
+    std::string pending_;
+    BoundedQueue<std::string> chunks_{8};
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable written_cv_;
+    size_t handed_ = 0;
+    size_t written_ = 0;
+};
+
+// Function to express file_path relative to root, with both made absolute and
+// normalised first so that relative and absolute spellings of the same file
+// agree; false unless the file lies strictly below root
+bool relative_to_root(const fs::path &file_path, const fs::path &root, fs::path &relative)
+{
+    std::error_code ec;
+    fs::path absolute_root = fs::absolute(root, ec).lexically_normal();
+    if (ec)
+    {
+        return false;
+    }
+    fs::path absolute_file = fs::absolute(file_path, ec).lexically_normal();
+    if (ec)
+    {
+        return false;
+    }
+    if (!absolute_root.has_filename() && absolute_root.has_relative_path())
+    {
+        absolute_root = absolute_root.parent_path(); // "photos/" -> "photos"
+    }
+    relative = absolute_file.lexically_relative(absolute_root);
+    return !relative.empty() && relative != "." && *relative.begin() != "..";
+}
+
+// An annotated image waiting to be encoded
+struct AnnotatedImage
+{
+    fs::path save_path;
+    cv::Mat image;
+};
+
+// Small pool that encodes and writes annotated images off the reporting
+// thread. Images keep their path relative to the scanned directory, so two
+// photos with the same name in different folders don't overwrite each other;
+// an image outside that directory is never saved, so nothing is written
+// outside save_dir.
+class AnnotatedImageWriter
+{
+public:
+    AnnotatedImageWriter(const fs::path &source_root, const fs::path &save_dir, unsigned threads)
+        : source_root_(source_root), save_dir_(save_dir), queue_(threads * 2)
+    {
+        for (unsigned i = 0; i < threads; ++i)
+        {
+            threads_.emplace_back([this] { run(); });
+        }
+    }
+
+    ~AnnotatedImageWriter() { close(); }
+
+    void submit(const fs::path &source_path, cv::Mat image)
+    {
+        fs::path relative;
+        if (!relative_to_root(source_path, source_root_, relative))
+        {
+            std::cerr << "Not saving an annotated copy of an image outside " << source_root_ << ": " << source_path
+                      << std::endl;
+            return;
+        }
+        queue_.push(AnnotatedImage{save_dir_ / relative, std::move(image)});
+    }
+
+    void close()
+    {
+        queue_.close();
+        for (auto &thread : threads_)
+        {
+            thread.join();
+        }
+        threads_.clear();
+    }
+
+private:
+    void run()
+    {
+        AnnotatedImage item;
+        while (queue_.pop(item))
+        {
+            std::error_code ec;
+            fs::create_directories(item.save_path.parent_path(), ec); // Create the directory if it doesn't exist
+            bool saved = false;
+            try
+            {
+                saved = cv::imwrite(item.save_path.string(), item.image);
+            }
+            catch (const cv::Exception &e)
+            {
+                std::cerr << e.what() << std::endl;
+            }
+            if (!saved)
+            {
+                std::cerr << "Failed to save the image to: " << item.save_path << std::endl;
+            }
+        }
+    }
+
+    fs::path source_root_;
+    fs::path save_dir_;
+    BoundedQueue<AnnotatedImage> queue_;
+    std::vector<std::thread> threads_;
+};
+
+// FNV-1a, 64 bit; pass the previous result as hash to continue a running hash
+uint64_t fnv1a(const char *data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Function to pick the cascade to run: the --cascade file if one was given,
+// else the copy meson compiled into the binary, else the stock XML looked up
+// the way the OpenCV samples do it. A compact (or otherwise current-layout)
+// file is kept in memory so every detection thread loads it from there.
+bool load_cascade_source(DetectorConfig &config, const std::string &cascade_file)
+{
+    if (!cascade_file.empty())
+    {
+        config.cascade_path = cascade_file;
+    }
+    else
+    {
+#ifdef FACE_DETECTION_EMBEDDED_CASCADE
+        config.cascade_text = std::make_shared<const std::string>(reinterpret_cast<const char *>(embedded_cascade),
+                                                                  embedded_cascade_size);
+        return true;
+#else
+        std::string cascade_path = "haarcascade_frontalface_default.xml"; // Adjust the path if necessary
+        config.cascade_path = cv::samples::findFile(cascade_path);
+#endif
+    }
+
+    std::string text;
+    if (!read_file(config.cascade_path, text))
+    {
+        std::cerr << "Could not read cascade: " << config.cascade_path << std::endl;
+        return false;
+    }
+    if (!is_old_format_cascade(text))
+    {
+        config.cascade_text = std::make_shared<const std::string>(std::move(text));
+    }
+    return true;
+}
+
+// Function to hash everything a cached result depends on: the backend, the
+// bytes of the cascade or model it loads (a retrained file with the same name
+// must not reuse results), the detector parameters and the decode height
+uint64_t detection_settings_hash(const DetectorConfig &config)
+{
+    uint64_t hash = fnv1a(nullptr, 0);
+    auto mix = [&hash](const char *data, size_t size) { hash = fnv1a(data, size, hash); };
+
+    const bool dnn = config.backend == DetectorBackend::Dnn;
+    if (!dnn && config.cascade_text)
+    {
+        mix(config.cascade_text->data(), config.cascade_text->size());
+    }
+    for (const std::string &path : dnn ? std::vector<std::string>{config.model_path, config.model_config}
+                                       : config.cascade_text ? std::vector<std::string>{}
+                                                             : std::vector<std::string>{config.cascade_path})
+    {
+        std::ifstream in(path, std::ios::binary);
+        char buffer[1 << 16];
+        while (in.read(buffer, sizeof(buffer)) || in.gcount() > 0)
+        {
+            mix(buffer, static_cast<size_t>(in.gcount()));
+        }
+    }
+
+    const DetectionParams &params = config.params;
+    char settings[160];
+    int length = dnn ? std::snprintf(settings, sizeof(settings), "|dnn|%.9g|%d|%d|%d", config.confidence,
+                                     config.input_size, params.min_size, detection_max_height)
+                     : std::snprintf(settings, sizeof(settings), "|cascade|%.17g|%d|%d|%d|%d", params.scale_factor,
+                                     params.min_neighbors, params.min_size, params.max_height, detection_max_height);
+    mix(settings, static_cast<size_t>(length));
+    return hash;
+}
+
+// On-disk cache of detection results, so a re-scan only decodes and detects
+// files that are new or changed. One text line per file:
+//
+//   <inode> <size> <mtime_ns> <width> <height> <scale> <count> [<x> <y> <w> <h>]...
+//
+// after a header naming the settings hash. The loaded table is read-only while
+// the pipeline runs (the walker looks up, nothing inserts), and new results
+// are appended as they are reported, so an interrupted run keeps what it
+// finished. close() rewrites the file without entries this run never saw,
+// such as files since modified or deleted.
+class DetectionCache
+{
+public:
+    // Function to load path if it was written with the same settings; a
+    // missing, foreign or mismatched file just means an empty cache
+    bool open(const fs::path &path, uint64_t settings_hash)
+    {
+        path_ = path;
+        char header[64];
+        std::snprintf(header, sizeof(header), "face_detection cache 1 %016llx",
+                      static_cast<unsigned long long>(settings_hash));
+        header_ = header;
+
+        bool reuse = false;
+        {
+            std::ifstream in(path_);
+            std::string line;
+            if (in && std::getline(in, line) && line == header_)
+            {
+                reuse = true;
+                while (std::getline(in, line))
+                {
+                    parse_line(line);
+                }
+            }
+        }
+
+        out_.open(path_, reuse ? std::ios::app : std::ios::trunc);
+        if (!out_)
+        {
+            std::cerr << "Could not open detection cache: " << path_ << std::endl;
+            return false;
+        }
+        if (!reuse)
+        {
+            out_ << header_ << "\n";
+        }
+        return true;
+    }
+
+    bool is_open() const { return out_.is_open(); }
+
+    size_t size() const { return entries_.size(); }
+
+    // Walker thread only
+    const CachedDetection *find(const FileKey &key)
+    {
+        auto it = entries_.find(key);
+        if (it == entries_.end())
+        {
+            return nullptr;
+        }
+        it->second.used = true;
+        return &it->second;
+    }
+
+    // Writer thread only
+    void record(const DetectionResult &result)
+    {
+        std::string line;
+        format_line(result.key, result.source_size, result.scale, result.faces, line);
+        out_ << line;
+        added_.push_back(std::move(line));
+    }
+
+    // Function to finish the cache once the pipeline has stopped; the file is
+    // compacted only when it holds entries this run didn't touch
+    void close()
+    {
+        if (!is_open())
+        {
+            return;
+        }
+        out_.close();
+        bool stale = std::any_of(entries_.begin(), entries_.end(), [](const auto &entry) { return !entry.second.used; });
+        if (!stale)
+        {
+            return;
+        }
+
+        fs::path temp_path = path_;
+        temp_path += ".tmp";
+        {
+            std::ofstream out(temp_path, std::ios::trunc);
+            out << header_ << "\n";
+            std::string line;
+            for (const auto &[key, entry] : entries_)
+            {
+                if (entry.used)
+                {
+                    line.clear();
+                    format_line(key, entry.source_size, entry.scale, entry.faces, line);
+                    out << line;
+                }
+            }
+            for (const auto &added : added_)
+            {
+                out << added;
+            }
+            if (!out.flush())
+            {
+                std::cerr << "Error writing detection cache: " << temp_path << std::endl;
+                return;
+            }
+        }
+        std::error_code ec;
+        fs::rename(temp_path, path_, ec);
+        if (ec)
+        {
+            std::cerr << "Error replacing detection cache: " << ec.message() << std::endl;
+        }
+    }
+
+private:
+    static void format_line(const FileKey &key, const cv::Size &source_size, double scale,
+                            const std::vector<cv::Rect> &faces, std::string &line)
+    {
+        char buffer[160];
+        std::snprintf(buffer, sizeof(buffer), "%llu %llu %lld %d %d %.17g %zu",
+                      static_cast<unsigned long long>(key.inode), static_cast<unsigned long long>(key.size),
+                      static_cast<long long>(key.mtime_ns), source_size.width, source_size.height, scale,
+                      faces.size());
+        line += buffer;
+        for (const auto &face : faces)
+        {
+            std::snprintf(buffer, sizeof(buffer), " %d %d %d %d", face.x, face.y, face.width, face.height);
+            line += buffer;
+        }
+        line += '\n';
+    }
+
+    // A line cut short by a crash fails to parse and is simply skipped
+    void parse_line(const std::string &line)
+    {
+        std::istringstream in(line);
+        FileKey key;
+        CachedDetection entry;
+        size_t count = 0;
+        if (!(in >> key.inode >> key.size >> key.mtime_ns >> entry.source_size.width >> entry.source_size.height >>
+              entry.scale >> count) ||
+            count > 4096)
+        {
+            return;
+        }
+        entry.faces.resize(count);
+        for (auto &face : entry.faces)
+        {
+            if (!(in >> face.x >> face.y >> face.width >> face.height))
+            {
+                return;
+            }
+        }
+        entries_[key] = std::move(entry);
+    }
+
+    fs::path path_;
+    std::string header_;
+    std::unordered_map<FileKey, CachedDetection, FileKeyHash> entries_;
+    std::ofstream out_;
+    std::vector<std::string> added_;
+};
+
+// Function to report the result of one image; runs on the writer (main) thread,
+// which is also the only thread allowed to use HighGUI windows
+void report_result(DetectionResult &result, const DetectionOptions &options, ResultSink &sink,
+                   AnnotatedImageWriter *images)
+{
+    sink.write(result);
+    if (result.faces.empty())
+    {
+        return;
+    }
+
+    if (result.image.empty())
+    {
+        return; // Reported from the cache without decoding
+    }
+
+    // Draw rectangles around detected faces
+    for (const auto &face : result.faces)
+    {
+        cv::rectangle(result.image, face, cv::Scalar(255, 0, 0), 2);
+    }
+
+    if (!options.batch)
+    {
+        cv::imshow("Detected Faces", result.image);
+
+        // The prompt goes to stderr so it can't end up inside a results stream
+        sink.sync();
+        std::cerr << "Press any key to continue to the next image..." << std::endl;
+        cv::waitKey(0); // Wait for a key press
+    }
+
+    // Save the image with detected faces to the save directory
+    if (images)
+    {
+        images->submit(result.path, std::move(result.image));
+    }
+}
+
+// Function to read the latency at quantile q (0..1) of samples, nearest rank
+double percentile(std::vector<double> &samples, double q)
+{
+    if (samples.empty())
+    {
+        return 0.0;
+    }
+    size_t rank = std::min(samples.size() - 1, static_cast<size_t>(q * samples.size()));
+    std::nth_element(samples.begin(), samples.begin() + rank, samples.end());
+    return samples[rank];
+}
+
+// Totals of a --profile run, merged from every pipeline thread's StageTimings
+class PipelineProfile
+{
+public:
+    void merge(const StageTimings &timings)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        totals_.merge(timings);
+    }
+
+    // Function to print the profile to stderr, leaving stdout to the results:
+    // throughput, peak RSS, then p50/p99/mean per stage and the pyramid levels
+    // the cascade evaluated. Cached images count toward images/sec but have
+    // no decode or detect samples.
+    void report(size_t images, double seconds)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        struct rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        char line[160];
+        std::snprintf(line, sizeof(line), "Profile: %zu images in %.2f s (%.1f images/s), peak RSS %.1f MiB\n", images,
+                      seconds, images / std::max(seconds, 1e-9), usage.ru_maxrss / 1024.0);
+        std::cerr << line;
+        std::snprintf(line, sizeof(line), "%-12s %10s %10s %10s %10s %12s\n", "stage", "count", "p50 ms", "p99 ms",
+                      "mean ms", "total s");
+        std::cerr << line;
+
+        const std::pair<const char *, std::vector<double> *> stages[] = {
+            {"decode", &totals_.decode},
+            {"preprocess", &totals_.preprocess},
+            {"detect", &totals_.detect},
+            {"output", &totals_.output}};
+        for (const auto &[name, samples] : stages)
+        {
+            double total = 0.0;
+            for (double sample : *samples)
+            {
+                total += sample;
+            }
+            double mean = samples->empty() ? 0.0 : total / samples->size();
+            std::snprintf(line, sizeof(line), "%-12s %10zu %10.3f %10.3f %10.3f %12.3f\n", name, samples->size(),
+                          percentile(*samples, 0.5) / 1000.0, percentile(*samples, 0.99) / 1000.0, mean / 1000.0,
+                          total / 1e6);
+            std::cerr << line;
+        }
+        if (totals_.pyramid_levels != 0)
+        {
+            std::snprintf(line, sizeof(line), "Pyramid levels evaluated: %llu (%.2f per detected image)\n",
+                          static_cast<unsigned long long>(totals_.pyramid_levels),
+                          static_cast<double>(totals_.pyramid_levels) / std::max<size_t>(totals_.detect.size(), 1));
+            std::cerr << line;
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    StageTimings totals_;
+};
+
+// Function to decide whether a file belongs to this node's shard. Files are
+// spread by a hash of their path relative to the scanned directory (as given
+// by relative_to_root), so nodes that mount the archive in different places
+// still agree on the split, and the same file always lands in the same shard.
+bool in_shard(const fs::path &relative, unsigned shard_index, unsigned shard_count)
+{
+    if (shard_count <= 1)
+    {
+        return true;
+    }
+    const std::string key = relative.generic_string();
+    return fnv1a(key.data(), key.size()) % shard_count == shard_index;
+}
+
+// Function to hand every file named in a manifest to submit: one path per
+// line, relative to root unless absolute. Entries are taken as given; nothing
+// is filtered by extension.
+template <typename Submit>
+void read_manifest(std::istream &in, const fs::path &root, Submit &&submit)
+{
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.pop_back();
+        }
+        if (line.empty())
+        {
+            continue;
+        }
+        fs::path entry = line;
+        submit(entry.is_absolute() ? entry : root / entry);
+    }
+}
+
+// Function to process every image below dir_path through a bounded pipeline:
+// one walker, a pool of decoders, a pool of detectors each holding its own
+// FaceDetector (neither a CascadeClassifier nor a dnn::Net may be shared
+// between threads), and the calling thread as the single writer. A DNN on an
+// accelerator gets a single detection thread that feeds it whole batches.
+// Results are reported in the order they finish, not in walk order. With a
+// cache, unchanged files skip decode and detection, unless their pixels are
+// still needed for display or saving. Given a manifest, the files it lists
+// are processed instead of walking; those outside dir_path are skipped.
+void process_directory(const fs::path &dir_path, const DetectorConfig &detector_config,
+                       const DetectionOptions &options, ResultSink &sink, DetectionCache *cache,
+                       std::istream *manifest)
+{
+    const auto started = std::chrono::steady_clock::now();
+    std::error_code ec;
+    const fs::path root = fs::absolute(dir_path, ec).lexically_normal(); // Once, not per file
+    std::unique_ptr<PipelineProfile> profile;
+    if (options.profile)
+    {
+        profile = std::make_unique<PipelineProfile>();
+    }
+    const unsigned jobs = std::max(1u, options.jobs);
+    const bool accelerated = detector_config.backend == DetectorBackend::Dnn && detector_config.target != DnnTarget::Cpu;
+    const unsigned detector_threads = accelerated ? 1 : jobs;
+    const bool keep_pixels = !options.batch || !options.save_dir.empty();
+    BoundedQueue<ScanItem> paths(jobs * 4);
+    BoundedQueue<DecodedImage> decoded(std::max<size_t>(jobs * 2, detector_config.batch_size * 2));
+    BoundedQueue<DetectionResult> results(jobs * 2);
+
+    // Our own pools already keep every core busy; OpenCV's internal
+    // parallel_for inside each stage would only oversubscribe them
+    if (jobs > 1)
+    {
+        cv::setNumThreads(1);
+    }
+
+    std::thread walker([&] {
+        auto submit = [&](const fs::path &file_path) {
+            // Only a manifest can name files outside the directory; they have
+            // no shard key and no place under save_dir
+            fs::path relative;
+            if (!relative_to_root(file_path, root, relative))
+            {
+                std::cerr << "Skipping a file outside " << dir_path << ": " << file_path << std::endl;
+                return;
+            }
+            if (!in_shard(relative, options.shard_index, options.shard_count))
+            {
+                return;
+            }
+            ScanItem item{file_path, {}, nullptr};
+            if (cache && read_file_key(item.path, item.key))
+            {
+                item.cached = cache->find(item.key);
+                if (item.cached && (item.cached->faces.empty() || !keep_pixels))
+                {
+                    // Nothing left to do but report it
+                    results.push(DetectionResult{item.path, cv::Mat(), item.cached->source_size,
+                                                 item.cached->scale, item.cached->faces, item.key, true});
+                    return;
+                }
+            }
+            paths.push(std::move(item));
+        };
+
+        try
+        {
+            if (manifest)
+            {
+                read_manifest(*manifest, dir_path, submit);
+            }
+            else
+            {
+                for (const auto &entry : fs::recursive_directory_iterator(dir_path))
+                {
+                    // Check if the file is an image
+                    if (fs::is_regular_file(entry) && is_image(entry.path()))
+                    {
+                        submit(entry.path());
+                    }
+                }
+            }
+        }
+        catch (const std::exception &e)
+        {
+            std::cerr << "Error processing directory: " << e.what() << std::endl;
+        }
+        paths.close();
+    });
+
+    std::vector<std::thread> decoders;
+    for (unsigned i = 0; i < jobs; ++i)
+    {
+        decoders.emplace_back([&] {
+            StageTimings timings;
+            ScanItem item;
+            while (paths.pop(item))
+            {
+                // Load the image
+                cv::Size source_size;
+                auto start = std::chrono::steady_clock::now();
+                cv::Mat image = decode_image(item.path, detection_max_height, source_size);
+                if (profile)
+                {
+                    timings.decode.push_back(StageTimings::micros(start, std::chrono::steady_clock::now()));
+                }
+                if (image.empty())
+                {
+                    std::cerr << "Could not open or find the image: " << item.path << std::endl;
+                    continue;
+                }
+                double scale = static_cast<double>(source_size.height) / image.rows;
+                decoded.push(DecodedImage{item.path, image, source_size, scale, item.key, item.cached});
+            }
+            if (profile)
+            {
+                profile->merge(timings);
+            }
+        });
+    }
+
+    std::vector<std::thread> detectors;
+    for (unsigned i = 0; i < detector_threads; ++i)
+    {
+        detectors.emplace_back([&] {
+            std::unique_ptr<FaceDetector> detector = make_detector(detector_config);
+            const size_t batch_size = detector ? detector->batch_size() : 1;
+            StageTimings timings;
+            if (detector && profile)
+            {
+                detector->timings = &timings;
+            }
+            std::vector<DecodedImage> batch;
+            std::vector<cv::Mat> images;
+            std::vector<std::vector<cv::Rect>> faces;
+            while (decoded.pop_batch(batch, batch_size))
+            {
+                // Detect faces in every image the cache couldn't answer for
+                images.clear();
+                for (const auto &item : batch)
+                {
+                    if (!item.cached)
+                    {
+                        images.push_back(item.image);
+                    }
+                }
+                faces.assign(images.size(), {});
+                if (detector && !images.empty())
+                {
+                    detector->detect(images, faces);
+                }
+
+                size_t next = 0;
+                for (auto &item : batch)
+                {
+                    DetectionResult result{item.path, item.image, item.source_size, item.scale, {}, item.key, false};
+                    if (item.cached)
+                    {
+                        result.faces = item.cached->faces;
+                        result.from_cache = true;
+                    }
+                    else
+                    {
+                        result.faces = std::move(faces[next++]);
+                    }
+                    results.push(std::move(result));
+                }
+            }
+            if (profile)
+            {
+                profile->merge(timings);
+            }
+        });
+    }
+
+    // Close each queue once every producer feeding it has finished
+    std::thread closer([&] {
+        walker.join();
+        for (auto &thread : decoders)
+        {
+            thread.join();
+        }
+        decoded.close();
+        for (auto &thread : detectors)
+        {
+            thread.join();
+        }
+        results.close();
+    });
+
+    // Encoding a capped-height image is cheap next to detecting in it, so a
+    // quarter of the pool keeps up
+    std::unique_ptr<AnnotatedImageWriter> images;
+    if (!options.save_dir.empty())
+    {
+        images = std::make_unique<AnnotatedImageWriter>(root, options.save_dir, std::max(1u, jobs / 4));
+    }
+
+    StageTimings timings;
+    size_t reported = 0;
+    DetectionResult result;
+    while (results.pop(result))
+    {
+        auto start = std::chrono::steady_clock::now();
+        if (cache && !result.from_cache && result.key.inode != 0)
+        {
+            cache->record(result);
+        }
+        report_result(result, options, sink, images.get());
+        if (profile)
+        {
+            timings.output.push_back(StageTimings::micros(start, std::chrono::steady_clock::now()));
+        }
+        ++reported;
+    }
+    closer.join();
+    if (images)
+    {
+        images->close();
+    }
+    sink.close();
+
+    if (profile)
+    {
+        profile->merge(timings);
+        profile->report(reported, std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+    }
+}
+
+// An image from the labeled sample set, decoded once and kept in memory so
+// that every setting in the sweep times detection alone
+struct LabeledImage
+{
+    fs::path path;
+    cv::Mat image;
+    double scale = 1.0;            // Source pixels per decoded pixel
+    std::vector<cv::Rect> faces;   // Ground truth, in source pixels
+};
+
+// Function to read a labels file: one "path,x,y,width,height" line per face,
+// or just "path" for an image with none, with paths relative to root. The
+// four numbers are taken from the end of the line, so paths may contain
+// commas; a "path,..." header, blank lines and lines starting with # are skipped.
+bool load_labels(const fs::path &labels_path, const fs::path &root, std::vector<LabeledImage> &images)
+{
+    std::ifstream in(labels_path);
+    if (!in)
+    {
+        std::cerr << "Could not open labels file: " << labels_path << std::endl;
+        return false;
+    }
+
+    std::unordered_map<std::string, size_t> index;
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.pop_back();
+        }
+        if (line.empty() || line[0] == '#' || line.rfind("path,", 0) == 0)
+        {
+            continue;
+        }
+
+        // Peel up to four integers off the end
+        std::string name = line;
+        int values[4];
+        int found = 0;
+        while (found < 4)
+        {
+            size_t comma = name.rfind(',');
+            if (comma == std::string::npos)
+            {
+                break;
+            }
+            const std::string field = name.substr(comma + 1);
+            char *end = nullptr;
+            long value = std::strtol(field.c_str(), &end, 10);
+            if (field.empty() || *end != '\0')
+            {
+                break;
+            }
+            values[3 - found++] = static_cast<int>(value);
+            name.erase(comma);
+        }
+        if (found != 0 && found != 4)
+        {
+            std::cerr << "Malformed label line: " << line << std::endl;
+            return false;
+        }
+
+        auto [it, inserted] = index.emplace(name, images.size());
+        if (inserted)
+        {
+            images.push_back(LabeledImage{root / name, cv::Mat(), 1.0, {}});
+        }
+        if (found == 4)
+        {
+            images[it->second].faces.emplace_back(values[0], values[1], values[2], values[3]);
+        }
+    }
+
+    for (auto &labeled : images)
+    {
+        cv::Size source_size;
+        labeled.image = decode_image(labeled.path, detection_max_height, source_size);
+        if (labeled.image.empty())
+        {
+            std::cerr << "Could not open or find the image: " << labeled.path << std::endl;
+            return false;
+        }
+        labeled.scale = static_cast<double>(source_size.height) / labeled.image.rows;
+    }
+    return true;
+}
+
+// Intersection over union of two rectangles
+double overlap(const cv::Rect &a, const cv::Rect &b)
+{
+    const int x1 = std::max(a.x, b.x);
+    const int y1 = std::max(a.y, b.y);
+    const int x2 = std::min(a.x + a.width, b.x + b.width);
+    const int y2 = std::min(a.y + a.height, b.y + b.height);
+    if (x2 <= x1 || y2 <= y1)
+    {
+        return 0.0;
+    }
+    const double intersection = static_cast<double>(x2 - x1) * (y2 - y1);
+    return intersection / (static_cast<double>(a.area()) + b.area() - intersection);
+}
+
+// Function to count the labeled faces that a detection covers with an IoU of
+// at least one half; each labeled face and each detection is used once
+size_t match_faces(const std::vector<cv::Rect> &found, const std::vector<cv::Rect> &truth)
+{
+    std::vector<bool> taken(found.size(), false);
+    size_t matched = 0;
+    for (const auto &face : truth)
+    {
+        double best = 0.5;
+        size_t best_index = found.size();
+        for (size_t i = 0; i < found.size(); ++i)
+        {
+            double iou = taken[i] ? 0.0 : overlap(face, found[i]);
+            if (iou >= best)
+            {
+                best = iou;
+                best_index = i;
+            }
+        }
+        if (best_index < found.size())
+        {
+            taken[best_index] = true;
+            ++matched;
+        }
+    }
+    return matched;
+}
+
+// Function to time every setting of the sweep grid over the labeled images and
+// print images/sec against recall and precision, then the fastest setting
+// that reaches the target recall. Decoding is done once up front and isn't
+// part of the timings.
+int run_sweep(const SweepConfig &sweep, const DetectorConfig &base_config, const fs::path &root, unsigned jobs)
+{
+    std::vector<LabeledImage> images;
+    if (!load_labels(sweep.labels_path, root, images))
+    {
+        return -1;
+    }
+    size_t labeled_faces = 0;
+    for (const auto &labeled : images)
+    {
+        labeled_faces += labeled.faces.size();
+    }
+    if (labeled_faces == 0)
+    {
+        std::cerr << "The labels file names no faces to measure recall against.\n";
+        return -1;
+    }
+    jobs = std::max(1u, std::min<unsigned>(jobs, static_cast<unsigned>(images.size())));
+    if (jobs > 1)
+    {
+        cv::setNumThreads(1);
+    }
+    std::cout << "Sweeping " << images.size() << " images with " << labeled_faces << " labeled faces on "
+              << jobs << " threads\n\n";
+
+    struct Row
+    {
+        DetectionParams params;
+        double images_per_second;
+        double recall;
+        double precision;
+    };
+    std::vector<Row> rows;
+    std::vector<std::vector<cv::Rect>> found(images.size());
+
+    std::printf("%-8s %-10s %-9s %10s %8s %10s\n", "scale", "neighbors", "min_size", "images/s", "recall", "precision");
+    std::fflush(stdout);
+    for (double scale_factor : sweep.scale_factors)
+    {
+        for (int min_neighbors : sweep.min_neighbors)
+        {
+            for (int min_size : sweep.min_sizes)
+            {
+                DetectorConfig config = base_config;
+                config.params.scale_factor = scale_factor;
+                config.params.min_neighbors = min_neighbors;
+                config.params.min_size = min_size;
+
+                // Every thread loads its detector before the clock starts
+                std::vector<std::unique_ptr<FaceDetector>> detectors;
+                for (unsigned i = 0; i < jobs; ++i)
+                {
+                    detectors.push_back(make_detector(config));
+                    if (!detectors.back())
+                    {
+                        return -1;
+                    }
+                }
+
+                std::atomic<size_t> next{0};
+                auto start = std::chrono::steady_clock::now();
+                std::vector<std::thread> threads;
+                for (unsigned i = 0; i < jobs; ++i)
+                {
+                    threads.emplace_back([&, detector = detectors[i].get()] {
+                        std::vector<cv::Mat> one(1);
+                        std::vector<std::vector<cv::Rect>> faces;
+                        for (size_t n; (n = next.fetch_add(1)) < images.size();)
+                        {
+                            one[0] = images[n].image;
+                            detector->detect(one, faces);
+                            found[n] = std::move(faces[0]);
+                        }
+                    });
+                }
+                for (auto &thread : threads)
+                {
+                    thread.join();
+                }
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+                size_t matched = 0;
+                size_t detections = 0;
+                for (size_t n = 0; n < images.size(); ++n)
+                {
+                    std::vector<cv::Rect> in_source;
+                    for (const auto &face : found[n])
+                    {
+                        in_source.push_back(to_source(face, images[n].scale));
+                    }
+                    matched += match_faces(in_source, images[n].faces);
+                    detections += in_source.size();
+                }
+                Row row{config.params, images.size() / std::max(seconds, 1e-9),
+                        static_cast<double>(matched) / labeled_faces,
+                        detections ? static_cast<double>(matched) / detections : 1.0};
+                rows.push_back(row);
+                std::printf("%-8.3g %-10d %-9d %10.1f %8.3f %10.3f\n", scale_factor, min_neighbors, min_size,
+                            row.images_per_second, row.recall, row.precision);
+                std::fflush(stdout);
+            }
+        }
+    }
+
+    const Row *best = nullptr;
+    for (const auto &row : rows)
+    {
+        if (row.recall >= sweep.target_recall && (!best || row.images_per_second > best->images_per_second))
+        {
+            best = &row;
+        }
+    }
+    std::cout << "\n";
+    if (!best)
+    {
+        std::cout << "No setting reached a recall of " << sweep.target_recall << ".\n";
+        return 1;
+    }
+    std::cout << "Fastest setting with recall >= " << sweep.target_recall << ": --scale-factor "
+              << best->params.scale_factor << " --min-neighbors " << best->params.min_neighbors << " --min-size "
+              << best->params.min_size << " (" << static_cast<int>(best->images_per_second) << " images/s, recall "
+              << best->recall << ")\n";
+    return 0;
+}
+
+// Function to parse a comma-separated list of numbers into values; false if
+// any element isn't a number or fails the check
+template <typename T, typename Check>
+bool parse_list(const char *text, std::vector<T> &values, Check check)
+{
+    values.clear();
+    std::stringstream in(text);
+    std::string item;
+    while (std::getline(in, item, ','))
+    {
+        char *end = nullptr;
+        double value = std::strtod(item.c_str(), &end);
+        if (item.empty() || *end != '\0' || !check(value))
+        {
+            return false;
+        }
+        values.push_back(static_cast<T>(value));
+    }
+    return !values.empty();
+}
+
+// Function to read the path a results record starts with, as format_result
+// wrote it: the "path" member of a JSONL object, or the first CSV field
+bool record_path(const std::string &line, OutputFormat format, std::string &path)
+{
+    path.clear();
+    if (format == OutputFormat::Jsonl)
+    {
+        static const std::string prefix = "{\"path\":\"";
+        if (line.compare(0, prefix.size(), prefix) != 0)
+        {
+            return false;
+        }
+        for (size_t i = prefix.size(); i < line.size(); ++i)
+        {
+            if (line[i] == '"')
+            {
+                return true;
+            }
+            if (line[i] != '\\')
+            {
+                path += line[i];
+                continue;
+            }
+            if (++i == line.size())
+            {
+                return false;
+            }
+            switch (line[i])
+            {
+            case 'n':
+                path += '\n';
+                break;
+            case 't':
+                path += '\t';
+                break;
+            case 'u':
+                if (i + 4 >= line.size())
+                {
+                    return false;
+                }
+                path += static_cast<char>(std::strtol(line.substr(i + 1, 4).c_str(), nullptr, 16));
+                i += 4;
+                break;
+            default:
+                path += line[i];
+            }
+        }
+        return false;
+    }
+
+    if (line.empty() || line[0] != '"')
+    {
+        path = line.substr(0, line.find(','));
+        return true;
+    }
+    for (size_t i = 1; i < line.size(); ++i)
+    {
+        if (line[i] == '"')
+        {
+            if (i + 1 < line.size() && line[i + 1] == '"')
+            {
+                path += '"';
+                ++i;
+                continue;
+            }
+            return true;
+        }
+        path += line[i];
+    }
+    return false;
+}
+
+// Function to merge the JSONL or CSV results of several shards (or runs)
+// into one file, ordered by path so the merge doesn't depend on which node
+// finished first. An image found in more than one input keeps the records of
+// the last input that has it.
+int merge_results(const std::vector<fs::path> &inputs, const fs::path &output_path)
+{
+    OutputFormat format = OutputFormat::Text;
+    std::map<std::string, std::pair<size_t, std::string>> records; // Path -> (input, its lines)
+    std::string line;
+    std::string path;
+    for (size_t index = 0; index < inputs.size(); ++index)
+    {
+        std::ifstream in(inputs[index], std::ios::binary);
+        if (!in)
+        {
+            std::cerr << "Could not open results file: " << inputs[index] << std::endl;
+            return -1;
+        }
+        bool first = true;
+        while (std::getline(in, line))
+        {
+            if (line.empty())
+            {
+                continue;
+            }
+            if (first)
+            {
+                first = false;
+                OutputFormat file_format = line == csv_header ? OutputFormat::Csv
+                                           : line[0] == '{'   ? OutputFormat::Jsonl
+                                                              : OutputFormat::Text;
+                if (file_format == OutputFormat::Text || (format != OutputFormat::Text && file_format != format))
+                {
+                    std::cerr << "Not a " << (format == OutputFormat::Csv ? "CSV" : format == OutputFormat::Jsonl ? "JSONL" : "JSONL or CSV")
+                              << " results file: " << inputs[index] << std::endl;
+                    return -1;
+                }
+                format = file_format;
+                if (format == OutputFormat::Csv)
+                {
+                    continue;
+                }
+            }
+            if (!record_path(line, format, path))
+            {
+                std::cerr << "Skipping malformed record in " << inputs[index] << ": " << line << std::endl;
+                continue;
+            }
+            auto &record = records[path];
+            if (record.first != index + 1)
+            {
+                record = {index + 1, std::string()};
+            }
+            record.second += line;
+            record.second += '\n';
+        }
+    }
+
+    std::ofstream file;
+    std::ostream *out = &std::cout;
+    if (!output_path.empty())
+    {
+        file.open(output_path, std::ios::binary | std::ios::trunc);
+        if (!file)
+        {
+            std::cerr << "Could not open results file: " << output_path << std::endl;
+            return -1;
+        }
+        out = &file;
+    }
+    if (format == OutputFormat::Csv)
+    {
+        *out << csv_header << "\n";
+    }
+    for (const auto &entry : records)
+    {
+        *out << entry.second.second;
+    }
+    out->flush();
+    if (!*out)
+    {
+        std::cerr << "Error writing results" << std::endl;
+        return -1;
+    }
+    std::cerr << "Merged " << records.size() << " images from " << inputs.size() << " files\n";
+    return 0;
+}
+
+// Function to display usage information
+void print_usage(const char *program_name)
+{
+    std::cerr << "Usage: " << program_name << " [OPTIONS] <directory_path> [<save_directory>]\n"
+              << "       " << program_name << " --merge [-o <P>] <results>...\n\n"
+              << "Options:\n"
+              << "  -h, --help                  Show this help message and exit\n"
+              << "  -j, --jobs <N>              Decode and detect with N threads per stage (default: all cores)\n"
+              << "  -b, --batch                 Headless: report results without showing or waiting on windows\n"
+              << "  -f, --format <F>            Results as text (default), jsonl (one object per image) or csv\n"
+              << "  -o, --output <P>            Write results to file P instead of stdout\n"
+              << "  -c, --cache <P>             Keep results in cache file P; re-scans skip unchanged images\n"
+              << "  -d, --detector <D>          cascade (default, Haar cascade on the CPU) or dnn\n"
+              << "  -m, --model <P>             DNN weights, e.g. res10_300x300_ssd_iter_140000.caffemodel\n"
+              << "      --model-config <P>      DNN network description, e.g. deploy.prototxt\n"
+              << "  -t, --target <T>            DNN device: cpu (default), opencl or cuda\n"
+              << "      --confidence <S>        Drop DNN detections scoring below S (default: 0.5)\n"
+              << "      --dnn-batch <N>         Images per DNN forward pass (default: 8)\n"
+              << "  -s, --scale-factor <F>      Cascade pyramid step, above 1; larger means fewer levels (default: 1.1)\n"
+              << "  -n, --min-neighbors <N>     Overlapping hits a cascade face needs (default: 10)\n"
+              << "      --min-size <PX>         Smallest face reported, in detection pixels (default: 60)\n"
+              << "      --sweep <LABELS>        Profile instead: time every -s/-n/--min-size combination on the\n"
+              << "                              images in LABELS (path[,x,y,width,height] per line, relative to\n"
+              << "                              <directory_path>) and report images/sec against recall; -s, -n\n"
+              << "                              and --min-size then take comma-separated lists\n"
+              << "      --target-recall <R>     Recall the suggested sweep setting must reach (default: 0.9)\n"
+              << "      --cascade <P>           Haar cascade to use instead of the built-in one (XML or compact)\n"
+              << "      --compile-cascade <P>   Write the compact form of the cascade to P and exit\n"
+              << "      --shard <I>/<N>         Only process the I-th (from 0) of N shards, split by path hash\n"
+              << "      --manifest <P>          Process the files listed in P (one per line, relative to\n"
+              << "                              <directory_path>; - for stdin) instead of walking the directory\n"
+              << "      --merge                 Merge JSONL or CSV result files of several shards into one\n"
+              << "      --profile               Print per-stage latency (p50/p99), images/sec, pyramid levels\n"
+              << "                              and peak RSS to stderr when done; best with --batch\n\n"
+              << "Annotated copies of images with faces go to <save_directory>, if given.\n";
+}
+
+int main(int argc, char *argv[])
+{
+    DetectionOptions options;
+    DetectorConfig detector_config;
+    SweepConfig sweep;
+    std::string cascade_file;
+    fs::path compile_output;
+    bool merge = false;
+
+    static struct option long_options[] = {
+        {"help",            no_argument,       0, 'h'},
+        {"jobs",            required_argument, 0, 'j'},
+        {"batch",           no_argument,       0, 'b'},
+        {"format",          required_argument, 0, 'f'},
+        {"output",          required_argument, 0, 'o'},
+        {"cache",           required_argument, 0, 'c'},
+        {"detector",        required_argument, 0, 'd'},
+        {"model",           required_argument, 0, 'm'},
+        {"model-config",    required_argument, 0, 1},
+        {"target",          required_argument, 0, 't'},
+        {"confidence",      required_argument, 0, 2},
+        {"dnn-batch",       required_argument, 0, 3},
+        {"scale-factor",    required_argument, 0, 's'},
+        {"min-neighbors",   required_argument, 0, 'n'},
+        {"min-size",        required_argument, 0, 4},
+        {"sweep",           required_argument, 0, 5},
+        {"target-recall",   required_argument, 0, 6},
+        {"cascade",         required_argument, 0, 7},
+        {"compile-cascade", required_argument, 0, 8},
+        {"shard",           required_argument, 0, 9},
+        {"manifest",        required_argument, 0, 10},
+        {"merge",           no_argument,       0, 11},
+        {"profile",         no_argument,       0, 12},
+        {0, 0, 0, 0}};
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "hj:bf:o:c:d:m:t:s:n:", long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+        case 'h':
+            print_usage(argv[0]);
+            return 0;
+        case 'j':
+        {
+            char *end = nullptr;
+            unsigned long jobs = std::strtoul(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || jobs > 1024)
+            {
+                std::cerr << "Invalid job count: " << optarg << "\n";
+                return -1;
+            }
+            if (jobs != 0)
+            {
+                options.jobs = static_cast<unsigned>(jobs);
+            }
+            break;
+        }
+        case 'b':
+            options.batch = true;
+            break;
+        case 'f':
+        {
+            std::string format = optarg;
+            if (format == "text")
+            {
+                options.format = OutputFormat::Text;
+            }
+            else if (format == "jsonl")
+            {
+                options.format = OutputFormat::Jsonl;
+            }
+            else if (format == "csv")
+            {
+                options.format = OutputFormat::Csv;
+            }
+            else
+            {
+                std::cerr << "Unknown output format: " << optarg << "\n";
+                return -1;
+            }
+            break;
+        }
+        case 'o':
+            options.output_path = optarg;
+            break;
+        case 'c':
+            options.cache_path = optarg;
+            break;
+        case 'd':
+        {
+            std::string backend = optarg;
+            if (backend == "cascade")
+            {
+                detector_config.backend = DetectorBackend::Cascade;
+            }
+            else if (backend == "dnn")
+            {
+                detector_config.backend = DetectorBackend::Dnn;
+            }
+            else
+            {
+                std::cerr << "Unknown detector: " << optarg << "\n";
+                return -1;
+            }
+            break;
+        }
+        case 'm':
+            detector_config.model_path = optarg;
+            break;
+        case 1:
+            detector_config.model_config = optarg;
+            break;
+        case 't':
+        {
+            std::string target = optarg;
+            if (target == "cpu")
+            {
+                detector_config.target = DnnTarget::Cpu;
+            }
+            else if (target == "opencl")
+            {
+                detector_config.target = DnnTarget::OpenCL;
+            }
+            else if (target == "cuda")
+            {
+                detector_config.target = DnnTarget::Cuda;
+            }
+            else
+            {
+                std::cerr << "Unknown DNN target: " << optarg << "\n";
+                return -1;
+            }
+            break;
+        }
+        case 2:
+        {
+            char *end = nullptr;
+            float confidence = std::strtof(optarg, &end);
+            if (end == optarg || *end != '\0' || !(confidence >= 0.0f && confidence <= 1.0f))
+            {
+                std::cerr << "Invalid confidence: " << optarg << "\n";
+                return -1;
+            }
+            detector_config.confidence = confidence;
+            break;
+        }
+        case 3:
+        {
+            char *end = nullptr;
+            unsigned long batch = std::strtoul(optarg, &end, 10);
+            if (end == optarg || *end != '\0' || batch == 0 || batch > 1024)
+            {
+                std::cerr << "Invalid DNN batch size: " << optarg << "\n";
+                return -1;
+            }
+            detector_config.batch_size = static_cast<unsigned>(batch);
+            break;
+        }
+        case 's':
+            if (!parse_list(optarg, sweep.scale_factors, [](double value) { return value > 1.0 && value <= 4.0; }))
+            {
+                std::cerr << "Invalid scale factor: " << optarg << "\n";
+                return -1;
+            }
+            break;
+        case 'n':
+            if (!parse_list(optarg, sweep.min_neighbors,
+                            [](double value) { return value >= 0 && value <= 1000 && value == static_cast<int>(value); }))
+            {
+                std::cerr << "Invalid minimum neighbour count: " << optarg << "\n";
+                return -1;
+            }
+            break;
+        case 4:
+            if (!parse_list(optarg, sweep.min_sizes,
+                            [](double value) { return value >= 1 && value <= 10000 && value == static_cast<int>(value); }))
+            {
+                std::cerr << "Invalid minimum face size: " << optarg << "\n";
+                return -1;
+            }
+            break;
+        case 5:
+            sweep.labels_path = optarg;
+            break;
+        case 6:
+        {
+            char *end = nullptr;
+            double recall = std::strtod(optarg, &end);
+            if (end == optarg || *end != '\0' || !(recall >= 0.0 && recall <= 1.0))
+            {
+                std::cerr << "Invalid target recall: " << optarg << "\n";
+                return -1;
+            }
+            sweep.target_recall = recall;
+            break;
+        }
+        case 7:
+            cascade_file = optarg;
+            break;
+        case 8:
+            compile_output = optarg;
+            break;
+        case 9:
+        {
+            char *end = nullptr;
+            unsigned long index = std::strtoul(optarg, &end, 10);
+            unsigned long count = 0;
+            if (end != optarg && *end == '/')
+            {
+                const char *count_text = end + 1;
+                count = std::strtoul(count_text, &end, 10);
+                if (end == count_text)
+                {
+                    count = 0;
+                }
+            }
+            if (*end != '\0' || count == 0 || count > 1000000 || index >= count)
+            {
+                std::cerr << "Invalid shard (expected I/N with 0 <= I < N): " << optarg << "\n";
+                return -1;
+            }
+            options.shard_index = static_cast<unsigned>(index);
+            options.shard_count = static_cast<unsigned>(count);
+            break;
+        }
+        case 10:
+            options.manifest_path = optarg;
+            break;
+        case 11:
+            merge = true;
+            break;
+        case 12:
+            options.profile = true;
+            break;
+        default:
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+
+    // Merging works on result files alone
+    if (merge)
+    {
+        if (optind >= argc)
+        {
+            print_usage(argv[0]);
+            return -1;
+        }
+        return merge_results(std::vector<fs::path>(argv + optind, argv + argc), options.output_path);
+    }
+
+    // Compiling a cascade needs no directory; this is how meson builds the
+    // one it embeds
+    if (!compile_output.empty())
+    {
+        std::string source = cascade_file.empty() ? cv::samples::findFile("haarcascade_frontalface_default.xml")
+                                                  : cascade_file;
+        return compile_cascade(source, compile_output) ? 0 : -1;
+    }
+
+    // Outside a sweep each detector setting takes a single value; an axis
+    // still holding the default grid wasn't given
+    if (sweep.labels_path.empty())
+    {
+        const SweepConfig grid;
+        DetectionParams &params = detector_config.params;
+        bool single = true;
+        if (sweep.scale_factors != grid.scale_factors)
+        {
+            single &= sweep.scale_factors.size() == 1;
+            params.scale_factor = sweep.scale_factors[0];
+        }
+        if (sweep.min_neighbors != grid.min_neighbors)
+        {
+            single &= sweep.min_neighbors.size() == 1;
+            params.min_neighbors = sweep.min_neighbors[0];
+        }
+        if (sweep.min_sizes != grid.min_sizes)
+        {
+            single &= sweep.min_sizes.size() == 1;
+            params.min_size = sweep.min_sizes[0];
+        }
+        if (!single)
+        {
+            std::cerr << "Lists of -s, -n and --min-size values are only accepted with --sweep.\n";
+            return -1;
+        }
+    }
+    else if (detector_config.backend != DetectorBackend::Cascade)
+    {
+        std::cerr << "--sweep tunes the cascade detector's parameters only.\n";
+        return -1;
+    }
+
+    // Check if the directory path is provided as a command-line argument
+    if (optind >= argc)
+    {
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    fs::path dir_path = argv[optind];
+
+    // Optional: Specify a directory to save processed images
+    if (optind + 1 < argc)
+    {
+        options.save_dir = argv[optind + 1];
+    }
+
+    // Check if the directory exists
+    if (!fs::exists(dir_path) || !fs::is_directory(dir_path))
+    {
+        std::cerr << "The provided path is not a valid directory.\n";
+        return -1;
+    }
+
+    // Load the pre-trained detector once up front, so a bad path fails before
+    // any thread starts; every detection thread then loads its own copy
+    if (detector_config.backend == DetectorBackend::Cascade && !load_cascade_source(detector_config, cascade_file))
+    {
+        return -1;
+    }
+    else if (detector_config.backend == DetectorBackend::Dnn && detector_config.model_path.empty())
+    {
+        std::cerr << "The dnn detector needs a model (--model).\n";
+        return -1;
+    }
+    if (!make_detector(detector_config))
+    {
+        return -1;
+    }
+
+    if (!sweep.labels_path.empty())
+    {
+        return run_sweep(sweep, detector_config, dir_path, options.jobs);
+    }
+
+    // Open the manifest up front too, so a mistyped path fails the run (before
+    // any results file is truncated) instead of producing an empty shard
+    std::ifstream manifest_file;
+    std::istream *manifest = nullptr;
+    if (options.manifest_path == "-")
+    {
+        manifest = &std::cin;
+    }
+    else if (!options.manifest_path.empty())
+    {
+        manifest_file.open(options.manifest_path);
+        if (!manifest_file)
+        {
+            std::cerr << "Could not open manifest: " << options.manifest_path << std::endl;
+            return -1;
+        }
+        manifest = &manifest_file;
+    }
+
+    ResultSink sink(options.format, options.output_path);
+    if (!sink.is_open())
+    {
+        return -1;
+    }
+
+    DetectionCache cache;
+    if (!options.cache_path.empty() && !cache.open(options.cache_path, detection_settings_hash(detector_config)))
+    {
+        return -1;
+    }
+
+    // Start processing the directory
+    process_directory(dir_path, detector_config, options, sink, cache.is_open() ? &cache : nullptr, manifest);
+    cache.close();
+
+    // Keep a results stream on stdout free of anything but records
+    if (options.format == OutputFormat::Text || !options.output_path.empty())
+    {
+        std::cout << "Processing completed.\n";
+    }
     return 0;
 }
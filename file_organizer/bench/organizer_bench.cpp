@@ -0,0 +1,476 @@
+// organizer_bench.cpp
+//
+// Benchmark driver for file_organizer. Generates a synthetic source tree,
+// runs the organizer binary on it and reports files/sec, syscalls per file
+// and peak RSS. Syscalls are counted in a separate ptrace'd run so tracing
+// overhead never leaks into the timing.
+
+#include <iostream>
+#include <filesystem>
+#include <string>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <csignal>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <unordered_map>
+#include <getopt.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+namespace fs = std::filesystem;
+
+// Parameters of the synthetic tree
+struct TreeSpec {
+    size_t files = 20000;
+    size_t depth = 3;
+    size_t files_per_dir = 100;
+    std::string extensions = "jpg=40,png=15,txt=20,mp4=5,pdf=10,=10";
+    std::string sizes = "small=95,medium=4,large=1";
+    double collision_rate = 0.05;   // Fraction of files reusing an earlier name
+    double identical_rate = 0.5;    // Fraction of collisions with identical contents
+    unsigned days = 30;             // Spread of modification times
+    unsigned seed = 1;
+};
+
+// Measurements of one organizer run
+struct RunResult {
+    bool ok = false;
+    double seconds = 0;
+    long peak_rss_kb = 0;
+    long syscalls = -1;
+};
+
+// Function to parse "name=weight,name=weight" lists
+std::vector<std::pair<std::string, double>> parse_weights(const std::string& spec) {
+    std::vector<std::pair<std::string, double>> weights;
+    size_t pos = 0;
+    while (pos <= spec.size()) {
+        size_t end = spec.find(',', pos);
+        if (end == std::string::npos) {
+            end = spec.size();
+        }
+        std::string item = spec.substr(pos, end - pos);
+        size_t eq = item.find('=');
+        if (eq != std::string::npos) {
+            weights.emplace_back(item.substr(0, eq), std::stod(item.substr(eq + 1)));
+        }
+        pos = end + 1;
+    }
+    return weights;
+}
+
+// Function to create the synthetic tree; returns the number of files written
+size_t generate_tree(const fs::path& root, const TreeSpec& spec) {
+    std::mt19937_64 rng(spec.seed);
+    auto extensions = parse_weights(spec.extensions);
+    auto size_classes = parse_weights(spec.sizes);
+    if (extensions.empty() || size_classes.empty()) {
+        throw std::runtime_error("empty extension or size distribution");
+    }
+
+    std::vector<double> extension_weights;
+    for (auto& e : extensions) {
+        extension_weights.push_back(e.second);
+    }
+    std::discrete_distribution<size_t> pick_extension(extension_weights.begin(), extension_weights.end());
+    std::vector<double> size_weights;
+    for (auto& s : size_classes) {
+        size_weights.push_back(s.second);
+    }
+    std::discrete_distribution<size_t> pick_size(size_weights.begin(), size_weights.end());
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+    // Size ranges line up with the organizer's default 1 MB / 10 MB thresholds
+    auto size_for = [&](const std::string& size_class) -> size_t {
+        if (size_class == "large") {
+            return 10 * 1024 * 1024 + rng() % (2 * 1024 * 1024);
+        } else if (size_class == "medium") {
+            return 1024 * 1024 + rng() % (1024 * 1024);
+        }
+        return 1 + rng() % (16 * 1024);
+    };
+
+    // Leaf directories nested depth levels deep
+    size_t leaf_count = std::max<size_t>(1, (spec.files + spec.files_per_dir - 1) / spec.files_per_dir);
+    std::vector<fs::path> leaves;
+    for (size_t i = 0; i < leaf_count; ++i) {
+        fs::path dir = root;
+        size_t value = i;
+        for (size_t level = 0; level < spec.depth; ++level) {
+            dir /= "level" + std::to_string(level) + "_" + std::to_string(value % 8);
+            value /= 8;
+        }
+        dir /= "leaf" + std::to_string(i);
+        fs::create_directories(dir);
+        leaves.push_back(dir);
+    }
+
+    // Shared content buffer; each file gets a unique header so sizes alone don't match
+    std::vector<char> content(12 * 1024 * 1024 + 64);
+    for (auto& c : content) {
+        c = static_cast<char>(rng());
+    }
+
+    struct Generated {
+        std::string name;
+        size_t size;
+        uint64_t tag;
+    };
+    std::vector<Generated> generated;
+    generated.reserve(spec.files);
+    auto now = std::chrono::system_clock::now();
+
+    for (size_t i = 0; i < spec.files; ++i) {
+        Generated file;
+        if (!generated.empty() && unit(rng) < spec.collision_rate) {
+            // Reuse an earlier name; identical collisions also reuse the contents
+            file = generated[rng() % generated.size()];
+            if (unit(rng) >= spec.identical_rate) {
+                file.tag = rng();
+            }
+        } else {
+            const std::string& ext = extensions[pick_extension(rng)].first;
+            file.name = "file" + std::to_string(i) + (ext.empty() ? "" : "." + ext);
+            file.size = size_for(size_classes[pick_size(rng)].first);
+            file.tag = rng();
+        }
+
+        fs::path path = leaves[i % leaves.size()] / file.name;
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("unable to create " + path.string() + ": " + strerror(errno));
+        }
+        memcpy(content.data(), &file.tag, sizeof(file.tag));
+        size_t written = 0;
+        while (written < file.size) {
+            ssize_t n = write(fd, content.data() + written, file.size - written);
+            if (n <= 0) {
+                close(fd);
+                throw std::runtime_error("unable to write " + path.string());
+            }
+            written += static_cast<size_t>(n);
+        }
+
+        // Spread modification times over the requested number of days
+        auto mtime = now - std::chrono::hours(24 * (spec.days ? rng() % spec.days : 0)) -
+                     std::chrono::seconds(rng() % 86400);
+        auto since_epoch = std::chrono::duration_cast<std::chrono::nanoseconds>(mtime.time_since_epoch());
+        struct timespec times[2];
+        times[0].tv_sec = times[1].tv_sec = static_cast<time_t>(since_epoch.count() / 1000000000);
+        times[0].tv_nsec = times[1].tv_nsec = static_cast<long>(since_epoch.count() % 1000000000);
+        futimens(fd, times);
+        close(fd);
+
+        generated.push_back(file);
+    }
+    return spec.files;
+}
+
+// Function to exec the organizer in a child with stdout silenced
+[[noreturn]] void exec_organizer(const std::vector<std::string>& argv) {
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull >= 0) {
+        dup2(devnull, STDOUT_FILENO);
+        close(devnull);
+    }
+    std::vector<char*> args;
+    for (const auto& arg : argv) {
+        args.push_back(const_cast<char*>(arg.c_str()));
+    }
+    args.push_back(nullptr);
+    execv(args[0], args.data());
+    _exit(127);
+}
+
+// Function to run the organizer once and time it
+RunResult run_timed(const std::vector<std::string>& argv) {
+    RunResult result;
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        exec_organizer(argv);
+    }
+    if (pid < 0) {
+        return result;
+    }
+
+    int status = 0;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        return result;
+    }
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.peak_rss_kb = usage.ru_maxrss;
+    result.ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    return result;
+}
+
+// Function to count the syscalls of the organizer and all of its threads by
+// stopping at every syscall entry and exit under ptrace. Returns -1 when
+// tracing isn't permitted here.
+long count_syscalls(const std::vector<std::string>& argv) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        if (ptrace(PTRACE_TRACEME, 0, nullptr, nullptr) != 0) {
+            _exit(126);
+        }
+        raise(SIGSTOP);
+        exec_organizer(argv);
+    }
+    if (pid < 0) {
+        return -1;
+    }
+
+    int status = 0;
+    if (waitpid(pid, &status, 0) < 0 || !WIFSTOPPED(status)) {
+        return -1;
+    }
+    long options = PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | PTRACE_O_EXITKILL;
+    if (ptrace(PTRACE_SETOPTIONS, pid, nullptr, options) != 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        return -1;
+    }
+    ptrace(PTRACE_SYSCALL, pid, nullptr, nullptr);
+
+    // Each syscall stops twice per thread (entry and exit); count entries
+    std::unordered_map<pid_t, bool> in_syscall;
+    long syscalls = 0;
+    size_t live = 1;
+    while (live > 0) {
+        pid_t tid = waitpid(-1, &status, __WALL);
+        if (tid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            in_syscall.erase(tid);
+            --live;
+            continue;
+        }
+        if (!WIFSTOPPED(status)) {
+            continue;
+        }
+
+        int signal = 0;
+        int stop = WSTOPSIG(status);
+        if (stop == (SIGTRAP | 0x80)) {
+            bool& entering = in_syscall[tid];
+            entering = !entering;
+            if (entering) {
+                ++syscalls;
+            }
+        } else if (stop == SIGTRAP && (status >> 16) == PTRACE_EVENT_CLONE) {
+            ++live; // The new thread starts traced and reports its own stop
+        } else if (stop == SIGSTOP && in_syscall.count(tid) == 0) {
+            in_syscall[tid] = false; // Initial stop of a new thread
+        } else if (stop != SIGTRAP) {
+            signal = stop;
+        }
+        ptrace(PTRACE_SYSCALL, tid, nullptr, signal);
+    }
+    return syscalls;
+}
+
+// Function to display usage information
+void print_usage(const char* program_name) {
+    std::cout << "Usage: " << program_name << " [OPTIONS] <file_organizer> [-- <organizer options>]\n\n"
+              << "Options:\n"
+              << "  -h, --help                 Show this help message and exit\n"
+              << "  -m, --mode <dry-run|real|both>\n"
+              << "                             Organizer mode(s) to measure (default: both)\n"
+              << "  -n, --files <N>            Number of files to generate (default: 20000)\n"
+              << "  --depth <N>                Directory nesting depth (default: 3)\n"
+              << "  --files-per-dir <N>        Files per leaf directory (default: 100)\n"
+              << "  --extensions <list>        Extension weights, e.g. jpg=40,txt=20,=10 (empty: none)\n"
+              << "  --sizes <list>             Size class weights over small, medium, large\n"
+              << "  --collision-rate <R>       Fraction of files reusing an earlier name (default: 0.05)\n"
+              << "  --identical-rate <R>       Fraction of collisions with identical contents (default: 0.5)\n"
+              << "  --days <N>                 Spread modification times over N days (default: 30)\n"
+              << "  --seed <N>                 Generator seed (default: 1)\n"
+              << "  --repeat <N>               Timed runs per mode; the fastest is reported (default: 1)\n"
+              << "  --no-syscalls              Skip the ptrace'd syscall-counting run\n"
+              << "  --workdir <dir>            Where to create the synthetic tree (default: $TMPDIR or /tmp)\n";
+}
+
+int main(int argc, char* argv[]) {
+    TreeSpec spec;
+    std::string mode = "both";
+    unsigned repeat = 1;
+    bool count = true;
+    const char* tmpdir = getenv("TMPDIR");
+    fs::path workdir = tmpdir ? tmpdir : "/tmp";
+
+    static struct option long_options[] = {
+        {"help",           no_argument,       0, 'h'},
+        {"mode",           required_argument, 0, 'm'},
+        {"files",          required_argument, 0, 'n'},
+        {"depth",          required_argument, 0,  1 },
+        {"files-per-dir",  required_argument, 0,  2 },
+        {"extensions",     required_argument, 0,  3 },
+        {"sizes",          required_argument, 0,  4 },
+        {"collision-rate", required_argument, 0,  5 },
+        {"identical-rate", required_argument, 0,  6 },
+        {"days",           required_argument, 0,  7 },
+        {"seed",           required_argument, 0,  8 },
+        {"repeat",         required_argument, 0,  9 },
+        {"no-syscalls",    no_argument,       0, 10 },
+        {"workdir",        required_argument, 0, 11 },
+        {0, 0, 0, 0}
+    };
+
+    int opt;
+    int option_index = 0;
+    try {
+        while ((opt = getopt_long(argc, argv, "+hm:n:", long_options, &option_index)) != -1) {
+            switch (opt) {
+                case 'h':
+                    print_usage(argv[0]);
+                    return 0;
+                case 'm':
+                    mode = optarg;
+                    break;
+                case 'n':
+                    spec.files = std::stoul(optarg);
+                    break;
+                case 1:
+                    spec.depth = std::stoul(optarg);
+                    break;
+                case 2:
+                    spec.files_per_dir = std::max<size_t>(1, std::stoul(optarg));
+                    break;
+                case 3:
+                    spec.extensions = optarg;
+                    break;
+                case 4:
+                    spec.sizes = optarg;
+                    break;
+                case 5:
+                    spec.collision_rate = std::stod(optarg);
+                    break;
+                case 6:
+                    spec.identical_rate = std::stod(optarg);
+                    break;
+                case 7:
+                    spec.days = static_cast<unsigned>(std::stoul(optarg));
+                    break;
+                case 8:
+                    spec.seed = static_cast<unsigned>(std::stoul(optarg));
+                    break;
+                case 9:
+                    repeat = std::max(1u, static_cast<unsigned>(std::stoul(optarg)));
+                    break;
+                case 10:
+                    count = false;
+                    break;
+                case 11:
+                    workdir = optarg;
+                    break;
+                default:
+                    print_usage(argv[0]);
+                    return 1;
+            }
+        }
+    } catch (...) {
+        std::cerr << "Error: Invalid value for option \"" << argv[optind - 1] << "\"\n";
+        return 1;
+    }
+
+    if (optind >= argc) {
+        std::cerr << "Error: file_organizer binary not specified.\n\n";
+        print_usage(argv[0]);
+        return 1;
+    }
+    std::string organizer = fs::absolute(argv[optind++]).string();
+    std::vector<std::string> extra_args;
+    for (int i = optind; i < argc; ++i) {
+        if (std::string(argv[i]) != "--") {
+            extra_args.push_back(argv[i]);
+        }
+    }
+
+    std::vector<std::string> modes;
+    if (mode == "both") {
+        modes = {"dry-run", "real"};
+    } else if (mode == "dry-run" || mode == "real") {
+        modes = {mode};
+    } else {
+        std::cerr << "Error: Invalid mode \"" << mode << "\". Choose from dry-run, real, both.\n";
+        return 1;
+    }
+
+    std::string pattern = (workdir / "organizer_bench.XXXXXX").string();
+    if (mkdtemp(pattern.data()) == nullptr) {
+        std::cerr << "Error: Unable to create work directory in \"" << workdir << "\": " << strerror(errno) << "\n";
+        return 1;
+    }
+    fs::path root = pattern;
+    fs::path tree = root / "tree";
+
+    int exit_code = 0;
+    try {
+        for (const auto& run_mode : modes) {
+            std::vector<std::string> args = {organizer};
+            if (run_mode == "dry-run") {
+                args.push_back("--dry-run");
+            }
+            args.insert(args.end(), extra_args.begin(), extra_args.end());
+            args.push_back(tree.string());
+
+            // A real run reorganizes the tree, so every run starts from a fresh copy
+            RunResult best;
+            for (unsigned i = 0; i < repeat; ++i) {
+                fs::remove_all(tree);
+                generate_tree(tree, spec);
+                RunResult result = run_timed(args);
+                if (!result.ok) {
+                    std::cerr << "Error: Organizer failed in " << run_mode << " mode\n";
+                    exit_code = 1;
+                    break;
+                }
+                if (!best.ok || result.seconds < best.seconds) {
+                    best = result;
+                }
+            }
+            if (!best.ok) {
+                continue;
+            }
+            if (count) {
+                fs::remove_all(tree);
+                generate_tree(tree, spec);
+                best.syscalls = count_syscalls(args);
+            }
+
+            std::cout << "mode: " << run_mode << "\n"
+                      << "  files:          " << spec.files << "\n"
+                      << "  elapsed_s:      " << best.seconds << "\n"
+                      << "  files_per_sec:  " << static_cast<long>(spec.files / best.seconds) << "\n"
+                      << "  peak_rss_kb:    " << best.peak_rss_kb << "\n";
+            if (best.syscalls >= 0) {
+                std::cout << "  syscalls:       " << best.syscalls << "\n"
+                          << "  syscalls_per_file: "
+                          << static_cast<double>(best.syscalls) / std::max<size_t>(spec.files, 1) << "\n";
+            } else if (count) {
+                std::cout << "  syscalls:       unavailable (ptrace not permitted)\n";
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        exit_code = 1;
+    }
+
+    std::error_code ec;
+    fs::remove_all(root, ec);
+    return exit_code;
+}
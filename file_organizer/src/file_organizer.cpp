@@ -7,22 +7,51 @@
 #include <iomanip>
 #include <fstream>
 #include <system_error>
-#include <sstream>
 #include <cstring>
 #include <sys/syscall.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <linux/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#if FILE_ORGANIZER_IO_URING
+#include <linux/io_uring.h>
+#endif
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <signal.h>
 #include <getopt.h>
 #include <vector>
 #include <algorithm>
+#include <array>
 #include <mutex>
 #include <thread>
 #include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <optional>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <sstream>
+#include <limits>
+#include <cctype>
 
 namespace fs = std::filesystem;
 
+// Serializes console output from worker threads
+std::mutex output_mutex;
+
 // Enumeration for time attributes
 enum class TimeAttribute {
     Creation,
@@ -37,17 +66,359 @@ struct SizeThresholds {
     // 'large' is anything >= medium
 };
 
-// Function to categorize file size
-std::string categorize_size(uintmax_t size, const SizeThresholds& thresholds) {
-    if (size < thresholds.small) {
-        return "small";
-    } else if (size < thresholds.medium) {
-        return "medium";
-    } else {
-        return "large";
+// Name prefix of the organizer's own state files in the source root
+constexpr const char* state_file_prefix = ".file_organizer";
+
+// Settings for one organizer run, filled from the command line
+struct OrganizerOptions {
+    TimeAttribute attr = TimeAttribute::Creation;
+    SizeThresholds thresholds;
+    unsigned jobs = 1;
+    bool dry_run = false;
+    bool verbose = false;
+    bool use_index = false;  // Persist content hashes across runs
+    bool dedup = false;      // Skip files whose contents already exist anywhere in the index
+    bool stats = false;      // Print counters and latency percentiles at the end
+    std::string stats_json;  // Also write them as JSON to this file ("-" for stdout)
+    std::string plan_file;   // Write the decisions here instead of moving anything
+    std::string apply_file;  // Execute a previously written plan
+    bool incremental = false; // List only directories changed since the last incremental run
+    bool watch = false;       // Keep running and organize new arrivals as they appear
+    bool fold_case = false;   // Bucket extensions case-insensitively (JPG and jpg together)
+    std::vector<std::pair<std::string, std::string>> categories;  // Extension -> bucket directory
+    std::string rules_file;   // Bucketing rules replacing the {ext}/{yyyy}/{mm}/{dd}/{size} layout
+    unsigned copy_jobs = 2;   // Threads copying files whose target is on another filesystem
+    bool journal = false;     // Log progress so an interrupted run can be resumed
+    bool resume = false;      // Continue the run recorded in the journal
+    unsigned walk_jobs = 0;   // Threads reading directories; 0 uses the --jobs count
+};
+
+// Outcome of one file, counted once per file
+enum class Outcome : unsigned {
+    Moved,
+    RenamedOnCollision,
+    SkippedInPlace,
+    SkippedIdentical,
+    SkippedDuplicate,
+    Error,
+    Count
+};
+
+// Timed operation classes: syscalls plus the per-file hashing/compare work
+enum class OpClass : unsigned {
+    Traversal,      // One directory iterator step (includes getdents)
+    Statx,
+    OpenDir,
+    Mkdir,
+    Rename,
+    Hash,           // Full streaming hash of one file
+    Compare,        // Tiered comparison of one colliding pair
+    UringStatxBatch,
+    UringRenameBatch,
+    Copy,           // Whole cross-filesystem copy of one file, fsync included
+    Count
+};
+
+static const char* const outcome_names[] = {
+    "moved", "renamed_on_collision", "skipped_in_place", "skipped_identical", "skipped_duplicate", "error"
+};
+static const char* const op_class_names[] = {
+    "traversal", "statx", "open_dir", "mkdir", "rename", "hash", "compare",
+    "uring_statx_batch", "uring_rename_batch", "copy"
+};
+
+// Log-linear latency histogram: four sub-buckets per power of two, so any
+// percentile is reported within 25% of the true value
+struct LatencyHistogram {
+    static constexpr unsigned bucket_count = 256;
+
+    uint64_t counts[bucket_count] = {};
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+
+    static unsigned bucket_of(uint64_t ns) {
+        if (ns < 4) {
+            return static_cast<unsigned>(ns);
+        }
+        unsigned msb = 63 - static_cast<unsigned>(__builtin_clzll(ns));
+        unsigned sub = static_cast<unsigned>((ns >> (msb - 2)) & 3);
+        return msb * 4 + sub;
+    }
+
+    // Upper bound of a bucket, used as the reported value
+    static uint64_t bucket_limit(unsigned bucket) {
+        if (bucket < 8) {
+            return bucket;
+        }
+        unsigned msb = bucket / 4;
+        uint64_t sub = bucket % 4;
+        return ((4 + sub + 1) << (msb - 2)) - 1;
+    }
+
+    void record(uint64_t ns) {
+        ++counts[bucket_of(ns)];
+        ++count;
+        total_ns += ns;
+        max_ns = std::max(max_ns, ns);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (unsigned i = 0; i < bucket_count; ++i) {
+            counts[i] += other.counts[i];
+        }
+        count += other.count;
+        total_ns += other.total_ns;
+        max_ns = std::max(max_ns, other.max_ns);
+    }
+
+    uint64_t percentile(double q) const {
+        if (count == 0) {
+            return 0;
+        }
+        uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(count - 1)) + 1;
+        uint64_t seen = 0;
+        for (unsigned i = 0; i < bucket_count; ++i) {
+            seen += counts[i];
+            if (seen >= rank) {
+                return std::min(bucket_limit(i), max_ns);
+            }
+        }
+        return max_ns;
+    }
+};
+
+// Counters owned by one thread; merged only when the report is printed
+struct ThreadStats {
+    uint64_t outcomes[static_cast<unsigned>(Outcome::Count)] = {};
+    uint64_t bytes_hashed = 0;
+    uint64_t bytes_compared = 0;
+    uint64_t bytes_copied = 0;   // Cross-filesystem moves, reflinked or copied
+    LatencyHistogram latency[static_cast<unsigned>(OpClass::Count)];
+    std::vector<uint64_t> extension_files;  // Indexed by extension id
+    std::vector<uint64_t> extension_bytes;
+};
+
+// Owns every thread's counters so they outlive the worker threads
+class StatsRegistry {
+public:
+    ThreadStats& local() {
+        thread_local ThreadStats* stats = nullptr;
+        if (stats == nullptr) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            threads_.push_back(std::make_unique<ThreadStats>());
+            stats = threads_.back().get();
+        }
+        return *stats;
+    }
+
+    ThreadStats merged() const {
+        ThreadStats total;
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& thread : threads_) {
+            for (unsigned i = 0; i < static_cast<unsigned>(Outcome::Count); ++i) {
+                total.outcomes[i] += thread->outcomes[i];
+            }
+            total.bytes_hashed += thread->bytes_hashed;
+            total.bytes_compared += thread->bytes_compared;
+            total.bytes_copied += thread->bytes_copied;
+            for (unsigned i = 0; i < static_cast<unsigned>(OpClass::Count); ++i) {
+                total.latency[i].merge(thread->latency[i]);
+            }
+            if (total.extension_files.size() < thread->extension_files.size()) {
+                total.extension_files.resize(thread->extension_files.size());
+                total.extension_bytes.resize(thread->extension_files.size());
+            }
+            for (size_t i = 0; i < thread->extension_files.size(); ++i) {
+                total.extension_files[i] += thread->extension_files[i];
+                total.extension_bytes[i] += thread->extension_bytes[i];
+            }
+        }
+        return total;
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<ThreadStats>> threads_;
+};
+
+// Set once before any worker starts; every hook is a single branch when off
+bool stats_enabled = false;
+StatsRegistry stats_registry;
+
+static void count_outcome(Outcome outcome) {
+    if (stats_enabled) {
+        ++stats_registry.local().outcomes[static_cast<unsigned>(outcome)];
+    }
+}
+
+static void count_bytes_hashed(uint64_t bytes) {
+    if (stats_enabled) {
+        stats_registry.local().bytes_hashed += bytes;
+    }
+}
+
+static void count_bytes_compared(uint64_t bytes) {
+    if (stats_enabled) {
+        stats_registry.local().bytes_compared += bytes;
+    }
+}
+
+static void count_bytes_copied(uint64_t bytes) {
+    if (stats_enabled) {
+        stats_registry.local().bytes_copied += bytes;
+    }
+}
+
+static void count_extension(uint32_t extension, uint64_t bytes) {
+    if (stats_enabled) {
+        ThreadStats& stats = stats_registry.local();
+        if (stats.extension_files.size() <= extension) {
+            stats.extension_files.resize(extension + 1);
+            stats.extension_bytes.resize(extension + 1);
+        }
+        ++stats.extension_files[extension];
+        stats.extension_bytes[extension] += bytes;
+    }
+}
+
+// Records the lifetime of the scope into the current thread's histogram
+class OpTimer {
+public:
+    explicit OpTimer(OpClass op) : op_(op) {
+        if (stats_enabled) {
+            start_ = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~OpTimer() {
+        if (stats_enabled) {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start_).count();
+            stats_registry.local().latency[static_cast<unsigned>(op_)].record(static_cast<uint64_t>(ns));
+        }
+    }
+
+    OpTimer(const OpTimer&) = delete;
+    OpTimer& operator=(const OpTimer&) = delete;
+
+private:
+    OpClass op_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+// Function to write text as the contents of a JSON string
+static void write_json_string(std::ostream& os, const std::string& text) {
+    os << '"';
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\') {
+            os << '\\' << c;
+        } else if (c < 0x20) {
+            os << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<unsigned>(c)
+               << std::dec << std::setfill(' ');
+        } else {
+            os << c;
+        }
+    }
+    os << '"';
+}
+
+// Number of extensions listed in the text report, busiest first
+constexpr size_t stats_top_extensions = 10;
+
+// Function to print the merged statistics as an aligned table. extension_names
+// maps extension ids to the names shown, or is empty.
+void print_stats_text(std::ostream& os, double elapsed_seconds, const std::vector<std::string>& extension_names) {
+    ThreadStats total = stats_registry.merged();
+    uint64_t files = 0;
+    for (uint64_t count : total.outcomes) {
+        files += count;
+    }
+
+    os << "Statistics:\n"
+       << "  Elapsed: " << elapsed_seconds << " s, " << files << " files";
+    if (elapsed_seconds > 0) {
+        os << " (" << static_cast<uint64_t>(static_cast<double>(files) / elapsed_seconds) << " files/s)";
+    }
+    os << "\n  Outcomes:\n";
+    for (unsigned i = 0; i < static_cast<unsigned>(Outcome::Count); ++i) {
+        os << "    " << std::left << std::setw(24) << outcome_names[i] << std::right << total.outcomes[i] << "\n";
+    }
+    os << "  Bytes hashed: " << total.bytes_hashed << "\n"
+       << "  Bytes compared: " << total.bytes_compared << "\n"
+       << "  Bytes copied: " << total.bytes_copied << "\n"
+       << "  Latency (us)              count        p50        p99        max\n";
+    for (unsigned i = 0; i < static_cast<unsigned>(OpClass::Count); ++i) {
+        const LatencyHistogram& h = total.latency[i];
+        if (h.count == 0) {
+            continue;
+        }
+        os << "    " << std::left << std::setw(20) << op_class_names[i] << std::right
+           << std::setw(11) << h.count
+           << std::setw(11) << std::fixed << std::setprecision(1) << h.percentile(0.50) / 1000.0
+           << std::setw(11) << h.percentile(0.99) / 1000.0
+           << std::setw(11) << h.max_ns / 1000.0 << std::defaultfloat << std::setprecision(6) << "\n";
+    }
+
+    std::vector<uint32_t> busiest;
+    for (size_t i = 0; i < total.extension_files.size() && i < extension_names.size(); ++i) {
+        if (total.extension_files[i] != 0) {
+            busiest.push_back(static_cast<uint32_t>(i));
+        }
+    }
+    if (busiest.empty()) {
+        return;
+    }
+    std::sort(busiest.begin(), busiest.end(), [&](uint32_t a, uint32_t b) {
+        return total.extension_files[a] != total.extension_files[b] ?
+               total.extension_files[a] > total.extension_files[b] : a < b;
+    });
+    os << "  Extensions                files      bytes\n";
+    for (size_t k = 0; k < busiest.size() && k < stats_top_extensions; ++k) {
+        uint32_t i = busiest[k];
+        os << "    " << std::left << std::setw(20) << extension_names[i] << std::right
+           << std::setw(11) << total.extension_files[i] << std::setw(11) << total.extension_bytes[i] << "\n";
+    }
+    if (busiest.size() > stats_top_extensions) {
+        os << "    (" << busiest.size() - stats_top_extensions << " more)\n";
     }
 }
 
+// Function to print the merged statistics as one JSON object
+void print_stats_json(std::ostream& os, double elapsed_seconds, const std::vector<std::string>& extension_names) {
+    ThreadStats total = stats_registry.merged();
+    os << "{\"elapsed_s\":" << elapsed_seconds << ",\"outcomes\":{";
+    for (unsigned i = 0; i < static_cast<unsigned>(Outcome::Count); ++i) {
+        os << (i ? "," : "") << "\"" << outcome_names[i] << "\":" << total.outcomes[i];
+    }
+    os << "},\"bytes_hashed\":" << total.bytes_hashed
+       << ",\"bytes_compared\":" << total.bytes_compared
+       << ",\"bytes_copied\":" << total.bytes_copied << ",\"latency_ns\":{";
+    bool first = true;
+    for (unsigned i = 0; i < static_cast<unsigned>(OpClass::Count); ++i) {
+        const LatencyHistogram& h = total.latency[i];
+        if (h.count == 0) {
+            continue;
+        }
+        os << (first ? "" : ",") << "\"" << op_class_names[i] << "\":{\"count\":" << h.count
+           << ",\"total\":" << h.total_ns << ",\"p50\":" << h.percentile(0.50)
+           << ",\"p99\":" << h.percentile(0.99) << ",\"max\":" << h.max_ns << "}";
+        first = false;
+    }
+    os << "},\"extensions\":{";
+    first = true;
+    for (size_t i = 0; i < total.extension_files.size() && i < extension_names.size(); ++i) {
+        if (total.extension_files[i] == 0) {
+            continue;
+        }
+        os << (first ? "" : ",");
+        write_json_string(os, extension_names[i]);
+        os << ":{\"files\":" << total.extension_files[i] << ",\"bytes\":" << total.extension_bytes[i] << "}";
+        first = false;
+    }
+    os << "}}\n";
+}
+
 // Check if the system supports statx (Linux 4.11+)
 #if defined(__linux__) && (__GNUC__ > 2 || (__GNUC__ == 2 && __GNUC_MINOR__ >= 17))
 #define HAS_STATX 1
@@ -62,302 +433,4280 @@ std::string categorize_size(uintmax_t size, const SizeThresholds& thresholds) {
 #ifndef STATX_BTIME
 #define STATX_BTIME 0x10000000000ULL
 #endif
+#endif
+
+// Per-file metadata gathered once and shared by every later stage
+struct FileMetadata {
+    uintmax_t size = 0;
+    std::chrono::system_clock::time_point btime;
+    std::chrono::system_clock::time_point mtime;
+    std::chrono::system_clock::time_point atime;
+    mode_t mode = 0;
+    bool has_btime = false;
+};
+
+// Convert a seconds/nanoseconds pair into a time_point
+static std::chrono::system_clock::time_point to_time_point(int64_t sec, uint32_t nsec) {
+    return std::chrono::system_clock::time_point(
+        std::chrono::duration_cast<std::chrono::system_clock::duration>(
+            std::chrono::seconds(sec) + std::chrono::nanoseconds(nsec)));
+}
+
+#if HAS_STATX
+// Fields requested for every file
+constexpr unsigned int file_metadata_statx_mask = STATX_TYPE | STATX_MODE | STATX_SIZE |
+                                                  STATX_ATIME | STATX_MTIME | STATX_BTIME;
+
+// Function to convert a statx result into the metadata record
+void fill_file_metadata(const struct statx& stx, FileMetadata& meta) {
+    meta.size = stx.stx_size;
+    meta.mode = stx.stx_mode;
+    meta.atime = to_time_point(stx.stx_atime.tv_sec, stx.stx_atime.tv_nsec);
+    meta.mtime = to_time_point(stx.stx_mtime.tv_sec, stx.stx_mtime.tv_nsec);
+    meta.has_btime = (stx.stx_mask & STATX_BTIME) != 0;
+    if (meta.has_btime) {
+        meta.btime = to_time_point(stx.stx_btime.tv_sec, stx.stx_btime.tv_nsec);
+    }
+}
+#endif
+
+// Function to retrieve all file metadata with a single statx (or stat) call,
+// resolving name relative to dir_fd. On failure errno is preserved so the
+// caller can report or skip the file.
+bool get_file_metadata_at(int dir_fd, const char* name, FileMetadata& meta) {
+#if HAS_STATX
+    struct statx stx;
+    memset(&stx, 0, sizeof(stx));
+
+    int flags = AT_STATX_SYNC_AS_STAT;
+    unsigned int mask = file_metadata_statx_mask;
+
+    int ret;
+    {
+        OpTimer timer(OpClass::Statx);
+        ret = static_cast<int>(syscall(SYS_statx, dir_fd, name, flags, mask, &stx));
+    }
+    if (ret == 0) {
+        fill_file_metadata(stx, meta);
+        return true;
+    }
+    // Only fall through to stat if the kernel lacks statx
+    if (errno != ENOSYS) {
+        return false;
+    }
+#endif
+
+    struct stat sb;
+    if (fstatat(dir_fd, name, &sb, 0) != 0) {
+        return false;
+    }
+    meta.size = static_cast<uintmax_t>(sb.st_size);
+    meta.mode = sb.st_mode;
+    meta.atime = to_time_point(sb.st_atim.tv_sec, sb.st_atim.tv_nsec);
+    meta.mtime = to_time_point(sb.st_mtim.tv_sec, sb.st_mtim.tv_nsec);
+    meta.has_btime = false;
+    return true;
+}
+
+bool get_file_metadata(const fs::path& file_path, FileMetadata& meta) {
+    return get_file_metadata_at(AT_FDCWD, file_path.c_str(), meta);
+}
+
+// Function to select the file time based on user choice
+std::chrono::system_clock::time_point get_file_time(const fs::path& file_path, const FileMetadata& meta,
+                                                    TimeAttribute attr) {
+    switch (attr) {
+        case TimeAttribute::Creation:
+            if (meta.has_btime) {
+                return meta.btime;
+            }
+            {
+                std::lock_guard<std::mutex> lock(output_mutex);
+                std::cerr << "Warning: Creation time not available for \"" << file_path 
+                          << "\". Falling back to last modification time.\n";
+            }
+            return meta.mtime;
+        case TimeAttribute::Access:
+            return meta.atime;
+        case TimeAttribute::Modification:
+        default:
+            return meta.mtime;
+    }
+}
+
+// Formats the YYYY/MM/DD bucket of a timestamp. The local day containing the
+// last timestamp is cached as an epoch range, so consecutive files from the
+// same day skip localtime_r entirely; one instance is kept per thread.
+class DateBucketFormatter {
+public:
+    enum class Part { Date, Year, Month, Day };
+
+    // Append the bucket for time to out
+    void append(std::time_t time, std::string& out) {
+        append(time, Part::Date, out);
+    }
+
+    // Append one component (or the whole YYYY/MM/DD) for time to out
+    void append(std::time_t time, Part part, std::string& out) {
+        if (!valid_ || time < day_start_ || time >= day_end_) {
+            refresh(time);
+        }
+        // Month and day are always two digits; the year takes the rest
+        const size_t year_length = text_length_ - 6;
+        switch (part) {
+            case Part::Date:
+                out.append(text_, text_length_);
+                break;
+            case Part::Year:
+                out.append(text_, year_length);
+                break;
+            case Part::Month:
+                out.append(text_ + year_length + 1, 2);
+                break;
+            case Part::Day:
+                out.append(text_ + year_length + 4, 2);
+                break;
+        }
+    }
+
+private:
+    static char* write_digits(char* p, int value, int width) {
+        for (int i = width - 1; i >= 0; --i) {
+            p[i] = static_cast<char>('0' + value % 10);
+            value /= 10;
+        }
+        return p + width;
+    }
+
+    void refresh(std::time_t time) {
+        std::tm tm_ptr;
+        localtime_r(&time, &tm_ptr); // Thread-safe version
+
+        int year = tm_ptr.tm_year + 1900;
+        if (year >= 0 && year <= 9999) {
+            char* p = write_digits(text_, year, 4);
+            *p++ = '/';
+            p = write_digits(p, tm_ptr.tm_mon + 1, 2);
+            *p++ = '/';
+            p = write_digits(p, tm_ptr.tm_mday, 2);
+            text_length_ = static_cast<size_t>(p - text_);
+        } else {
+            text_length_ = static_cast<size_t>(
+                snprintf(text_, sizeof(text_), "%d/%02d/%02d", year, tm_ptr.tm_mon + 1, tm_ptr.tm_mday));
+        }
+
+        // Day boundaries come from mktime so DST transitions are honoured
+        std::tm start = tm_ptr;
+        start.tm_hour = start.tm_min = start.tm_sec = 0;
+        start.tm_isdst = -1;
+        std::tm next = start;
+        next.tm_mday += 1;
+        next.tm_isdst = -1;
+        day_start_ = mktime(&start);
+        day_end_ = mktime(&next);
+        if (day_start_ == -1 || day_end_ == -1 || time < day_start_ || time >= day_end_) {
+            // Unrepresentable range; cache just this second
+            day_start_ = time;
+            day_end_ = time + 1;
+        }
+        valid_ = true;
+    }
+
+    bool valid_ = false;
+    std::time_t day_start_ = 0;
+    std::time_t day_end_ = 0;
+    char text_[32];
+    size_t text_length_ = 0;
+};
+
+// Bucketing rules compiled from a rules file, or from the command line's
+// size thresholds when there is none. A file's target directory below the
+// source root comes from the first rule whose predicates all hold, else from
+// the layout. Rules files are line based; # starts a comment:
+//
+//   layout {ext}/{yyyy}/{mm}/{dd}/{size}
+//   tiers tiny:64K small:1M medium:100M large
+//   rule ext=jpg,png size>=20M -> photos/raw/{yyyy}
+//   rule age<7d -> inbox/{ext}
+//
+// Templates may use {ext} (the extension's bucket), {yyyy}, {mm}, {dd} and
+// {size} (the size tier). Predicates are ext=<list>, size<op><bytes> and
+// age<op><n>[s|h|d|w] with op one of < <= > >=; age is measured from the
+// start of the run using the --time attribute. Everything is resolved at load
+// time into flat ranges, per-extension bit masks and field opcodes, so a file
+// costs a few compares and appends, the same as the fixed layout.
+class BucketRules {
+public:
+    // The fixed layout: {ext}/{yyyy}/{mm}/{dd}/{size} with small/medium/large
+    BucketRules(TimeAttribute attr, const SizeThresholds& thresholds)
+        : attr_(attr), now_(std::time(nullptr)) {
+        std::string error;
+        compile_template("{ext}/{yyyy}/{mm}/{dd}/{size}", layout_, error);
+        tiers_ = {{thresholds.small, "small"}, {thresholds.medium, "medium"}, {UINTMAX_MAX, "large"}};
+    }
+
+    // Replace the defaults with a rules file. On failure error names the line.
+    bool load(const fs::path& path, std::string& error) {
+        std::ifstream in(path);
+        if (!in) {
+            error = "cannot open \"" + path.string() + "\"";
+            return false;
+        }
+        std::string line;
+        for (int number = 1; std::getline(in, line); ++number) {
+            size_t comment = line.find('#');
+            if (comment != std::string::npos) {
+                line.erase(comment);
+            }
+            std::vector<std::string> words;
+            std::istringstream tokens(line);
+            for (std::string word; tokens >> word;) {
+                words.push_back(word);
+            }
+            if (!words.empty() && !parse_statement(words, error)) {
+                error = path.string() + ":" + std::to_string(number) + ": " + error;
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Bit set of the rules whose ext= list contains extension; computed once
+    // per extension by the extension table
+    uint64_t extension_mask(const std::string& extension, bool fold_case) const {
+        auto same = [fold_case](const std::string& a, const std::string& b) {
+            return a.size() == b.size() &&
+                   std::equal(a.begin(), a.end(), b.begin(), [fold_case](char x, char y) {
+                       return x == y || (fold_case && std::tolower(static_cast<unsigned char>(x)) ==
+                                                          std::tolower(static_cast<unsigned char>(y)));
+                   });
+        };
+        uint64_t mask = 0;
+        for (size_t i = 0; i < rules_.size(); ++i) {
+            for (const std::string& listed : rules_[i].extensions) {
+                if (same(listed, extension)) {
+                    mask |= uint64_t(1) << i;
+                    break;
+                }
+            }
+        }
+        return mask;
+    }
+
+    size_t rule_count() const { return rules_.size(); }
+    size_t tier_count() const { return tiers_.size(); }
+
+    // Append the directory for a file (relative to the root, no trailing
+    // slash) to out. bucket and extension_mask come from its extension.
+    void append(const fs::path& file_path, const FileMetadata& meta, const std::string& bucket,
+                uint64_t extension_mask, std::string& out) const {
+        thread_local DateBucketFormatter date_formatter;
+        std::time_t file_time = 0;
+        bool have_time = false;
+        auto time_of_file = [&] {
+            if (!have_time) {
+                file_time = std::chrono::system_clock::to_time_t(get_file_time(file_path, meta, attr_));
+                have_time = true;
+            }
+            return file_time;
+        };
+
+        const std::vector<TemplateOp>* ops = &layout_;
+        for (const Rule& rule : rules_) {
+            if ((rule.extension_bit != 0 && (extension_mask & rule.extension_bit) == 0) ||
+                meta.size < rule.min_size || meta.size > rule.max_size) {
+                continue;
+            }
+            if (rule.has_age) {
+                int64_t age = static_cast<int64_t>(now_) - static_cast<int64_t>(time_of_file());
+                if (age < rule.min_age || age > rule.max_age) {
+                    continue;
+                }
+            }
+            ops = &rule.ops;
+            break;
+        }
+
+        for (const TemplateOp& op : *ops) {
+            switch (op.field) {
+                case Field::Literal:
+                    out += op.text;
+                    break;
+                case Field::Extension:
+                    out += bucket;
+                    break;
+                case Field::Date:
+                    date_formatter.append(time_of_file(), DateBucketFormatter::Part::Date, out);
+                    break;
+                case Field::Year:
+                    date_formatter.append(time_of_file(), DateBucketFormatter::Part::Year, out);
+                    break;
+                case Field::Month:
+                    date_formatter.append(time_of_file(), DateBucketFormatter::Part::Month, out);
+                    break;
+                case Field::Day:
+                    date_formatter.append(time_of_file(), DateBucketFormatter::Part::Day, out);
+                    break;
+                case Field::SizeTier:
+                    out += size_tier(meta.size);
+                    break;
+            }
+        }
+    }
+
+private:
+    enum class Field { Literal, Extension, Date, Year, Month, Day, SizeTier };
+
+    struct TemplateOp {
+        Field field;
+        std::string text;  // Literal only
+    };
+
+    // Inclusive ranges; an absent predicate spans the whole domain
+    struct Rule {
+        std::vector<std::string> extensions;
+        uint64_t extension_bit = 0;
+        uintmax_t min_size = 0;
+        uintmax_t max_size = UINTMAX_MAX;
+        bool has_age = false;
+        int64_t min_age = INT64_MIN;
+        int64_t max_age = INT64_MAX;
+        std::vector<TemplateOp> ops;
+    };
+
+    struct Tier {
+        uintmax_t limit;  // Sizes below this belong to the tier
+        std::string name;
+    };
+
+    static constexpr size_t max_rules = 64;  // One bit each in an extension mask
+
+    const std::string& size_tier(uintmax_t size) const {
+        for (const Tier& tier : tiers_) {
+            if (size < tier.limit) {
+                return tier.name;
+            }
+        }
+        return tiers_.back().name;
+    }
+
+    // Parse "<n>[K|M|G|T]" as bytes (binary multiples)
+    static bool parse_bytes(const std::string& text, uintmax_t& out) {
+        size_t used = 0;
+        unsigned long long value;
+        try {
+            value = std::stoull(text, &used);
+        } catch (...) {
+            return false;
+        }
+        std::string suffix = text.substr(used);
+        int shift = suffix.empty() ? 0 : suffix == "K" ? 10 : suffix == "M" ? 20 : suffix == "G" ? 30 :
+                    suffix == "T" ? 40 : -1;
+        if (shift < 0 || (shift > 0 && value > (UINTMAX_MAX >> shift))) {
+            return false;
+        }
+        out = static_cast<uintmax_t>(value) << shift;
+        return true;
+    }
+
+    // Parse "<n>[s|h|d|w]" as seconds
+    static bool parse_age(const std::string& text, int64_t& out) {
+        size_t used = 0;
+        long long value;
+        try {
+            value = std::stoll(text, &used);
+        } catch (...) {
+            return false;
+        }
+        std::string suffix = text.substr(used);
+        int64_t unit = suffix.empty() || suffix == "s" ? 1 : suffix == "h" ? 3600 : suffix == "d" ? 86400 :
+                       suffix == "w" ? 604800 : 0;
+        if (unit == 0 || value < 0 || value > INT64_MAX / unit) {
+            return false;
+        }
+        out = value * unit;
+        return true;
+    }
+
+    // Narrow [low, high] by "<op><value>" applied to an integer domain
+    template <typename T>
+    static bool apply_bound(const std::string& op, T value, T& low, T& high) {
+        if (op == "<") {
+            if (value == std::numeric_limits<T>::min()) {
+                return false;
+            }
+            high = std::min(high, static_cast<T>(value - 1));
+        } else if (op == "<=") {
+            high = std::min(high, value);
+        } else if (op == ">") {
+            if (value == std::numeric_limits<T>::max()) {
+                return false;
+            }
+            low = std::max(low, static_cast<T>(value + 1));
+        } else if (op == ">=") {
+            low = std::max(low, value);
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    static bool compile_template(const std::string& text, std::vector<TemplateOp>& ops, std::string& error) {
+        ops.clear();
+        std::string literal;
+        auto flush_literal = [&] {
+            if (!literal.empty()) {
+                ops.push_back(TemplateOp{Field::Literal, literal});
+                literal.clear();
+            }
+        };
+        for (size_t i = 0; i < text.size();) {
+            if (text[i] != '{') {
+                literal += text[i++];
+                continue;
+            }
+            size_t close = text.find('}', i);
+            if (close == std::string::npos) {
+                error = "unterminated placeholder in \"" + text + "\"";
+                return false;
+            }
+            std::string name = text.substr(i + 1, close - i - 1);
+            i = close + 1;
+            Field field;
+            if (name == "ext") {
+                field = Field::Extension;
+            } else if (name == "yyyy" && text.compare(i, 10, "/{mm}/{dd}") == 0) {
+                field = Field::Date; // The common case formats the whole date in one append
+                i += 10;
+            } else if (name == "yyyy") {
+                field = Field::Year;
+            } else if (name == "mm") {
+                field = Field::Month;
+            } else if (name == "dd") {
+                field = Field::Day;
+            } else if (name == "size") {
+                field = Field::SizeTier;
+            } else {
+                error = "unknown placeholder {" + name + "}";
+                return false;
+            }
+            flush_literal();
+            ops.push_back(TemplateOp{field, std::string()});
+        }
+        flush_literal();
+
+        // Every component must stay below the root
+        std::string components;
+        for (const TemplateOp& op : ops) {
+            components += op.field == Field::Literal ? op.text : std::string("x");
+        }
+        std::istringstream parts(components);
+        std::string part;
+        if (components.empty() || components.front() == '/' || components.back() == '/') {
+            error = "template \"" + text + "\" must be a relative path without a trailing slash";
+            return false;
+        }
+        while (std::getline(parts, part, '/')) {
+            if (part.empty() || part == "." || part == "..") {
+                error = "template \"" + text + "\" has an empty, \".\" or \"..\" component";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool parse_statement(const std::vector<std::string>& words, std::string& error) {
+        const std::string& keyword = words[0];
+        if (keyword == "layout") {
+            if (words.size() != 2) {
+                error = "expected: layout <template>";
+                return false;
+            }
+            return compile_template(words[1], layout_, error);
+        }
+
+        if (keyword == "tiers") {
+            std::vector<Tier> tiers;
+            for (size_t i = 1; i < words.size(); ++i) {
+                size_t colon = words[i].find(':');
+                bool last = i + 1 == words.size();
+                Tier tier{UINTMAX_MAX, words[i].substr(0, colon)};
+                if (tier.name.empty() || tier.name.find('/') != std::string::npos || tier.name == "." ||
+                    tier.name == ".." || (colon == std::string::npos) != last ||
+                    (!last && !parse_bytes(words[i].substr(colon + 1), tier.limit)) ||
+                    (!tiers.empty() && tier.limit <= tiers.back().limit)) {
+                    error = "expected: tiers <name>:<limit>... <name>, with increasing limits";
+                    return false;
+                }
+                tiers.push_back(tier);
+            }
+            if (tiers.empty()) {
+                error = "tiers needs at least one tier";
+                return false;
+            }
+            tiers_ = std::move(tiers);
+            return true;
+        }
+
+        if (keyword == "rule") {
+            auto arrow = std::find(words.begin(), words.end(), "->");
+            if (arrow == words.end() || arrow + 2 != words.end()) {
+                error = "expected: rule <predicate>... -> <template>";
+                return false;
+            }
+            if (rules_.size() == max_rules) {
+                error = "at most " + std::to_string(max_rules) + " rules are supported";
+                return false;
+            }
+            Rule rule;
+            for (auto it = words.begin() + 1; it != arrow; ++it) {
+                if (!parse_predicate(*it, rule)) {
+                    error = "invalid predicate \"" + *it + "\"";
+                    return false;
+                }
+            }
+            if (!compile_template(*(arrow + 1), rule.ops, error)) {
+                return false;
+            }
+            if (!rule.extensions.empty()) {
+                rule.extension_bit = uint64_t(1) << rules_.size();
+            }
+            rules_.push_back(std::move(rule));
+            return true;
+        }
+
+        error = "unknown statement \"" + keyword + "\"";
+        return false;
+    }
+
+    bool parse_predicate(const std::string& word, Rule& rule) const {
+        if (word.compare(0, 4, "ext=") == 0) {
+            std::istringstream list(word.substr(4));
+            for (std::string extension; std::getline(list, extension, ',');) {
+                if (!extension.empty() && extension[0] == '.') {
+                    extension.erase(0, 1);
+                }
+                if (extension.empty()) {
+                    return false;
+                }
+                rule.extensions.push_back(extension);
+            }
+            return !rule.extensions.empty();
+        }
+        bool is_size = word.compare(0, 4, "size") == 0;
+        bool is_age = word.compare(0, 3, "age") == 0;
+        if (!is_size && !is_age) {
+            return false;
+        }
+        std::string rest = word.substr(is_size ? 4 : 3);
+        size_t op_length = rest.size() >= 2 && rest[1] == '=' ? 2 : 1;
+        std::string op = rest.substr(0, op_length);
+        std::string value = rest.substr(std::min(op_length, rest.size()));
+        if (is_size) {
+            uintmax_t bytes;
+            return parse_bytes(value, bytes) && apply_bound(op, bytes, rule.min_size, rule.max_size);
+        }
+        int64_t seconds;
+        rule.has_age = true;
+        return parse_age(value, seconds) && apply_bound(op, seconds, rule.min_age, rule.max_age);
+    }
+
+    TimeAttribute attr_;
+    std::time_t now_;
+    std::vector<TemplateOp> layout_;
+    std::vector<Tier> tiers_;
+    std::vector<Rule> rules_;
+};
+
+// Function to display usage information
+void print_usage(const char* program_name) {
+    std::cout << "Usage: " << program_name << " [OPTIONS] <source_directory>\n\n"
+              << "Options:\n"
+              << "  -h, --help                 Show this help message and exit\n"
+              << "  -v, --verbose              Enable verbose output\n"
+              << "  -d, --dry-run              Perform a trial run with no changes made\n"
+              << "  -j, --jobs <N>             Classify and move files with N worker threads (default: 1, 0: all cores)\n"
+              << "  -t, --time [creation|modification|access]\n"
+              << "                             Specify the time attribute to organize by (default: creation)\n"
+              << "  --small <size_in_MB>       Define the threshold for 'small' files (default: 1)\n"
+              << "  --medium <size_in_MB>      Define the threshold for 'medium' files (default: 10)\n"
+              << "  --index                    Keep a content-hash index in the source root to skip re-reading\n"
+              << "                             collided files on later runs\n"
+              << "  --dedup                    Leave files in place whose contents are already organized\n"
+              << "                             anywhere in the tree (implies --index)\n"
+              << "  --stats                    Print per-outcome counts and syscall latency percentiles\n"
+              << "  --stats-json <file>        Write the same statistics as JSON to file (- for stdout)\n"
+              << "  --plan <file>              Decide every move and write the plan to file without changing anything\n"
+              << "  --apply <file>             Execute a plan written by --plan; the source directory is taken\n"
+              << "                             from the plan and may be omitted\n"
+              << "  --incremental              Only list directories that changed since the previous\n"
+              << "                             incremental run, using a snapshot kept in the source root\n"
+              << "  --watch                    After the initial pass, keep organizing files as they arrive\n"
+              << "                             until interrupted (SIGINT/SIGTERM)\n"
+              << "  --fold-case                Treat extensions case-insensitively, so JPG and jpg share a bucket\n"
+              << "  --category <exts=name>     Put the listed extensions in one bucket, e.g. \"jpg,png=images\"\n"
+              << "                             (\"jpg,png -> images\" also works; may be repeated)\n"
+              << "  --rules <file>             Lay out targets with a rules file instead of ext/date/size:\n"
+              << "                               layout {ext}/{yyyy}/{mm}/{dd}/{size}\n"
+              << "                               tiers tiny:64K small:1M medium:100M large\n"
+              << "                               rule ext=jpg,png size>=20M -> photos/raw/{yyyy}\n"
+              << "                               rule age<7d -> inbox/{ext}\n"
+              << "                             The first matching rule wins; otherwise layout applies\n"
+              << "  --journal                  Keep a crash-safe journal of listed directories and completed\n"
+              << "                             moves in the source root; it is removed when the run finishes\n"
+              << "  --resume                   Continue a run that was interrupted, from its journal, without\n"
+              << "                             listing the directories it had already read\n"
+              << "  --walk-jobs <N>            Read directories with N threads (default: same as --jobs, 0: all cores)\n"
+              << "  --copy-jobs <N>            Threads copying files whose target is on another filesystem\n"
+              << "                             (reflink when possible; default: 2, 0: all cores)\n"
+              << "\nExamples:\n"
+              << "  " << program_name << " -v /path/to/source\n"
+              << "  " << program_name << " --dry-run --time modification --small 2 --medium 20 /path/to/source\n"
+              << "  " << program_name << " --jobs 8 /path/to/source\n"
+              << "  " << program_name << " --plan tonight.plan /path/to/source && "
+              << program_name << " --apply tonight.plan\n";
+}
+
+// Function to parse a category mapping such as "jpg,png=images" or
+// "jpg, png -> images" into (extension, bucket) pairs
+bool parse_category(const std::string& str, std::vector<std::pair<std::string, std::string>>& categories_out) {
+    auto trim = [](std::string text) {
+        size_t begin = text.find_first_not_of(" \t");
+        size_t end = text.find_last_not_of(" \t");
+        return begin == std::string::npos ? std::string() : text.substr(begin, end - begin + 1);
+    };
+
+    size_t separator = str.find("->");
+    size_t separator_length = 2;
+    if (separator == std::string::npos) {
+        separator = str.find('=');
+        separator_length = 1;
+    }
+    if (separator == std::string::npos) {
+        return false;
+    }
+    std::string bucket = trim(str.substr(separator + separator_length));
+    if (bucket.empty() || bucket == "." || bucket == ".." || bucket.find('/') != std::string::npos) {
+        return false;
+    }
+
+    std::vector<std::pair<std::string, std::string>> parsed;
+    std::string extensions = str.substr(0, separator);
+    for (size_t begin = 0; begin <= extensions.size();) {
+        size_t comma = extensions.find(',', begin);
+        std::string extension = trim(extensions.substr(begin, comma == std::string::npos ? std::string::npos : comma - begin));
+        if (!extension.empty() && extension[0] == '.') {
+            extension.erase(0, 1);
+        }
+        if (extension.empty() || extension.find('/') != std::string::npos) {
+            return false;
+        }
+        parsed.emplace_back(extension, bucket);
+        if (comma == std::string::npos) {
+            break;
+        }
+        begin = comma + 1;
+    }
+    categories_out.insert(categories_out.end(), parsed.begin(), parsed.end());
+    return true;
+}
+
+// Function to parse size from string (in MB)
+bool parse_size(const std::string& str, uintmax_t& size_out) {
+    try {
+        size_out = std::stoull(str) * 1024 * 1024;
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+// Function to parse a worker count; 0 selects one worker per hardware thread
+bool parse_jobs(const std::string& str, unsigned& jobs_out) {
+    try {
+        size_t consumed = 0;
+        unsigned long value = std::stoul(str, &consumed);
+        if (consumed != str.size() || value > 1024) {
+            return false;
+        }
+        jobs_out = value == 0 ? std::max(1u, std::thread::hardware_concurrency())
+                              : static_cast<unsigned>(value);
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
+// Work-stealing thread pool. Each worker owns a deque: it pops its own tasks
+// from the back and steals from the front of other workers' deques when idle.
+// External submissions block once max_pending tasks are queued.
+class WorkStealingPool {
+public:
+    using Task = std::function<void()>;
+
+    WorkStealingPool(unsigned num_threads, size_t max_pending)
+        : max_pending_(std::max<size_t>(max_pending, 1)) {
+        num_threads = std::max(num_threads, 1u);
+        for (unsigned i = 0; i < num_threads; ++i) {
+            queues_.emplace_back(std::make_unique<WorkerQueue>());
+        }
+        for (unsigned i = 0; i < num_threads; ++i) {
+            threads_.emplace_back(&WorkStealingPool::run, this, i);
+        }
+    }
+
+    ~WorkStealingPool() {
+        wait();
+        {
+            std::lock_guard<std::mutex> lock(state_mutex_);
+            stopping_ = true;
+        }
+        work_cv_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    // Queue a task. Tasks submitted from a worker go to that worker's own deque
+    // and never block; external submissions are spread round-robin.
+    void submit(Task task) {
+        size_t index;
+        {
+            std::unique_lock<std::mutex> lock(state_mutex_);
+            if (current_pool == this) {
+                index = current_index;
+            } else {
+                space_cv_.wait(lock, [this] { return queued_ < max_pending_; });
+                index = next_queue_++ % queues_.size();
+            }
+            ++queued_;
+            ++pending_;
+        }
+        {
+            std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+            queues_[index]->tasks.push_back(std::move(task));
+        }
+        work_cv_.notify_one();
+    }
+
+    // Block until every submitted task has finished
+    void wait() {
+        std::unique_lock<std::mutex> lock(state_mutex_);
+        idle_cv_.wait(lock, [this] { return pending_ == 0; });
+    }
+
+    size_t size() const {
+        return threads_.size();
+    }
+
+private:
+    struct WorkerQueue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    bool try_pop(size_t index, Task& task) {
+        WorkerQueue& queue = *queues_[index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) {
+            return false;
+        }
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    bool try_steal(size_t thief, Task& task) {
+        for (size_t offset = 1; offset < queues_.size(); ++offset) {
+            WorkerQueue& queue = *queues_[(thief + offset) % queues_.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.tasks.empty()) {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(size_t index) {
+        current_pool = this;
+        current_index = index;
+        for (;;) {
+            Task task;
+            if (try_pop(index, task) || try_steal(index, task)) {
+                {
+                    std::lock_guard<std::mutex> lock(state_mutex_);
+                    --queued_;
+                }
+                space_cv_.notify_one();
+                try {
+                    task();
+                } catch (const std::exception& e) {
+                    std::lock_guard<std::mutex> lock(output_mutex);
+                    std::cerr << "Error: Worker task failed: " << e.what() << "\n";
+                }
+                bool idle;
+                {
+                    std::lock_guard<std::mutex> lock(state_mutex_);
+                    idle = (--pending_ == 0);
+                }
+                if (idle) {
+                    idle_cv_.notify_all();
+                }
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(state_mutex_);
+            if (stopping_ && queued_ == 0) {
+                return;
+            }
+            work_cv_.wait(lock, [this] { return stopping_ || queued_ > 0; });
+        }
+    }
+
+    static thread_local WorkStealingPool* current_pool;
+    static thread_local size_t current_index;
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues_;
+    std::vector<std::thread> threads_;
+    std::mutex state_mutex_;
+    std::condition_variable work_cv_;
+    std::condition_variable space_cv_;
+    std::condition_variable idle_cv_;
+    size_t max_pending_;
+    size_t queued_ = 0;   // Tasks sitting in a deque
+    size_t pending_ = 0;  // Tasks queued or running
+    size_t next_queue_ = 0;
+    bool stopping_ = false;
+};
+
+thread_local WorkStealingPool* WorkStealingPool::current_pool = nullptr;
+thread_local size_t WorkStealingPool::current_index = 0;
+
+// Set of target paths currently being resolved or moved into. It guarantees
+// that two workers never pick the same name, and that files racing for the
+// same target are compared and moved one after another.
+class TargetReservations {
+public:
+    // Wait until the path is free, then reserve it
+    void acquire(const std::string& path) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        released_cv_.wait(lock, [&] { return reserved_.count(path) == 0; });
+        reserved_.insert(path);
+    }
+
+    // Reserve the path only if nobody else holds it
+    bool try_acquire(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return reserved_.insert(path).second;
+    }
+
+    void release(const std::string& path) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            reserved_.erase(path);
+        }
+        released_cv_.notify_all();
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable released_cv_;
+    std::unordered_set<std::string> reserved_;
+};
+
+// Releases every reservation taken while resolving one move
+class ReservationGuard {
+public:
+    explicit ReservationGuard(TargetReservations& reservations) : reservations_(reservations) {}
+    ~ReservationGuard() {
+        for (const auto& path : held_) {
+            reservations_.release(path);
+        }
+    }
+
+    ReservationGuard(const ReservationGuard&) = delete;
+    ReservationGuard& operator=(const ReservationGuard&) = delete;
+
+    void acquire(const std::string& path) {
+        reservations_.acquire(path);
+        held_.push_back(path);
+    }
+
+    bool try_acquire(const std::string& path) {
+        if (!reservations_.try_acquire(path)) {
+            return false;
+        }
+        held_.push_back(path);
+        return true;
+    }
+
+    // Release everything now instead of at scope exit
+    void release() {
+        for (const auto& path : held_) {
+            reservations_.release(path);
+        }
+        held_.clear();
+    }
+
+private:
+    TargetReservations& reservations_;
+    std::vector<std::string> held_;
+};
+
+// Owns a file descriptor and closes it on scope exit
+class ScopedFd {
+public:
+    explicit ScopedFd(int fd = -1) : fd_(fd) {}
+    ~ScopedFd() {
+        if (fd_ >= 0) {
+            close(fd_);
+        }
+    }
+
+    ScopedFd(ScopedFd&& other) noexcept : fd_(other.fd_) {
+        other.fd_ = -1;
+    }
+    ScopedFd& operator=(ScopedFd&& other) noexcept {
+        if (this != &other) {
+            if (fd_ >= 0) {
+                close(fd_);
+            }
+            fd_ = other.fd_;
+            other.fd_ = -1;
+        }
+        return *this;
+    }
+
+    ScopedFd(const ScopedFd&) = delete;
+    ScopedFd& operator=(const ScopedFd&) = delete;
+
+    int get() const {
+        return fd_;
+    }
+
+    bool valid() const {
+        return fd_ >= 0;
+    }
+
+private:
+    int fd_;
+};
+
+// Page-aligned read buffer, suitable for large sequential reads
+struct AlignedBuffer {
+    explicit AlignedBuffer(size_t size) : size(size) {
+        void* ptr = nullptr;
+        if (posix_memalign(&ptr, 4096, size) != 0) {
+            throw std::bad_alloc();
+        }
+        data.reset(static_cast<char*>(ptr));
+    }
+
+    struct FreeDeleter {
+        void operator()(char* ptr) const {
+            free(ptr);
+        }
+    };
+
+    std::unique_ptr<char, FreeDeleter> data;
+    size_t size;
+};
+
+// Read exactly length bytes at offset, retrying on short reads
+static bool pread_full(int fd, char* buffer, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t n = pread(fd, buffer, length, offset);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (n == 0) {
+            return false; // File shrank underneath us
+        }
+        buffer += n;
+        length -= static_cast<size_t>(n);
+        offset += n;
+    }
+    return true;
+}
+
+// Compare the byte range [offset, offset + length) of two open files
+static bool ranges_equal(int fd_a, int fd_b, off_t offset, uintmax_t length,
+                         AlignedBuffer& buf_a, AlignedBuffer& buf_b) {
+    while (length > 0) {
+        size_t chunk = static_cast<size_t>(std::min<uintmax_t>(length, buf_a.size));
+        if (!pread_full(fd_a, buf_a.data.get(), chunk, offset) ||
+            !pread_full(fd_b, buf_b.data.get(), chunk, offset)) {
+            return false;
+        }
+        count_bytes_compared(2 * chunk);
+        if (memcmp(buf_a.data.get(), buf_b.data.get(), chunk) != 0) {
+            return false;
+        }
+        offset += static_cast<off_t>(chunk);
+        length -= chunk;
+    }
+    return true;
+}
+
+// Function to check whether two files have identical contents. The checks are
+// tiered from cheapest to most expensive and stop at the first mismatch: sizes,
+// then the first and last chunks (where differing files usually diverge), then
+// a streaming comparison of the remainder. Memory use is two fixed buffers no
+// matter how large the files are. Unreadable files are treated as different.
+// With samples_only set the streaming pass is skipped, so a true result only
+// means the files could be identical.
+bool files_identical(const fs::path& source_file, const fs::path& target_file, uintmax_t source_size,
+                     bool samples_only = false) {
+    constexpr size_t sample_size = 64 * 1024;
+    constexpr size_t stream_buffer_size = 1024 * 1024;
+    OpTimer timer(OpClass::Compare);
+
+    FileMetadata target_meta;
+    if (!get_file_metadata(target_file, target_meta) || target_meta.size != source_size) {
+        return false;
+    }
+
+    ScopedFd source_fd(open(source_file.c_str(), O_RDONLY | O_CLOEXEC));
+    ScopedFd target_fd(open(target_file.c_str(), O_RDONLY | O_CLOEXEC));
+    if (!source_fd.valid() || !target_fd.valid()) {
+        return false;
+    }
+
+    const uintmax_t size = source_size;
+    if (size <= 2 * sample_size) {
+        AlignedBuffer buf_a(2 * sample_size), buf_b(2 * sample_size);
+        return ranges_equal(source_fd.get(), target_fd.get(), 0, size, buf_a, buf_b);
+    }
+
+    // Head and tail samples
+    {
+        AlignedBuffer buf_a(sample_size), buf_b(sample_size);
+        if (!ranges_equal(source_fd.get(), target_fd.get(), 0, sample_size, buf_a, buf_b) ||
+            !ranges_equal(source_fd.get(), target_fd.get(), static_cast<off_t>(size - sample_size),
+                          sample_size, buf_a, buf_b)) {
+            return false;
+        }
+    }
+    if (samples_only) {
+        return true;
+    }
+
+    // Full streaming pass over the middle
+    posix_fadvise(source_fd.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(target_fd.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+    AlignedBuffer buf_a(stream_buffer_size), buf_b(stream_buffer_size);
+    return ranges_equal(source_fd.get(), target_fd.get(), sample_size, size - 2 * sample_size, buf_a, buf_b);
+}
+
+// Streaming XXH64, a fast non-cryptographic 64-bit hash
+class Xxh64 {
+public:
+    explicit Xxh64(uint64_t seed = 0) {
+        acc_[0] = seed + prime1 + prime2;
+        acc_[1] = seed + prime2;
+        acc_[2] = seed;
+        acc_[3] = seed - prime1;
+        seed_ = seed;
+    }
+
+    void update(const void* data, size_t length) {
+        const unsigned char* p = static_cast<const unsigned char*>(data);
+        total_ += length;
+        if (buffered_ + length < sizeof(buffer_)) {
+            memcpy(buffer_ + buffered_, p, length);
+            buffered_ += length;
+            return;
+        }
+        if (buffered_ > 0) {
+            size_t fill = sizeof(buffer_) - buffered_;
+            memcpy(buffer_ + buffered_, p, fill);
+            consume_stripe(buffer_);
+            p += fill;
+            length -= fill;
+            buffered_ = 0;
+        }
+        while (length >= sizeof(buffer_)) {
+            consume_stripe(p);
+            p += sizeof(buffer_);
+            length -= sizeof(buffer_);
+        }
+        memcpy(buffer_, p, length);
+        buffered_ = length;
+    }
+
+    uint64_t digest() const {
+        uint64_t h;
+        if (total_ >= sizeof(buffer_)) {
+            h = rotl(acc_[0], 1) + rotl(acc_[1], 7) + rotl(acc_[2], 12) + rotl(acc_[3], 18);
+            for (uint64_t acc : acc_) {
+                h = (h ^ round(0, acc)) * prime1 + prime4;
+            }
+        } else {
+            h = seed_ + prime5;
+        }
+        h += total_;
+
+        const unsigned char* p = buffer_;
+        size_t length = buffered_;
+        while (length >= 8) {
+            h ^= round(0, read64(p));
+            h = rotl(h, 27) * prime1 + prime4;
+            p += 8;
+            length -= 8;
+        }
+        if (length >= 4) {
+            h ^= static_cast<uint64_t>(read32(p)) * prime1;
+            h = rotl(h, 23) * prime2 + prime3;
+            p += 4;
+            length -= 4;
+        }
+        while (length > 0) {
+            h ^= (*p) * prime5;
+            h = rotl(h, 11) * prime1;
+            ++p;
+            --length;
+        }
+
+        h ^= h >> 33;
+        h *= prime2;
+        h ^= h >> 29;
+        h *= prime3;
+        h ^= h >> 32;
+        return h;
+    }
+
+    static uint64_t hash(const void* data, size_t length, uint64_t seed = 0) {
+        Xxh64 state(seed);
+        state.update(data, length);
+        return state.digest();
+    }
+
+private:
+    static constexpr uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+    static constexpr uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+    static constexpr uint64_t prime3 = 0x165667B19E3779F9ULL;
+    static constexpr uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+    static constexpr uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+
+    static uint64_t rotl(uint64_t x, int r) {
+        return (x << r) | (x >> (64 - r));
+    }
+    static uint64_t read64(const unsigned char* p) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    static uint32_t read32(const unsigned char* p) {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    static uint64_t round(uint64_t acc, uint64_t input) {
+        acc += input * prime2;
+        return rotl(acc, 31) * prime1;
+    }
+
+    void consume_stripe(const unsigned char* p) {
+        for (int i = 0; i < 4; ++i) {
+            acc_[i] = round(acc_[i], read64(p + 8 * i));
+        }
+    }
+
+    uint64_t acc_[4];
+    uint64_t seed_;
+    uint64_t total_ = 0;
+    unsigned char buffer_[32];
+    size_t buffered_ = 0;
+};
+
+// Function to hash a file's full contents with a bounded streaming buffer
+bool hash_file(const fs::path& file_path, uint64_t& hash_out) {
+    constexpr size_t stream_buffer_size = 1024 * 1024;
+    OpTimer timer(OpClass::Hash);
+
+    ScopedFd fd(open(file_path.c_str(), O_RDONLY | O_CLOEXEC));
+    if (!fd.valid()) {
+        return false;
+    }
+    posix_fadvise(fd.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    AlignedBuffer buffer(stream_buffer_size);
+    Xxh64 state;
+    for (;;) {
+        ssize_t n = read(fd.get(), buffer.data.get(), buffer.size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        if (n == 0) {
+            break;
+        }
+        state.update(buffer.data.get(), static_cast<size_t>(n));
+        count_bytes_hashed(static_cast<uint64_t>(n));
+    }
+    hash_out = state.digest();
+    return true;
+}
+
+// Nanoseconds since the epoch, as stored in the content index
+static int64_t to_nanoseconds(std::chrono::system_clock::time_point time) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+// Write all of data, retrying short writes and EINTR
+static bool write_all(int fd, const void* data, size_t length) {
+    const char* p = static_cast<const char*>(data);
+    while (length > 0) {
+        ssize_t n = write(fd, p, length);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        length -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Compact list of file paths. Each directory string is stored once and a
+// file is a directory id plus a NUL-terminated name in one shared arena, so
+// walker batches and whole-tree plans cost a few bytes per file instead of a
+// separately allocated full path each.
+class FileTable {
+public:
+    size_t size() const { return directory_.size(); }
+    bool empty() const { return directory_.empty(); }
+
+    void reserve(size_t files, size_t name_bytes) {
+        directory_.reserve(files);
+        name_offset_.reserve(files);
+        name_length_.reserve(files);
+        names_.reserve(name_bytes);
+    }
+
+    // Id for directory, adding it on first use. Consecutive files almost
+    // always share a directory, so the last id is checked before the map.
+    uint32_t intern_directory(const std::string& directory) {
+        if (!directories_.empty() && directories_[last_directory_] == directory) {
+            return last_directory_;
+        }
+        auto it = directory_ids_.find(directory);
+        if (it == directory_ids_.end()) {
+            it = directory_ids_.emplace(directory, static_cast<uint32_t>(directories_.size())).first;
+            directories_.push_back(directory);
+        }
+        last_directory_ = it->second;
+        return last_directory_;
+    }
+
+    const std::string& directory_name(uint32_t id) const { return directories_[id]; }
+
+    // Append a file by directory id and name; returns its index
+    size_t add(uint32_t directory, const char* name, size_t name_length) {
+        directory_.push_back(directory);
+        name_offset_.push_back(names_.size());
+        name_length_.push_back(static_cast<uint8_t>(std::min<size_t>(name_length, UINT8_MAX)));
+        names_.append(name, name_length);
+        names_.push_back('\0');
+        return directory_.size() - 1;
+    }
+
+    // Append a file by its full path
+    size_t add(const std::string& file_path) {
+        size_t slash = file_path.rfind('/');
+        if (slash == std::string::npos) {
+            return add(intern_directory("."), file_path.c_str(), file_path.size());
+        }
+        // Keep the slash of the filesystem root so "/" stays a valid directory
+        directory_scratch_.assign(file_path, 0, slash == 0 ? 1 : slash);
+        return add(intern_directory(directory_scratch_), file_path.c_str() + slash + 1,
+                   file_path.size() - slash - 1);
+    }
+
+    uint32_t directory_id(size_t i) const { return directory_[i]; }
+    const std::string& directory(size_t i) const { return directories_[directory_[i]]; }
+    const char* name(size_t i) const { return names_.data() + name_offset_[i]; }
+    size_t name_length(size_t i) const { return name_length_[i]; }
+
+    // Full path of file i, built on demand
+    fs::path path(size_t i) const {
+        const std::string& dir = directory(i);
+        std::string full;
+        full.reserve(dir.size() + 1 + name_length(i));
+        full += dir;
+        if (full.back() != '/') {
+            full += '/';
+        }
+        full.append(name(i), name_length(i));
+        return fs::path(std::move(full));
+    }
+
+private:
+    std::vector<std::string> directories_;
+    std::unordered_map<std::string, uint32_t> directory_ids_;
+    uint32_t last_directory_ = 0;
+    std::string directory_scratch_;
+
+    // One entry per file
+    std::vector<uint32_t> directory_;
+    std::vector<uint64_t> name_offset_;
+    std::vector<uint8_t> name_length_;  // NAME_MAX is 255
+    std::string names_;
+};
+
+// Persistent map of organized files to their content hashes, stored as a
+// memory-mapped file in the source root. Entries are keyed by the path
+// relative to the root and are trusted only while the file's size and mtime
+// still match, so a stale entry costs a re-hash and never a wrong answer.
+// Duplicates left in place by --dedup are kept too, so they aren't read
+// again, but they are never offered as the copy to match against.
+//
+// File layout (native endianness):
+//   IndexHeader
+//   IndexRecord[count]       sorted by path_hash, for lookups by path
+//   uint32_t[count]          record numbers sorted by (size, content_hash)
+//   char[strings_size]       relative paths, not NUL-terminated
+class ContentIndex {
+public:
+    explicit ContentIndex(fs::path root) : root_(std::move(root)) {}
+
+    ~ContentIndex() {
+        if (map_ != nullptr) {
+            munmap(const_cast<char*>(map_), map_size_);
+        }
+    }
+
+    ContentIndex(const ContentIndex&) = delete;
+    ContentIndex& operator=(const ContentIndex&) = delete;
+
+    fs::path index_file() const {
+        return root_ / (std::string(state_file_prefix) + ".index");
+    }
+
+    // Map the index file. A missing file is an empty index; a corrupt one is
+    // reported and ignored so the run can rebuild it.
+    void load() {
+        fs::path path = index_file();
+        ScopedFd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        if (!fd.valid()) {
+            return;
+        }
+        struct stat sb;
+        if (fstat(fd.get(), &sb) != 0 || static_cast<size_t>(sb.st_size) < sizeof(IndexHeader)) {
+            report_corrupt(path);
+            return;
+        }
+        size_t size = static_cast<size_t>(sb.st_size);
+        void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+        if (map == MAP_FAILED) {
+            report_corrupt(path);
+            return;
+        }
+
+        // Bounding count and strings_size by the file size first keeps the
+        // sum below from wrapping around to match it
+        const auto* header = static_cast<const IndexHeader*>(map);
+        if (memcmp(header->magic, index_magic, sizeof(header->magic)) != 0 ||
+            header->count > size || header->strings_size > size ||
+            sizeof(IndexHeader) + header->count * (sizeof(IndexRecord) + sizeof(uint32_t)) +
+                header->strings_size != size) {
+            munmap(map, size);
+            report_corrupt(path);
+            return;
+        }
+
+        const char* base = static_cast<const char*>(map);
+        const auto* records = reinterpret_cast<const IndexRecord*>(base + sizeof(IndexHeader));
+        const auto* by_content = reinterpret_cast<const uint32_t*>(records + header->count);
+        if (!entries_in_bounds(records, by_content, header->count, header->strings_size)) {
+            munmap(map, size);
+            report_corrupt(path);
+            return;
+        }
+
+        map_ = base;
+        map_size_ = size;
+        count_ = header->count;
+        records_ = records;
+        by_content_ = by_content;
+        strings_ = reinterpret_cast<const char*>(by_content_ + count_);
+        strings_size_ = header->strings_size;
+    }
+
+    // Write the merged index to a temporary file and rename it into place
+    bool save() const {
+        std::vector<IndexRecord> records;
+        std::string strings;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (size_t i = 0; i < count_; ++i) {
+                std::string path = record_path(records_[i]);
+                if (overlay_.count(path) == 0) {
+                    append_record(records, strings, path, records_[i].size, records_[i].mtime_ns,
+                                  records_[i].content_hash, records_[i].flags);
+                }
+            }
+            for (const auto& item : overlay_) {
+                if (!item.second.removed) {
+                    append_record(records, strings, item.first, item.second.size, item.second.mtime_ns,
+                                  item.second.content_hash, item.second.duplicate ? duplicate_flag : 0);
+                }
+            }
+        }
+
+        std::sort(records.begin(), records.end(), [](const IndexRecord& a, const IndexRecord& b) {
+            return a.path_hash < b.path_hash;
+        });
+        std::vector<uint32_t> by_content(records.size());
+        for (size_t i = 0; i < by_content.size(); ++i) {
+            by_content[i] = static_cast<uint32_t>(i);
+        }
+        std::sort(by_content.begin(), by_content.end(), [&](uint32_t a, uint32_t b) {
+            return content_key(records[a]) < content_key(records[b]);
+        });
+
+        IndexHeader header;
+        memcpy(header.magic, index_magic, sizeof(header.magic));
+        header.count = records.size();
+        header.strings_size = strings.size();
+
+        fs::path path = index_file();
+        fs::path temp_path = path;
+        temp_path += ".tmp";
+        ScopedFd fd(open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+        bool ok = fd.valid() &&
+                  write_all(fd.get(), &header, sizeof(header)) &&
+                  write_all(fd.get(), records.data(), records.size() * sizeof(IndexRecord)) &&
+                  write_all(fd.get(), by_content.data(), by_content.size() * sizeof(uint32_t)) &&
+                  write_all(fd.get(), strings.data(), strings.size()) &&
+                  fdatasync(fd.get()) == 0;
+        if (!ok || rename(temp_path.c_str(), path.c_str()) != 0) {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cerr << "Error: Unable to write content index \"" << path << "\": " << strerror(errno) << "\n";
+            unlink(temp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Cached hash of file_path if the index entry still matches its size and mtime
+    bool lookup(const fs::path& file_path, uint64_t size, int64_t mtime_ns, uint64_t& hash_out) const {
+        std::string key = relative_key(file_path);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = overlay_.find(key);
+            if (it != overlay_.end()) {
+                if (it->second.removed || it->second.size != size || it->second.mtime_ns != mtime_ns) {
+                    return false;
+                }
+                hash_out = it->second.content_hash;
+                return true;
+            }
+        }
+        const IndexRecord* record = find_mapped(key);
+        if (record == nullptr || record->size != size || record->mtime_ns != mtime_ns) {
+            return false;
+        }
+        hash_out = record->content_hash;
+        return true;
+    }
+
+    void record(const fs::path& file_path, uint64_t size, int64_t mtime_ns, uint64_t content_hash) {
+        std::string key = relative_key(file_path);
+        std::lock_guard<std::mutex> lock(mutex_);
+        overlay_[key] = OverlayEntry{size, mtime_ns, content_hash, false, false};
+        overlay_by_content_.emplace(std::make_pair(size, content_hash), key);
+        overlay_sizes_.insert(size);
+    }
+
+    // Remember the hash of a duplicate that stays where it is, without making
+    // it a candidate for find_content
+    void record_duplicate(const fs::path& file_path, uint64_t size, int64_t mtime_ns, uint64_t content_hash) {
+        std::string key = relative_key(file_path);
+        std::lock_guard<std::mutex> lock(mutex_);
+        overlay_[key] = OverlayEntry{size, mtime_ns, content_hash, false, true};
+    }
+
+    void forget(const fs::path& file_path) {
+        std::string key = relative_key(file_path);
+        std::lock_guard<std::mutex> lock(mutex_);
+        overlay_[key] = OverlayEntry{0, 0, 0, true, false};
+    }
+
+    // Whether any indexed file has this size; lets dedup skip hashing unique sizes
+    bool has_size(uint64_t size) const {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (overlay_sizes_.count(size) != 0) {
+                return true;
+            }
+        }
+        auto range = mapped_content_range(size, 0, true);
+        return range.first != range.second;
+    }
+
+    // Absolute paths of indexed files with this size and content hash
+    std::vector<fs::path> find_content(uint64_t size, uint64_t content_hash) const {
+        std::vector<fs::path> paths;
+        auto range = mapped_content_range(size, content_hash, false);
+        for (const uint32_t* it = range.first; it != range.second; ++it) {
+            if ((records_[*it].flags & duplicate_flag) == 0) {
+                paths.push_back(root_ / record_path(records_[*it]));
+            }
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto overlay_range = overlay_by_content_.equal_range(std::make_pair(size, content_hash));
+        for (auto it = overlay_range.first; it != overlay_range.second; ++it) {
+            if (!overlay_.at(it->second).duplicate) {
+                paths.push_back(root_ / it->second);
+            }
+        }
+        return paths;
+    }
+
+private:
+    static constexpr char index_magic[8] = {'F', 'O', 'I', 'D', 'X', '0', '0', '1'};
+
+    // IndexRecord::flags
+    static constexpr uint32_t duplicate_flag = 1;  // Left in place by --dedup
+
+    struct IndexHeader {
+        char magic[8];
+        uint64_t count;
+        uint64_t strings_size;
+    };
+
+    struct IndexRecord {
+        uint64_t path_hash;
+        uint64_t size;
+        int64_t mtime_ns;
+        uint64_t content_hash;
+        uint64_t path_offset;
+        uint32_t path_length;
+        uint32_t flags;
+    };
+
+    struct OverlayEntry {
+        uint64_t size;
+        int64_t mtime_ns;
+        uint64_t content_hash;
+        bool removed;
+        bool duplicate;
+    };
+
+    static std::pair<uint64_t, uint64_t> content_key(const IndexRecord& record) {
+        return {record.size, record.content_hash};
+    }
+
+    static void report_corrupt(const fs::path& path) {
+        std::lock_guard<std::mutex> lock(output_mutex);
+        std::cerr << "Warning: Ignoring unreadable content index \"" << path << "\"; it will be rebuilt.\n";
+    }
+
+    static void append_record(std::vector<IndexRecord>& records, std::string& strings, const std::string& path,
+                              uint64_t size, int64_t mtime_ns, uint64_t content_hash, uint32_t flags) {
+        IndexRecord record{};
+        record.path_hash = Xxh64::hash(path.data(), path.size());
+        record.size = size;
+        record.mtime_ns = mtime_ns;
+        record.content_hash = content_hash;
+        record.path_offset = strings.size();
+        record.path_length = static_cast<uint32_t>(path.size());
+        record.flags = flags;
+        records.push_back(record);
+        strings += path;
+    }
+
+    // Check once at load time that every record's path lies inside the
+    // strings and every by_content entry names a record, so lookups can
+    // index the mapping directly
+    static bool entries_in_bounds(const IndexRecord* records, const uint32_t* by_content, size_t count,
+                                  uint64_t strings_size) {
+        for (size_t i = 0; i < count; ++i) {
+            if (records[i].path_length > strings_size ||
+                records[i].path_offset > strings_size - records[i].path_length || by_content[i] >= count) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::string relative_key(const fs::path& file_path) const {
+        return file_path.lexically_relative(root_).generic_string();
+    }
+
+    std::string record_path(const IndexRecord& record) const {
+        return std::string(strings_ + record.path_offset, record.path_length);
+    }
+
+    // Binary search the mapped records by path hash, then confirm the path
+    const IndexRecord* find_mapped(const std::string& key) const {
+        uint64_t path_hash = Xxh64::hash(key.data(), key.size());
+        const IndexRecord* end = records_ + count_;
+        const IndexRecord* it = std::lower_bound(records_, end, path_hash,
+            [](const IndexRecord& record, uint64_t value) { return record.path_hash < value; });
+        for (; it != end && it->path_hash == path_hash; ++it) {
+            if (record_path(*it) == key) {
+                return it;
+            }
+        }
+        return nullptr;
+    }
+
+    // Range of by_content entries matching size (and content_hash unless size_only)
+    std::pair<const uint32_t*, const uint32_t*> mapped_content_range(uint64_t size, uint64_t content_hash,
+                                                                     bool size_only) const {
+        const uint32_t* begin = by_content_;
+        const uint32_t* end = by_content_ + count_;
+        auto key_of = [this](uint32_t index) { return content_key(records_[index]); };
+        if (size_only) {
+            begin = std::lower_bound(begin, end, size,
+                [&](uint32_t index, uint64_t value) { return key_of(index).first < value; });
+            end = std::upper_bound(begin, end, size,
+                [&](uint64_t value, uint32_t index) { return value < key_of(index).first; });
+            return {begin, end};
+        }
+        auto key = std::make_pair(size, content_hash);
+        begin = std::lower_bound(begin, end, key,
+            [&](uint32_t index, const std::pair<uint64_t, uint64_t>& value) { return key_of(index) < value; });
+        end = std::upper_bound(begin, end, key,
+            [&](const std::pair<uint64_t, uint64_t>& value, uint32_t index) { return value < key_of(index); });
+        return {begin, end};
+    }
+
+    fs::path root_;
+    const char* map_ = nullptr;
+    size_t map_size_ = 0;
+    size_t count_ = 0;
+    const IndexRecord* records_ = nullptr;
+    const uint32_t* by_content_ = nullptr;
+    const char* strings_ = nullptr;
+    size_t strings_size_ = 0;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, OverlayEntry> overlay_;
+    std::multimap<std::pair<uint64_t, uint64_t>, std::string> overlay_by_content_;
+    std::unordered_set<uint64_t> overlay_sizes_;
+};
+
+constexpr char ContentIndex::index_magic[8];
+constexpr uint32_t ContentIndex::duplicate_flag;
+
+// What a plan entry asks the apply step to do
+enum class PlanAction : uint32_t {
+    Move = 0,     // Move source to target, resolving collisions at apply time
+    InPlace = 1   // Already organized; recorded so plans can be compared
+};
+
+// Organization plan for one source root: every (source, target, action)
+// decided by a planning run, written sorted by source so two plans of the
+// same tree compare byte for byte when nothing changed. The apply step maps
+// the file and moves entries without walking or stat'ing the tree.
+//
+// While planning, decisions are kept as columns: sources in a FileTable of
+// root-relative directories, targets as a directory id in the same table
+// (the name is the source's unless the classifier renamed it), and size,
+// mtime, hash and action alongside. A whole-tree plan therefore costs a few
+// dozen bytes per file.
+//
+// File layout (native endianness):
+//   PlanHeader
+//   PlanRecord[count]        sorted by source directory, then name
+//   char[strings_size]       root, then relative source/target paths
+class OrganizePlan {
+public:
+    struct Entry {
+        fs::path source;
+        fs::path target;
+        PlanAction action;
+        FileMetadata meta;                  // Size and mtime as seen by the planner
+        std::optional<uint64_t> content_hash;
+    };
+
+    explicit OrganizePlan(fs::path root = fs::path()) : root_(std::move(root)) {}
+
+    ~OrganizePlan() {
+        if (map_ != nullptr) {
+            munmap(const_cast<char*>(map_), map_size_);
+        }
+    }
+
+    OrganizePlan(const OrganizePlan&) = delete;
+    OrganizePlan& operator=(const OrganizePlan&) = delete;
+
+    const fs::path& root() const { return root_; }
+    size_t size() const { return count_; }
+
+    // Add one decision; called concurrently by the planning workers
+    void add(const fs::path& source, const fs::path& target, PlanAction action, const FileMetadata& meta,
+             const std::optional<uint64_t>& content_hash) {
+        std::string source_directory = relative_directory(source);
+        std::string target_directory = relative_directory(target);
+        const std::string source_name = source.filename().native();
+        const std::string target_name = target.filename().native();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t i = sources_.add(sources_.intern_directory(source_directory), source_name.c_str(), source_name.size());
+        target_directory_.push_back(sources_.intern_directory(target_directory));
+        if (target_name != source_name) {
+            renamed_targets_.emplace(i, target_name);
+        }
+        action_.push_back(static_cast<uint8_t>(action));
+        has_hash_.push_back(content_hash.has_value());
+        size_.push_back(meta.size);
+        mtime_ns_.push_back(to_nanoseconds(meta.mtime));
+        content_hash_.push_back(content_hash.value_or(0));
+    }
+
+    // Write the collected decisions to path through a temporary file
+    bool save(const fs::path& path) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::vector<uint32_t> order(sources_.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = static_cast<uint32_t>(i);
+        }
+        std::sort(order.begin(), order.end(), [this](uint32_t a, uint32_t b) {
+            int by_directory = sources_.directory(a).compare(sources_.directory(b));
+            return by_directory != 0 ? by_directory < 0 : strcmp(sources_.name(a), sources_.name(b)) < 0;
+        });
+
+        std::string strings = root_.native();
+        std::vector<PlanRecord> records;
+        records.reserve(order.size());
+        for (uint32_t i : order) {
+            PlanRecord record{};
+            record.size = size_[i];
+            record.mtime_ns = mtime_ns_[i];
+            record.content_hash = content_hash_[i];
+            record.source_offset = strings.size();
+            append_relative(strings, sources_.directory(i), sources_.name(i), sources_.name_length(i));
+            record.source_length = static_cast<uint32_t>(strings.size() - record.source_offset);
+            record.target_offset = strings.size();
+            auto renamed = renamed_targets_.find(i);
+            if (renamed != renamed_targets_.end()) {
+                append_relative(strings, sources_.directory_name(target_directory_[i]), renamed->second.c_str(),
+                                renamed->second.size());
+            } else {
+                append_relative(strings, sources_.directory_name(target_directory_[i]), sources_.name(i),
+                                sources_.name_length(i));
+            }
+            record.target_length = static_cast<uint32_t>(strings.size() - record.target_offset);
+            record.action = action_[i];
+            record.flags = has_hash_[i] ? record_has_hash : 0;
+            records.push_back(record);
+        }
+
+        PlanHeader header;
+        memcpy(header.magic, plan_magic, sizeof(header.magic));
+        header.count = records.size();
+        header.strings_size = strings.size();
+        header.root_length = root_.native().size();
+
+        fs::path temp_path = path;
+        temp_path += ".tmp";
+        ScopedFd fd(open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+        bool ok = fd.valid() &&
+                  write_all(fd.get(), &header, sizeof(header)) &&
+                  write_all(fd.get(), records.data(), records.size() * sizeof(PlanRecord)) &&
+                  write_all(fd.get(), strings.data(), strings.size()) &&
+                  fdatasync(fd.get()) == 0;
+        if (!ok || rename(temp_path.c_str(), path.c_str()) != 0) {
+            std::lock_guard<std::mutex> output_lock(output_mutex);
+            std::cerr << "Error: Unable to write plan \"" << path << "\": " << strerror(errno) << "\n";
+            unlink(temp_path.c_str());
+            return false;
+        }
+        count_ = records.size();
+        return true;
+    }
+
+    // Map a plan written by save(); the root is taken from the file
+    bool load(const fs::path& path) {
+        ScopedFd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        if (!fd.valid()) {
+            std::cerr << "Error: Unable to open plan \"" << path << "\": " << strerror(errno) << "\n";
+            return false;
+        }
+        struct stat sb;
+        if (fstat(fd.get(), &sb) != 0 || static_cast<size_t>(sb.st_size) < sizeof(PlanHeader)) {
+            std::cerr << "Error: \"" << path << "\" is not a plan file.\n";
+            return false;
+        }
+        size_t size = static_cast<size_t>(sb.st_size);
+        void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd.get(), 0);
+        if (map == MAP_FAILED) {
+            std::cerr << "Error: Unable to map plan \"" << path << "\": " << strerror(errno) << "\n";
+            return false;
+        }
+
+        const auto* header = static_cast<const PlanHeader*>(map);
+        bool valid = memcmp(header->magic, plan_magic, sizeof(header->magic)) == 0 &&
+                     header->count <= size / sizeof(PlanRecord) &&
+                     sizeof(PlanHeader) + header->count * sizeof(PlanRecord) + header->strings_size == size &&
+                     header->root_length <= header->strings_size;
+        const auto* records = reinterpret_cast<const PlanRecord*>(static_cast<const char*>(map) + sizeof(PlanHeader));
+        for (size_t i = 0; valid && i < header->count; ++i) {
+            valid = records[i].source_offset + records[i].source_length <= header->strings_size &&
+                    records[i].target_offset + records[i].target_length <= header->strings_size &&
+                    records[i].action <= static_cast<uint32_t>(PlanAction::InPlace);
+        }
+        if (!valid) {
+            munmap(map, size);
+            std::cerr << "Error: \"" << path << "\" is not a valid plan file.\n";
+            return false;
+        }
+
+        map_ = static_cast<const char*>(map);
+        map_size_ = size;
+        count_ = header->count;
+        records_ = records;
+        strings_ = reinterpret_cast<const char*>(records_ + count_);
+        root_ = std::string(strings_, header->root_length);
+        return true;
+    }
+
+    // Decode entry i of a loaded plan
+    void entry(size_t i, Entry& out) const {
+        const PlanRecord& record = records_[i];
+        out.source = root_ / std::string(strings_ + record.source_offset, record.source_length);
+        out.target = root_ / std::string(strings_ + record.target_offset, record.target_length);
+        out.action = static_cast<PlanAction>(record.action);
+        out.meta = FileMetadata();
+        out.meta.size = record.size;
+        out.meta.mtime = std::chrono::system_clock::time_point(
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(record.mtime_ns)));
+        out.meta.mode = S_IFREG;
+        out.content_hash.reset();
+        if (record.flags & record_has_hash) {
+            out.content_hash = record.content_hash;
+        }
+    }
+
+private:
+    static constexpr char plan_magic[8] = {'F', 'O', 'P', 'L', 'A', 'N', '0', '1'};
+    static constexpr uint32_t record_has_hash = 1;
+
+    struct PlanHeader {
+        char magic[8];
+        uint64_t count;
+        uint64_t strings_size;
+        uint64_t root_length;
+    };
+
+    struct PlanRecord {
+        uint64_t size;
+        int64_t mtime_ns;
+        uint64_t content_hash;
+        uint64_t source_offset;
+        uint64_t target_offset;
+        uint32_t source_length;
+        uint32_t target_length;
+        uint32_t action;
+        uint32_t flags;
+    };
+
+    // Parent of file_path relative to the root, "." for the root itself
+    std::string relative_directory(const fs::path& file_path) const {
+        const std::string& path = file_path.native();
+        const std::string& root = root_.native();
+        size_t slash = path.rfind('/');
+        size_t prefix = root.back() == '/' ? root.size() : root.size() + 1;
+        if (slash == std::string::npos || slash < prefix || path.compare(0, root.size(), root) != 0) {
+            return ".";
+        }
+        return path.substr(prefix, slash - prefix);
+    }
+
+    static void append_relative(std::string& out, const std::string& directory, const char* name, size_t length) {
+        if (directory != ".") {
+            out += directory;
+            out += '/';
+        }
+        out.append(name, length);
+    }
+
+    fs::path root_;
+    const char* map_ = nullptr;
+    size_t map_size_ = 0;
+    size_t count_ = 0;
+    const PlanRecord* records_ = nullptr;
+    const char* strings_ = nullptr;
+
+    // Decisions collected while planning, one column entry per file
+    std::mutex mutex_;
+    FileTable sources_;
+    std::vector<uint32_t> target_directory_;
+    std::unordered_map<size_t, std::string> renamed_targets_;
+    std::vector<uint8_t> action_;
+    std::vector<uint8_t> has_hash_;
+    std::vector<uint64_t> size_;
+    std::vector<int64_t> mtime_ns_;
+    std::vector<uint64_t> content_hash_;
+};
+
+constexpr char OrganizePlan::plan_magic[8];
+
+// Per-directory state from the previous incremental run, kept in the source
+// root. A directory whose mtime still matches had no entry added, removed or
+// renamed since it was listed, so its files are known to be organized and
+// only its recorded subdirectories need a visit. Directories that held a
+// file the run failed on are left out so the next run lists them again.
+//
+// File layout (native endianness):
+//   SnapshotHeader
+//   SnapshotRecord[count]        one per directory, keyed by relative path
+//   ChildRecord[child_count]     subdirectory names, grouped per directory
+//   char[strings_size]           paths and names, not NUL-terminated
+class DirectorySnapshot {
+public:
+    struct Directory {
+        int64_t mtime_ns = 0;
+        uint64_t entry_count = 0;
+        std::vector<std::string> children;  // Subdirectory names
+    };
+
+    explicit DirectorySnapshot(fs::path root) : root_(std::move(root)) {}
+
+    fs::path snapshot_file() const {
+        return root_ / (std::string(state_file_prefix) + ".snapshot");
+    }
+
+    // Read the previous snapshot. Missing or unreadable means list everything.
+    void load() {
+        fs::path path = snapshot_file();
+        ScopedFd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        if (!fd.valid()) {
+            return;
+        }
+        struct stat sb;
+        if (fstat(fd.get(), &sb) != 0) {
+            return;
+        }
+        std::string data(static_cast<size_t>(sb.st_size), '\0');
+        if (!pread_full(fd.get(), &data[0], data.size(), 0) || !parse(data)) {
+            previous_.clear();
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cerr << "Warning: Ignoring unreadable snapshot \"" << path << "\"; all directories will be listed.\n";
+        }
+    }
+
+    // State of a directory in the previous run, or null if it must be listed
+    const Directory* previous(const std::string& key) const {
+        auto it = previous_.find(key);
+        return it == previous_.end() ? nullptr : &it->second;
+    }
+
+    // Record a directory for the next run; called by the walker only
+    void record(const std::string& key, Directory directory) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        current_[key] = std::move(directory);
+    }
+
+    // Exclude a directory from the next snapshot; called by any worker
+    void mark_dirty(const fs::path& directory) {
+        std::string key = relative_key(directory);
+        std::lock_guard<std::mutex> lock(mutex_);
+        dirty_.insert(std::move(key));
+    }
+
+    std::string relative_key(const fs::path& directory) const {
+        return directory.lexically_relative(root_).generic_string();
+    }
+
+    // Write the recorded, non-dirty directories through a temporary file
+    bool save() const {
+        std::vector<SnapshotRecord> records;
+        std::vector<ChildRecord> children;
+        std::string strings;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (const auto& item : current_) {
+                if (dirty_.count(item.first) != 0) {
+                    continue;
+                }
+                SnapshotRecord record{};
+                record.mtime_ns = item.second.mtime_ns;
+                record.entry_count = item.second.entry_count;
+                record.path_offset = strings.size();
+                record.path_length = static_cast<uint32_t>(item.first.size());
+                strings += item.first;
+                record.first_child = children.size();
+                record.child_count = static_cast<uint32_t>(item.second.children.size());
+                for (const auto& name : item.second.children) {
+                    children.push_back(ChildRecord{strings.size(), static_cast<uint32_t>(name.size()), 0});
+                    strings += name;
+                }
+                records.push_back(record);
+            }
+        }
+
+        SnapshotHeader header;
+        memcpy(header.magic, snapshot_magic, sizeof(header.magic));
+        header.count = records.size();
+        header.child_count = children.size();
+        header.strings_size = strings.size();
+
+        fs::path path = snapshot_file();
+        fs::path temp_path = path;
+        temp_path += ".tmp";
+        ScopedFd fd(open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+        bool ok = fd.valid() &&
+                  write_all(fd.get(), &header, sizeof(header)) &&
+                  write_all(fd.get(), records.data(), records.size() * sizeof(SnapshotRecord)) &&
+                  write_all(fd.get(), children.data(), children.size() * sizeof(ChildRecord)) &&
+                  write_all(fd.get(), strings.data(), strings.size()) &&
+                  fdatasync(fd.get()) == 0;
+        if (!ok || rename(temp_path.c_str(), path.c_str()) != 0) {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cerr << "Error: Unable to write snapshot \"" << path << "\": " << strerror(errno) << "\n";
+            unlink(temp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+
+private:
+    static constexpr char snapshot_magic[8] = {'F', 'O', 'S', 'N', 'A', 'P', '0', '1'};
+
+    struct SnapshotHeader {
+        char magic[8];
+        uint64_t count;
+        uint64_t child_count;
+        uint64_t strings_size;
+    };
+
+    struct SnapshotRecord {
+        int64_t mtime_ns;
+        uint64_t entry_count;
+        uint64_t path_offset;
+        uint64_t first_child;
+        uint32_t path_length;
+        uint32_t child_count;
+    };
+
+    struct ChildRecord {
+        uint64_t name_offset;
+        uint32_t name_length;
+        uint32_t reserved;
+    };
+
+    bool parse(const std::string& data) {
+        if (data.size() < sizeof(SnapshotHeader)) {
+            return false;
+        }
+        SnapshotHeader header;
+        memcpy(&header, data.data(), sizeof(header));
+        if (memcmp(header.magic, snapshot_magic, sizeof(header.magic)) != 0 ||
+            header.count > data.size() / sizeof(SnapshotRecord) ||
+            header.child_count > data.size() / sizeof(ChildRecord) ||
+            sizeof(SnapshotHeader) + header.count * sizeof(SnapshotRecord) +
+                header.child_count * sizeof(ChildRecord) + header.strings_size != data.size()) {
+            return false;
+        }
+        const char* base = data.data() + sizeof(SnapshotHeader);
+        const char* child_base = base + header.count * sizeof(SnapshotRecord);
+        const char* strings = child_base + header.child_count * sizeof(ChildRecord);
+        for (uint64_t i = 0; i < header.count; ++i) {
+            SnapshotRecord record;
+            memcpy(&record, base + i * sizeof(SnapshotRecord), sizeof(record));
+            if (record.path_offset + record.path_length > header.strings_size ||
+                record.first_child + record.child_count > header.child_count) {
+                return false;
+            }
+            Directory directory;
+            directory.mtime_ns = record.mtime_ns;
+            directory.entry_count = record.entry_count;
+            for (uint64_t c = record.first_child; c < record.first_child + record.child_count; ++c) {
+                ChildRecord child;
+                memcpy(&child, child_base + c * sizeof(ChildRecord), sizeof(child));
+                if (child.name_offset + child.name_length > header.strings_size) {
+                    return false;
+                }
+                directory.children.emplace_back(strings + child.name_offset, child.name_length);
+            }
+            previous_.emplace(std::string(strings + record.path_offset, record.path_length), std::move(directory));
+        }
+        return true;
+    }
+
+    fs::path root_;
+    std::unordered_map<std::string, Directory> previous_;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, Directory> current_;
+    std::unordered_set<std::string> dirty_;
+};
+
+constexpr char DirectorySnapshot::snapshot_magic[8];
+
+// Crash-safe log of a run's progress in the source root. The walker appends
+// each directory it lists together with the files it found there, and a
+// completion record follows every move once the move is durable. Renames
+// are made durable in groups: the touched directories are fdatasync'ed
+// together, then the completion records and the journal itself. A run that
+// dies leaves the journal behind, and --resume replays it: listed
+// directories are not read again, and only their files with no completion
+// record are looked at. A run that finishes removes it.
+class MoveJournal {
+public:
+    struct Directory {
+        std::vector<std::string> children;  // Subdirectory names
+        std::vector<std::string> files;     // Names listed and not yet completed
+    };
+
+    explicit MoveJournal(fs::path root) : root_(std::move(root)) {}
+
+    ~MoveJournal() {
+        commit();
+    }
+
+    MoveJournal(const MoveJournal&) = delete;
+    MoveJournal& operator=(const MoveJournal&) = delete;
+
+    fs::path journal_file() const {
+        return root_ / (std::string(state_file_prefix) + ".journal");
+    }
+
+    // Read the journal left by an interrupted run. False if there is none, it
+    // belongs to another root or it is damaged anywhere but at the end; a
+    // torn final record is ignored.
+    bool load() {
+        fs::path path = journal_file();
+        ScopedFd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        struct stat sb;
+        if (!fd.valid() || fstat(fd.get(), &sb) != 0) {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cerr << "Error: No journal to resume in \"" << root_ << "\": " << strerror(errno) << "\n";
+            return false;
+        }
+        std::string data(static_cast<size_t>(sb.st_size), '\0');
+        if (!pread_full(fd.get(), &data[0], data.size(), 0) || !parse(data)) {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cerr << "Error: Unable to read journal \"" << path << "\"\n";
+            return false;
+        }
+        return true;
+    }
+
+    // Open the journal for appending, starting a new one unless resuming. A
+    // resumed journal is first cut back to its last intact record, or what
+    // this run appends would sit behind the torn one and never be replayed.
+    bool open_for_append(bool resume) {
+        fs::path path = journal_file();
+        int flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | (resume ? 0 : O_TRUNC);
+        fd_ = ScopedFd(open(path.c_str(), flags, 0644));
+        bool ok = fd_.valid();
+        if (ok && resume) {
+            ok = ftruncate(fd_.get(), static_cast<off_t>(intact_size_)) == 0 && fdatasync(fd_.get()) == 0;
+        } else if (ok) {
+            JournalHeader header;
+            memcpy(header.magic, journal_magic, sizeof(header.magic));
+            header.root_length = root_.native().size();
+            ok = write_all(fd_.get(), &header, sizeof(header)) &&
+                 write_all(fd_.get(), root_.c_str(), root_.native().size()) && fdatasync(fd_.get()) == 0;
+        }
+        if (!ok) {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cerr << "Error: Unable to write journal \"" << path << "\": " << strerror(errno) << "\n";
+        }
+        return ok;
+    }
+
+    // A directory listed by an interrupted run, or null if it must be listed
+    const Directory* previous(const std::string& key) const {
+        auto it = previous_.find(key);
+        return it == previous_.end() ? nullptr : &it->second;
+    }
+
+    std::string relative_key(const fs::path& path) const {
+        return path.lexically_relative(root_).generic_string();
+    }
+
+    // Record a listed directory; called by the walker only
+    void record_directory(const std::string& key, const std::vector<std::string>& children,
+                          const std::vector<std::string>& files) {
+        std::string payload = key;
+        payload += '\0';
+        for (const auto& name : children) {
+            payload.append(name).push_back('\0');
+        }
+        for (const auto& name : files) {
+            payload.append(name).push_back('\0');
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        append_record(RecordType::Directory, static_cast<uint32_t>(children.size()), payload);
+    }
+
+    // Note a finished rename. Its completion record is written once the
+    // group it joins has been synced; the caller may end up syncing it.
+    void completed(const fs::path& source_file, const fs::path& final_target) {
+        bool full;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (unsynced_.empty()) {
+                oldest_unsynced_ = std::chrono::steady_clock::now();
+            }
+            unsynced_.push_back(Completion{source_file, final_target});
+            full = unsynced_.size() >= journal_group_size ||
+                   std::chrono::steady_clock::now() - oldest_unsynced_ >= journal_group_interval;
+        }
+        if (full) {
+            commit();
+        }
+    }
+
+    // Make every noted rename and buffered record durable. Returns false if
+    // the journal could not be written.
+    bool commit() {
+        std::lock_guard<std::mutex> commit_lock(commit_mutex_);
+        std::vector<Completion> group;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            group.swap(unsynced_);
+        }
+
+        // One fdatasync per directory the group touched, sources and targets
+        std::vector<std::string> directories;
+        directories.reserve(group.size() * 2);
+        for (const auto& move : group) {
+            directories.push_back(move.source.parent_path().native());
+            directories.push_back(move.target.parent_path().native());
+        }
+        std::sort(directories.begin(), directories.end());
+        directories.erase(std::unique(directories.begin(), directories.end()), directories.end());
+        for (const auto& directory : directories) {
+            ScopedFd dir_fd(open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+            if (dir_fd.valid()) {
+                fdatasync(dir_fd.get());
+            }
+        }
+
+        std::string pending;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (const auto& move : group) {
+                std::string payload = relative_key(move.source);
+                payload += '\0';
+                payload += relative_key(move.target);
+                payload += '\0';
+                append_record(RecordType::Completed, 0, payload);
+            }
+            pending.swap(buffer_);
+        }
+        if (!fd_.valid() || pending.empty()) {
+            return true;
+        }
+        if (write_all(fd_.get(), pending.data(), pending.size()) && fdatasync(fd_.get()) == 0) {
+            return true;
+        }
+        if (!failed_) {
+            failed_ = true;
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cerr << "Error: Unable to write journal \"" << journal_file() << "\": " << strerror(errno)
+                      << "\n";
+        }
+        return false;
+    }
+
+    // Commit what is left and drop the journal after a run that finished
+    bool finish() {
+        bool ok = commit() && !failed_;
+        fd_ = ScopedFd();
+        if (ok && unlink(journal_file().c_str()) != 0) {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cerr << "Error: Unable to remove journal \"" << journal_file() << "\": " << strerror(errno)
+                      << "\n";
+            return false;
+        }
+        return ok;
+    }
+
+private:
+    static constexpr char journal_magic[8] = {'F', 'O', 'J', 'R', 'N', 'L', '0', '1'};
+
+    // Renames synced together once this many are waiting, or once the oldest
+    // has waited this long
+    static constexpr size_t journal_group_size = 512;
+    static constexpr std::chrono::milliseconds journal_group_interval{200};
+
+    enum class RecordType : uint32_t { Directory = 1, Completed = 2 };
+
+    struct JournalHeader {
+        char magic[8];
+        uint64_t root_length;
+    };
+
+    // Followed by payload_size bytes of NUL-terminated strings: a directory's
+    // key, its child_count subdirectories and then its files, or the source
+    // and final target of a completed move
+    struct RecordHeader {
+        uint32_t type;
+        uint32_t payload_size;
+        uint32_t child_count;
+        uint32_t reserved;
+        uint64_t checksum;  // Of the payload, so a torn tail is recognized
+    };
+
+    struct Completion {
+        fs::path source;
+        fs::path target;
+    };
+
+    void append_record(RecordType type, uint32_t child_count, const std::string& payload) {
+        RecordHeader header{static_cast<uint32_t>(type), static_cast<uint32_t>(payload.size()), child_count, 0,
+                            Xxh64::hash(payload.data(), payload.size())};
+        buffer_.append(reinterpret_cast<const char*>(&header), sizeof(header));
+        buffer_ += payload;
+    }
+
+    bool parse(const std::string& data) {
+        JournalHeader header;
+        if (data.size() < sizeof(header)) {
+            return false;
+        }
+        memcpy(&header, data.data(), sizeof(header));
+        if (memcmp(header.magic, journal_magic, sizeof(header.magic)) != 0 ||
+            header.root_length > data.size() - sizeof(header) ||
+            data.compare(sizeof(header), header.root_length, root_.native()) != 0) {
+            return false;
+        }
+
+        std::unordered_set<std::string> completed;
+        std::vector<std::pair<std::string, Directory>> listed;
+        size_t offset = sizeof(header) + header.root_length;
+        intact_size_ = offset;
+        while (data.size() - offset >= sizeof(RecordHeader)) {
+            RecordHeader record;
+            memcpy(&record, data.data() + offset, sizeof(record));
+            offset += sizeof(record);
+            if (record.payload_size > data.size() - offset ||
+                Xxh64::hash(data.data() + offset, record.payload_size) != record.checksum) {
+                // Torn by the crash: the record runs to the end of the file or
+                // only never-written zeros follow. Anything else is damage
+                // that a resume would silently lose records behind.
+                if (record.payload_size < data.size() - offset &&
+                    data.find_first_not_of('\0', intact_size_) != std::string::npos) {
+                    return false;
+                }
+                break;
+            }
+            std::vector<std::string> strings;
+            for (size_t start = offset, end = offset + record.payload_size; start < end;) {
+                size_t nul = data.find('\0', start);
+                if (nul == std::string::npos || nul >= end) {
+                    return false;
+                }
+                strings.emplace_back(data, start, nul - start);
+                start = nul + 1;
+            }
+            offset += record.payload_size;
+            intact_size_ = offset;
+
+            if (record.type == static_cast<uint32_t>(RecordType::Completed) && strings.size() == 2) {
+                completed.insert(std::move(strings[0]));
+            } else if (record.type == static_cast<uint32_t>(RecordType::Directory) && !strings.empty() &&
+                       record.child_count < strings.size()) {
+                Directory directory;
+                auto first_file = strings.begin() + 1 + record.child_count;
+                directory.children.assign(std::make_move_iterator(strings.begin() + 1),
+                                          std::make_move_iterator(first_file));
+                directory.files.assign(std::make_move_iterator(first_file), std::make_move_iterator(strings.end()));
+                listed.emplace_back(std::move(strings[0]), std::move(directory));
+            } else {
+                return false;
+            }
+        }
+
+        for (auto& item : listed) {
+            auto& files = item.second.files;
+            files.erase(std::remove_if(files.begin(), files.end(), [&](const std::string& name) {
+                return completed.count(item.first == "." ? name : item.first + "/" + name) != 0;
+            }), files.end());
+            previous_[item.first] = std::move(item.second);
+        }
+        return true;
+    }
+
+    fs::path root_;
+    std::unordered_map<std::string, Directory> previous_;
+    size_t intact_size_ = 0;  // End of the last intact record read by load()
+    ScopedFd fd_;
+    bool failed_ = false;
+
+    std::mutex commit_mutex_;  // One group commit at a time, in record order
+    std::mutex mutex_;         // Guards the fields below
+    std::string buffer_;       // Records not yet written
+    std::vector<Completion> unsynced_;
+    std::chrono::steady_clock::time_point oldest_unsynced_;
+};
+
+constexpr char MoveJournal::journal_magic[8];
+constexpr std::chrono::milliseconds MoveJournal::journal_group_interval;
+
+// Function to decide whether the source matches an existing target. Without an
+// index this is a direct comparison. With one, the target's hash is reused from
+// a previous run when possible, so only the source has to be read.
+bool target_matches(const fs::path& source_file, const FileMetadata& source_meta, const fs::path& target_file,
+                    std::optional<uint64_t>& source_hash, ContentIndex* index) {
+    if (index == nullptr) {
+        return files_identical(source_file, target_file, source_meta.size);
+    }
+
+    FileMetadata target_meta;
+    if (!get_file_metadata(target_file, target_meta) || target_meta.size != source_meta.size) {
+        return false;
+    }
+
+    uint64_t target_hash;
+    int64_t target_mtime = to_nanoseconds(target_meta.mtime);
+    if (!index->lookup(target_file, target_meta.size, target_mtime, target_hash)) {
+        // Rule out most mismatches cheaply before paying for two full hashes
+        if (!files_identical(source_file, target_file, source_meta.size, true) ||
+            !hash_file(target_file, target_hash)) {
+            return false;
+        }
+        index->record(target_file, target_meta.size, target_mtime, target_hash);
+    }
+
+    if (!source_hash) {
+        uint64_t hash;
+        if (!hash_file(source_file, hash)) {
+            return false;
+        }
+        source_hash = hash;
+    }
+    return *source_hash == target_hash;
+}
+
+// Names of the extension directories this run created directly under the
+// source directory. The walker must not descend into them: everything in
+// there was placed by this run and is already organized.
+class OutputDirectoryRegistry {
+public:
+    void add(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        names_.insert(name);
+    }
+
+    bool contains(const std::string& name) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return names_.count(name) != 0;
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::unordered_set<std::string> names_;
+};
+
+// Define RENAME_NOREPLACE if not defined
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
+// Whether path is directory itself or lies below it
+static bool path_within(const std::string& path, const std::string& directory) {
+    return path.size() >= directory.size() && path.compare(0, directory.size(), directory) == 0 &&
+           (path.size() == directory.size() || path[directory.size()] == '/');
+}
+
+// LRU cache of O_PATH descriptors for source and target directories. Every
+// statx, mkdirat and rename is issued relative to one of these, so the kernel
+// only resolves the final component instead of re-walking the whole path.
+// Handles are shared: an evicted descriptor stays open until its last user
+// drops it.
+class DirectoryFdCache {
+public:
+    using Handle = std::shared_ptr<const ScopedFd>;
+
+    explicit DirectoryFdCache(size_t capacity) : capacity_(std::max<size_t>(capacity, 1)) {}
+
+    DirectoryFdCache(const DirectoryFdCache&) = delete;
+    DirectoryFdCache& operator=(const DirectoryFdCache&) = delete;
+
+    // Descriptor for path, opened on a miss; null with errno set on failure
+    Handle acquire(const std::string& path) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = entries_.find(path);
+            if (it != entries_.end()) {
+                lru_.splice(lru_.begin(), lru_, it->second);
+                return it->second->second;
+            }
+        }
+        ScopedFd fd;
+        {
+            OpTimer timer(OpClass::OpenDir);
+            fd = ScopedFd(open(path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC));
+        }
+        if (!fd.valid()) {
+            return nullptr;
+        }
+        return insert(path, std::move(fd));
+    }
+
+    // Cache a descriptor opened elsewhere; an existing entry wins
+    Handle insert(const std::string& path, ScopedFd fd) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(path);
+        if (it != entries_.end()) {
+            lru_.splice(lru_.begin(), lru_, it->second);
+            return it->second->second;
+        }
+        lru_.emplace_front(path, std::make_shared<const ScopedFd>(std::move(fd)));
+        entries_[path] = lru_.begin();
+        if (lru_.size() > capacity_) {
+            entries_.erase(lru_.back().first);
+            lru_.pop_back();
+        }
+        return lru_.front().second;
+    }
+
+    // Drop every descriptor for directory and below after it was moved or
+    // deleted, so later lookups resolve the path again
+    void forget_tree(const std::string& directory) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = lru_.begin(); it != lru_.end();) {
+            if (path_within(it->first, directory)) {
+                entries_.erase(it->first);
+                it = lru_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+private:
+    using Entry = std::pair<std::string, Handle>;
+
+    size_t capacity_;
+    std::mutex mutex_;
+    std::list<Entry> lru_;
+    std::unordered_map<std::string, std::list<Entry>::iterator> entries_;
+};
+
+// Default descriptor cache size: a quarter of the open file limit, capped
+static size_t directory_fd_capacity() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY) {
+        return 1024;
+    }
+    return std::min<size_t>(std::max<size_t>(limit.rlim_cur / 4, 16), 4096);
+}
+
+// Concurrent set of directories known to exist during this run. Each target
+// bucket costs one mkdir chain per run; after that a lookup is a hash probe.
+// Missing components are created with mkdirat relative to an fd of the
+// nearest known ancestor, so the kernel never re-resolves the full path.
+class DirectoryCache {
+public:
+    DirectoryCache(const fs::path& root, OutputDirectoryRegistry& output_directories, DirectoryFdCache& dir_fds)
+        : root_(root), output_directories_(output_directories), dir_fds_(dir_fds) {
+        remember(root_.string());
+    }
+
+    // Ensure directory exists. created reports whether this call made (or in a
+    // dry run would make) any part of it; on failure error holds the errno.
+    bool ensure(const std::string& directory, bool dry_run, bool& created, int& error) {
+        created = false;
+        if (known(directory)) {
+            return true;
+        }
+        if (dry_run) {
+            std::error_code ec;
+            created = !fs::exists(directory, ec);
+            remember(directory);
+            return true;
+        }
+
+        // Climb to the nearest ancestor already known to exist
+        std::vector<fs::path> missing;
+        fs::path ancestor = directory;
+        while (!known(ancestor.string())) {
+            fs::path parent = ancestor.parent_path();
+            if (parent == ancestor) {
+                break;
+            }
+            missing.push_back(ancestor.filename());
+            ancestor = std::move(parent);
+        }
+
+        DirectoryFdCache::Handle dir_fd = dir_fds_.acquire(ancestor.string());
+        if (!dir_fd) {
+            error = errno;
+            return false;
+        }
+        fs::path current = ancestor;
+        for (auto it = missing.rbegin(); it != missing.rend(); ++it) {
+            const char* name = it->c_str();
+            // Register a new extension directory before it appears so the walker skips it
+            if (current == root_) {
+                struct stat sb;
+                if (fstatat(dir_fd->get(), name, &sb, 0) != 0 && errno == ENOENT) {
+                    output_directories_.add(it->string());
+                }
+            }
+            int ret;
+            {
+                OpTimer timer(OpClass::Mkdir);
+                ret = mkdirat(dir_fd->get(), name, 0777);
+            }
+            if (ret == 0) {
+                created = true;
+            } else if (errno != EEXIST) {
+                error = errno;
+                return false;
+            }
+            // EEXIST may be a concurrent worker's mkdir; O_DIRECTORY rejects non-directories
+            ScopedFd next_fd(openat(dir_fd->get(), name, O_PATH | O_DIRECTORY | O_CLOEXEC));
+            if (!next_fd.valid()) {
+                error = errno;
+                return false;
+            }
+            current /= *it;
+            remember(current.string());
+            dir_fd = dir_fds_.insert(current.string(), std::move(next_fd));
+        }
+        return true;
+    }
+
+    // Stop trusting directory and everything below it
+    void forget_tree(const std::string& directory) {
+        for (auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            for (auto it = shard.directories.begin(); it != shard.directories.end();) {
+                if (path_within(*it, directory) && *it != root_.native()) {
+                    it = shard.directories.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+    }
+
+private:
+    static constexpr size_t shard_count = 16;
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_set<std::string> directories;
+    };
+
+    Shard& shard_for(const std::string& path) {
+        return shards_[std::hash<std::string>()(path) % shard_count];
+    }
+
+    bool known(const std::string& path) {
+        Shard& shard = shard_for(path);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        return shard.directories.count(path) != 0;
+    }
+
+    void remember(const std::string& path) {
+        Shard& shard = shard_for(path);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.directories.insert(path);
+    }
+
+    fs::path root_;
+    OutputDirectoryRegistry& output_directories_;
+    DirectoryFdCache& dir_fds_;
+    std::array<Shard, shard_count> shards_;
+};
+
+// Per-extension state, resolved the first time an extension is seen
+struct ExtensionInfo {
+    uint32_t id;
+    std::string name;              // Extension as bucketed, "no_extension" when there is none
+    std::string bucket;            // Directory it is filed under: its category, else its name
+    uint64_t rule_mask;            // Bucketing rules whose ext= list names it
+};
+
+// Interned file extensions. Each distinct extension is case-folded if asked,
+// mapped to its category and turned into a target prefix once; after that a
+// file costs one hash probe under a shared lock and no allocation.
+class ExtensionTable {
+public:
+    ExtensionTable(const fs::path& root, bool fold_case,
+                   const std::vector<std::pair<std::string, std::string>>& categories, const BucketRules& rules)
+        : root_(root.native()), fold_case_(fold_case), rules_(rules) {
+        if (root_.empty() || root_.back() != '/') {
+            root_ += '/';
+        }
+        for (const auto& mapping : categories) {
+            categories_[fold(mapping.first)] = mapping.second;
+        }
+    }
+
+    // State for the extension of filename, as fs::path::extension() finds it
+    const ExtensionInfo& lookup(const std::string& filename) {
+        thread_local std::string key;
+        size_t dot = filename.rfind('.');
+        if (dot == std::string::npos || dot == 0) {
+            key.clear();
+        } else {
+            key.assign(filename, dot + 1, std::string::npos);
+            if (fold_case_) {
+                fold_in_place(key);
+            }
+        }
+
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex_);
+            auto it = extensions_.find(key);
+            if (it != extensions_.end()) {
+                return *it->second;
+            }
+        }
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        auto& slot = extensions_[key];
+        if (!slot) {
+            slot = std::make_unique<ExtensionInfo>();
+            slot->id = static_cast<uint32_t>(by_id_.size());
+            slot->name = key.empty() ? "no_extension" : key;
+            auto category = categories_.find(key);
+            slot->bucket = category != categories_.end() ? category->second : slot->name;
+            slot->rule_mask = rules_.extension_mask(slot->name, fold_case_);
+            by_id_.push_back(slot.get());
+        }
+        return *slot;
+    }
+
+    // The source root with a trailing slash, where every target path starts
+    const std::string& root() const { return root_; }
+
+    // Display names by id, showing the category an extension was mapped to
+    std::vector<std::string> names() const {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        std::vector<std::string> names;
+        names.reserve(by_id_.size());
+        for (const ExtensionInfo* info : by_id_) {
+            auto category = categories_.find(info->name);
+            names.push_back(category != categories_.end() ? info->name + " -> " + category->second : info->name);
+        }
+        return names;
+    }
+
+private:
+    static void fold_in_place(std::string& text) {
+        for (char& c : text) {
+            if (c >= 'A' && c <= 'Z') {
+                c = static_cast<char>(c - 'A' + 'a');
+            }
+        }
+    }
+
+    std::string fold(std::string text) const {
+        if (fold_case_) {
+            fold_in_place(text);
+        }
+        return text;
+    }
+
+    std::string root_;
+    bool fold_case_;
+    std::unordered_map<std::string, std::string> categories_;
+    const BucketRules& rules_;
+
+    mutable std::shared_mutex mutex_;
+    std::unordered_map<std::string, std::unique_ptr<ExtensionInfo>> extensions_;
+    std::vector<const ExtensionInfo*> by_id_;
+};
+
+// Targets this process is moving files to, so the watcher can drop the
+// inotify events its own renames cause instead of classifying them again.
+// A name is added before the rename is issued, so the event can never win
+// the race; entries expire instead of being consumed because one move can
+// surface both as an event and in the scan of a newly created directory.
+class RecentMoves {
+public:
+    using clock = std::chrono::steady_clock;
+
+    void add(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        paths_[path] = clock::now();
+    }
+
+    bool contains(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return paths_.count(path) != 0;
+    }
+
+    // Forget names added before cutoff
+    void expire(clock::time_point cutoff) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = paths_.begin(); it != paths_.end();) {
+            it = it->second < cutoff ? paths_.erase(it) : std::next(it);
+        }
+    }
+
+private:
+    std::mutex mutex_;
+    std::unordered_map<std::string, clock::time_point> paths_;
+};
+
+// Number of files the walker hands to a worker at once
+constexpr size_t organize_batch_size = 64;
+
+// Settings and shared state for one organizer run
+struct OrganizerContext {
+    fs::path src_directory;
+    OrganizerOptions options;
+    TargetReservations reservations;
+    OutputDirectoryRegistry output_directories;
+    std::unique_ptr<DirectoryFdCache> dir_fds;
+    std::unique_ptr<DirectoryCache> directories;
+    std::unique_ptr<ContentIndex> index;  // Null unless --index or --dedup
+    OrganizePlan* plan = nullptr;         // Set while writing a plan; decisions are recorded, not executed
+    std::unique_ptr<DirectorySnapshot> snapshot;  // Null unless --incremental
+    std::unique_ptr<RecentMoves> recent_moves;    // Null unless --watch
+    std::unique_ptr<ExtensionTable> extensions;
+    const BucketRules* rules = nullptr;
+    std::unique_ptr<WorkStealingPool> copies;  // Cross-filesystem moves; null in a dry run
+    std::unique_ptr<MoveJournal> journal;      // Null unless --journal or --resume
+};
+
+// Function to count a failed file and keep its directory out of the next
+// incremental snapshot, so the file is retried
+static void record_error(const fs::path& file_path, OrganizerContext& ctx) {
+    count_outcome(Outcome::Error);
+    if (ctx.snapshot) {
+        ctx.snapshot->mark_dirty(file_path.parent_path());
+    }
+}
+
+// Function to rename name from src_dir to dst_dir without ever replacing an
+// existing file. Returns 0, EEXIST when the target is taken, or another errno.
+// In a dry run only the existence check is performed.
+static int rename_noreplace(int src_dir, const char* src_name, int dst_dir, const char* dst_name, bool dry_run) {
+    struct stat sb;
+    if (dry_run) {
+        if (dst_dir < 0) {
+            return 0; // Target directory doesn't exist yet
+        }
+        if (fstatat(dst_dir, dst_name, &sb, AT_SYMLINK_NOFOLLOW) == 0) {
+            return EEXIST;
+        }
+        return errno == ENOENT ? 0 : errno;
+    }
+
+    OpTimer timer(OpClass::Rename);
+    if (syscall(SYS_renameat2, src_dir, src_name, dst_dir, dst_name, RENAME_NOREPLACE) == 0) {
+        return 0;
+    }
+    if (errno != EINVAL && errno != ENOSYS) {
+        return errno;
+    }
+
+    // Kernel or filesystem without RENAME_NOREPLACE. Reservations still keep
+    // our own workers apart; only other processes can race this check.
+    if (fstatat(dst_dir, dst_name, &sb, AT_SYMLINK_NOFOLLOW) == 0) {
+        return EEXIST;
+    }
+    if (renameat(src_dir, src_name, dst_dir, dst_name) != 0) {
+        return errno;
+    }
+    return 0;
+}
+
+// Function to tell the watcher that a rename to target is about to happen
+static void expect_arrival(const fs::path& target, OrganizerContext& ctx) {
+    if (ctx.recent_moves && !ctx.options.dry_run) {
+        ctx.recent_moves->add(target.native());
+    }
+}
+
+// Function to record a completed move in the index and report it
+static void finish_move(const fs::path& source_file, const FileMetadata& source_meta, const fs::path& final_target,
+                        const std::optional<uint64_t>& source_hash, OrganizerContext& ctx) {
+    if (ctx.index && source_hash) {
+        ctx.index->record(final_target, source_meta.size, to_nanoseconds(source_meta.mtime), *source_hash);
+    }
+    if (ctx.journal) {
+        ctx.journal->completed(source_file, final_target);
+    }
+
+    if (ctx.options.verbose) {
+        std::lock_guard<std::mutex> lock(output_mutex);
+        std::cout << "Moved: \"" << source_file << "\" -> \"" << final_target << "\"\n";
+    }
+}
+
+// Function to rename src_name into target_file's directory, or into the
+// first free target_N name when the target exists with different contents.
+// Sets identical instead when it exists with the same contents. Returns 0 or
+// the errno of the last rename; final_target is the name last tried.
+static int rename_into_target(int src_dir, const char* src_name, const fs::path& source_file,
+                              const FileMetadata& source_meta, const fs::path& target_file, int target_fd,
+                              std::optional<uint64_t>& source_hash, ReservationGuard& guard,
+                              OrganizerContext& ctx, fs::path& final_target, bool& identical) {
+    const bool dry_run = ctx.options.dry_run;
+    identical = false;
+    final_target = target_file;
+    expect_arrival(target_file, ctx);
+    int err = rename_noreplace(src_dir, src_name, target_fd, target_file.filename().c_str(), dry_run);
+    if (err != EEXIST) {
+        return err;
+    }
+
+    // The target file already exists
+    if (target_matches(source_file, source_meta, target_file, source_hash, ctx.index.get())) {
+        identical = true;
+        return 0;
+    }
+
+    // File contents differ; RENAME_NOREPLACE makes claiming each _N name atomic
+    const std::string stem = target_file.stem().string();
+    const std::string extension = target_file.extension().string();
+    for (int counter = 1; err == EEXIST; ++counter) {
+        std::string candidate = stem + "_" + std::to_string(counter) + extension;
+        final_target = target_file.parent_path() / candidate;
+        if (!guard.try_acquire(final_target.string())) {
+            continue;
+        }
+        expect_arrival(final_target, ctx);
+        err = rename_noreplace(src_dir, src_name, target_fd, candidate.c_str(), dry_run);
+    }
+    return err;
+}
+
+// Chunk handed to one copy_file_range or sendfile call
+constexpr size_t copy_chunk_size = 64 * 1024 * 1024;
+
+// Function to copy the rest of in_fd into out_fd. Tries a reflink, which
+// shares extents on filesystems that support it, then in-kernel copies, and
+// plain read/write last. Returns 0 or an errno; copied counts the bytes.
+static int copy_file_contents(int in_fd, int out_fd, uint64_t& copied) {
+    copied = 0;
+    struct stat sb;
+    if (ioctl(out_fd, FICLONE, in_fd) == 0) {
+        if (fstat(in_fd, &sb) == 0) {
+            copied = static_cast<uint64_t>(sb.st_size);
+        }
+        return 0;
+    }
+
+    // Across filesystems copy_file_range needs Linux 5.3+ (and is refused
+    // again by 5.19+ for some pairs); fall through on any early failure
+    for (;;) {
+        ssize_t n = copy_file_range(in_fd, nullptr, out_fd, nullptr, copy_chunk_size, 0);
+        if (n > 0) {
+            copied += static_cast<uint64_t>(n);
+            continue;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (copied != 0 || (errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)) {
+            return errno;
+        }
+        break;
+    }
+
+    for (;;) {
+        ssize_t n = sendfile(out_fd, in_fd, nullptr, copy_chunk_size);
+        if (n > 0) {
+            copied += static_cast<uint64_t>(n);
+            continue;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (copied != 0 || (errno != EINVAL && errno != ENOSYS)) {
+            return errno;
+        }
+        break;
+    }
+
+    AlignedBuffer buffer(1024 * 1024);
+    for (;;) {
+        ssize_t n = read(in_fd, buffer.data.get(), buffer.size);
+        if (n == 0) {
+            return 0;
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        if (!write_all(out_fd, buffer.data.get(), static_cast<size_t>(n))) {
+            return errno;
+        }
+        copied += static_cast<uint64_t>(n);
+    }
+}
+
+// Name prefix of the temporary files cross-filesystem moves copy into
+static const std::string copy_temp_prefix = std::string(state_file_prefix) + ".copy.";
+
+// Function to move a file whose target is on another filesystem: copy it
+// into a temporary file beside the target, fsync it, rename it into place
+// with the usual collision handling, fsync the directory and only then
+// unlink the source. Runs on the copy pool.
+static void cross_device_move(const fs::path& source_file, const FileMetadata& source_meta,
+                              const fs::path& target_file, std::optional<uint64_t> source_hash,
+                              OrganizerContext& ctx) {
+    static std::atomic<uint64_t> temp_counter{0};
+    auto fail = [&](const fs::path& shown_target, int err) {
+        record_error(source_file, ctx);
+        std::lock_guard<std::mutex> lock(output_mutex);
+        std::cerr << "Error: Unable to move \"" << source_file << "\" -> \"" << shown_target
+                  << "\" across filesystems: " << strerror(err) << "\n";
+    };
+
+    DirectoryFdCache::Handle source_dir = ctx.dir_fds->acquire(source_file.parent_path().string());
+    DirectoryFdCache::Handle target_dir = ctx.dir_fds->acquire(target_file.parent_path().string());
+    if (!source_dir || !target_dir) {
+        fail(target_file, errno);
+        return;
+    }
+    const std::string source_name = source_file.filename().string();
+    const std::string temp_name = copy_temp_prefix + std::to_string(getpid()) + "." +
+                                  std::to_string(temp_counter.fetch_add(1, std::memory_order_relaxed));
+
+    uint64_t copied = 0;
+    {
+        OpTimer timer(OpClass::Copy);
+        ScopedFd in(openat(source_dir->get(), source_name.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC));
+        if (!in.valid()) {
+            fail(target_file, errno);
+            return;
+        }
+        ScopedFd out(openat(target_dir->get(), temp_name.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600));
+        if (!out.valid()) {
+            fail(target_file, errno);
+            return;
+        }
+        int err = copy_file_contents(in.get(), out.get(), copied);
+
+        // Carry over what the date buckets and the owner care about; btime
+        // cannot be set and becomes the copy's creation time
+        struct stat sb;
+        if (err == 0 && fstat(in.get(), &sb) == 0) {
+            const struct timespec times[2] = {sb.st_atim, sb.st_mtim};
+            if (fchown(out.get(), sb.st_uid, sb.st_gid) != 0) {
+                // Not permitted for other users' files; keep ours
+            }
+            if (fchmod(out.get(), sb.st_mode & 07777) != 0 || futimens(out.get(), times) != 0) {
+                err = errno;
+            }
+        }
+        if (err == 0 && fsync(out.get()) != 0) {
+            err = errno;
+        }
+        if (err != 0) {
+            unlinkat(target_dir->get(), temp_name.c_str(), 0);
+            fail(target_file, err);
+            return;
+        }
+    }
+    count_bytes_copied(copied);
+
+    ReservationGuard guard(ctx.reservations);
+    guard.acquire(target_file.string());
+    fs::path final_target;
+    bool identical;
+    int err = rename_into_target(target_dir->get(), temp_name.c_str(), source_file, source_meta, target_file,
+                                 target_dir->get(), source_hash, guard, ctx, final_target, identical);
+    if (identical || err != 0) {
+        unlinkat(target_dir->get(), temp_name.c_str(), 0);
+    }
+    if (identical) {
+        if (ctx.options.verbose) {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cout << "Skipping: \"" << source_file << "\" as it matches the existing file.\n";
+        }
+        count_outcome(Outcome::SkippedIdentical);
+        return;
+    }
+    if (err != 0) {
+        fail(final_target, err);
+        return;
+    }
+
+    // The new name must be durable before the only other copy goes away. The
+    // cached directory fds are O_PATH, which fsync refuses.
+    ScopedFd sync_dir(openat(target_dir->get(), ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (!sync_dir.valid() || fsync(sync_dir.get()) != 0 ||
+        unlinkat(source_dir->get(), source_name.c_str(), 0) != 0) {
+        err = errno;
+        record_error(source_file, ctx);
+        std::lock_guard<std::mutex> lock(output_mutex);
+        std::cerr << "Error: Copied \"" << source_file << "\" to \"" << final_target
+                  << "\" but could not remove the source: " << strerror(err) << "\n";
+        return;
+    }
+    count_outcome(final_target == target_file ? Outcome::Moved : Outcome::RenamedOnCollision);
+    finish_move(source_file, source_meta, final_target, source_hash, ctx);
+}
+
+// Function to move a single file
+bool move_file(const fs::path& source_file, const FileMetadata& source_meta, const fs::path& target_file,
+               std::optional<uint64_t>& source_hash, OrganizerContext& ctx) {
+    const bool dry_run = ctx.options.dry_run;
+    const bool verbose = ctx.options.verbose;
+    ContentIndex* index = ctx.index.get();
+
+    if (source_file == target_file) {
+        if (index != nullptr && source_hash && !dry_run) {
+            index->record(source_file, source_meta.size, to_nanoseconds(source_meta.mtime), *source_hash);
+        }
+        if (verbose) {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cout << "Skipping: \"" << source_file << "\" is already in the correct location.\n";
+        }
+        count_outcome(Outcome::SkippedInPlace);
+        return true;
+    }
+
+    // Hold the target name until the move is done so a concurrent file with
+    // the same name is compared against the result instead of racing us
+    ReservationGuard guard(ctx.reservations);
+    guard.acquire(target_file.string());
+
+    DirectoryFdCache::Handle source_dir = ctx.dir_fds->acquire(source_file.parent_path().string());
+    DirectoryFdCache::Handle target_dir = ctx.dir_fds->acquire(target_file.parent_path().string());
+    if (!source_dir || (!target_dir && !dry_run)) {
+        record_error(source_file, ctx);
+        std::lock_guard<std::mutex> lock(output_mutex);
+        std::cerr << "Error: Unable to move \"" << source_file << "\" -> \"" << target_file 
+                  << "\": " << strerror(errno) << "\n";
+        return false;
+    }
+    const int target_fd = target_dir ? target_dir->get() : -1;
+    const std::string source_name = source_file.filename().string();
+
+    fs::path final_target;
+    bool identical;
+    int err = rename_into_target(source_dir->get(), source_name.c_str(), source_file, source_meta, target_file,
+                                 target_fd, source_hash, guard, ctx, final_target, identical);
+    if (identical) {
+        if (verbose) {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cout << "Skipping: \"" << source_file << "\" as it matches the existing file.\n";
+        }
+        count_outcome(Outcome::SkippedIdentical);
+        return true; // Skip moving as the contents are identical
+    }
+
+    // The target is on another filesystem. Copying is left to the copy pool
+    // so a large file doesn't hold up the metadata-bound small files; our
+    // reservations go first, as the copy takes its own.
+    if (err == EXDEV && ctx.copies) {
+        guard.release();
+        ctx.copies->submit([&ctx, source_file, source_meta, target_file, source_hash] {
+            cross_device_move(source_file, source_meta, target_file, source_hash, ctx);
+        });
+        return true;
+    }
+
+    if (err != 0) {
+        record_error(source_file, ctx);
+        std::lock_guard<std::mutex> lock(output_mutex);
+        std::cerr << "Error: Unable to move \"" << source_file << "\" -> \"" << final_target 
+                  << "\": " << strerror(err) << "\n";
+        return false;
+    }
+    count_outcome(final_target == target_file ? Outcome::Moved : Outcome::RenamedOnCollision);
+
+    if (dry_run) {
+        std::lock_guard<std::mutex> lock(output_mutex);
+        std::cout << "[Dry-Run] Would move: \"" << source_file << "\" -> \"" << final_target << "\"\n";
+        return true;
+    }
+
+    finish_move(source_file, source_meta, final_target, source_hash, ctx);
+    return true;
+}
+
+// Bytes of directory entries fetched per getdents64 call
+constexpr size_t walk_buffer_size = 256 * 1024;
+
+// Layout of the records getdents64 fills the buffer with
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// Shared state of one parallel walk. Each directory is a task on a
+// work-stealing pool: a walker pushes the subdirectories it finds onto its
+// own deque and idle walkers steal them, so wide trees are read in
+// parallel. Files go into a per-thread batch that is emitted when full.
+class ParallelWalk {
+public:
+    ParallelWalk(const fs::path& root, const OutputDirectoryRegistry& output_directories,
+                 DirectorySnapshot* snapshot, MoveJournal* journal, size_t batch_size,
+                 const std::function<void(FileTable&&)>& emit)
+        : root_(root), output_directories_(output_directories), snapshot_(snapshot), journal_(journal),
+          batch_size_(batch_size), emit_(emit),
+          trusted_before_(to_nanoseconds(std::chrono::system_clock::now() - std::chrono::seconds(1))) {}
+
+    size_t run(unsigned threads, size_t& skipped_directories, uint64_t& skipped_entries) {
+        {
+            WorkStealingPool walkers(threads, 1);
+            pool_ = &walkers;
+            std::string root = root_.native();
+            walkers.submit([this, root] {
+                visit(root, ".", -1);
+            });
+            walkers.wait();
+        }
+        for (auto& shard : shards_) {
+            if (!shard->batch.empty()) {
+                emit_(std::move(shard->batch));
+            }
+        }
+        skipped_directories = skipped_directories_;
+        skipped_entries = skipped_entries_;
+        return count_;
+    }
+
+private:
+    // One walker thread's batch and getdents buffer
+    struct Shard {
+        FileTable batch;
+        AlignedBuffer buffer{walk_buffer_size};
+    };
+
+    Shard& shard() {
+        thread_local Shard* shard = nullptr;
+        thread_local const ParallelWalk* owner = nullptr;
+        if (shard == nullptr || owner != this) {
+            std::lock_guard<std::mutex> lock(shards_mutex_);
+            shards_.push_back(std::make_unique<Shard>());
+            shard = shards_.back().get();
+            shard->batch.reserve(batch_size_, batch_size_ * 32);
+            owner = this;
+        }
+        return *shard;
+    }
+
+    void add_file(Shard& shard, const std::string& directory, const char* name) {
+        std::string path = directory;
+        if (path.back() != '/') {
+            path += '/';
+        }
+        path += name;
+        shard.batch.add(path);
+        count_.fetch_add(1, std::memory_order_relaxed);
+        if (shard.batch.size() >= batch_size_) {
+            emit_(std::move(shard.batch));
+            shard.batch = FileTable();
+            shard.batch.reserve(batch_size_, batch_size_ * 32);
+        }
+    }
+
+    void visit_children(const std::string& directory, const std::string& key, int depth,
+                        const std::vector<std::string>& children) {
+        for (const auto& name : children) {
+            if (depth + 1 == 0 && output_directories_.contains(name)) {
+                continue;
+            }
+            std::string path = directory;
+            if (path.back() != '/') {
+                path += '/';
+            }
+            path += name;
+            std::string child_key = key == "." ? name : key + "/" + name;
+            pool_->submit([this, path = std::move(path), child_key = std::move(child_key), depth] {
+                visit(path, child_key, depth + 1);
+            });
+        }
+    }
+
+    void report(const std::string& directory, int err) {
+        // Unreadable directories are skipped like skip_permission_denied does
+        if (err != EACCES && err != EPERM && err != ENOENT && err != ENOTDIR && err != ELOOP) {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cerr << "Error during file collection: \"" << directory << "\": " << strerror(err) << "\n";
+        }
+    }
+
+    void visit(const std::string& directory, const std::string& key, int depth) {
+        ScopedFd fd(open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+        struct stat sb;
+        if (!fd.valid() || fstat(fd.get(), &sb) != 0) {
+            report(directory, errno);
+            return;
+        }
+        const int64_t mtime_ns = static_cast<int64_t>(sb.st_mtim.tv_sec) * 1000000000 + sb.st_mtim.tv_nsec;
+
+        const DirectorySnapshot::Directory* previous = snapshot_ ? snapshot_->previous(key) : nullptr;
+        if (previous != nullptr && previous->mtime_ns == mtime_ns) {
+            ++skipped_directories_;
+            skipped_entries_ += previous->entry_count;
+            snapshot_->record(key, *previous);
+            visit_children(directory, key, depth, previous->children);
+            return;
+        }
+        const MoveJournal::Directory* listed = journal_ ? journal_->previous(key) : nullptr;
+        if (listed != nullptr) {
+            ++skipped_directories_;
+            skipped_entries_ += listed->children.size() + listed->files.size();
+            Shard& files_shard = shard();
+            for (const auto& name : listed->files) {
+                add_file(files_shard, directory, name.c_str());
+            }
+            visit_children(directory, key, depth, listed->children);
+            return;
+        }
+
+        Shard& local = shard();
+        DirectorySnapshot::Directory current;
+        current.mtime_ns = mtime_ns;
+        std::vector<std::string> files;  // For the journal
+        for (;;) {
+            long n;
+            {
+                OpTimer timer(OpClass::Traversal);
+                n = syscall(SYS_getdents64, fd.get(), local.buffer.data.get(), local.buffer.size);
+            }
+            if (n < 0) {
+                // Never recorded, so a snapshot or journal tries it again
+                report(directory, errno);
+                return;
+            }
+            if (n == 0) {
+                break;
+            }
+            for (long offset = 0; offset < n;) {
+                const auto* entry = reinterpret_cast<const LinuxDirent64*>(local.buffer.data.get() + offset);
+                offset += entry->d_reclen;
+                const char* name = entry->d_name;
+                if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                    continue;
+                }
+                ++current.entry_count;
+
+                // d_type saves a stat; only unknown types and symlinks cost one.
+                // Symlinks count as what they point to, like the organizer's
+                // own statx, but linked directories are never descended into.
+                unsigned char type = entry->d_type;
+                if (type == DT_UNKNOWN || type == DT_LNK) {
+                    struct stat st;
+                    int flags = type == DT_UNKNOWN ? AT_SYMLINK_NOFOLLOW : 0;
+                    if (fstatat(fd.get(), name, &st, flags) != 0) {
+                        continue;
+                    }
+                    if (S_ISREG(st.st_mode)) {
+                        type = DT_REG;
+                    } else if (S_ISDIR(st.st_mode) && type == DT_UNKNOWN) {
+                        type = DT_DIR;
+                    } else {
+                        continue;
+                    }
+                }
+
+                if (type == DT_REG) {
+                    if (depth == -1 && strncmp(name, state_file_prefix, strlen(state_file_prefix)) == 0) {
+                        continue; // The organizer's own index and journal files
+                    }
+                    if (journal_) {
+                        files.emplace_back(name);
+                    }
+                    add_file(local, directory, name);
+                } else if (type == DT_DIR) {
+                    current.children.emplace_back(name);
+                }
+            }
+        }
+
+        if (journal_) {
+            journal_->record_directory(key, current.children, files);
+        }
+        visit_children(directory, key, depth, current.children);
+        if (snapshot_ && mtime_ns < trusted_before_) {
+            snapshot_->record(key, std::move(current));
+        }
+    }
+
+    const fs::path& root_;
+    const OutputDirectoryRegistry& output_directories_;
+    DirectorySnapshot* snapshot_;
+    MoveJournal* journal_;
+    size_t batch_size_;
+    const std::function<void(FileTable&&)>& emit_;
+    const int64_t trusted_before_;
+    WorkStealingPool* pool_ = nullptr;
+
+    std::atomic<size_t> count_{0};
+    std::atomic<size_t> skipped_directories_{0};
+    std::atomic<uint64_t> skipped_entries_{0};
+    std::mutex shards_mutex_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+// Walk the source tree with threads walkers and hand regular files to emit
+// in batches as they are found, so organizing starts right away and memory
+// stays bounded by the consumer's queue rather than the size of the tree.
+// emit is called from the walker threads. Returns the file count.
+//
+// The snapshot and the journal may be null. With a snapshot, the listing
+// of every directory whose mtime matches the previous one is skipped and only
+// the subdirectories recorded for it are visited. Each directory listed is
+// recorded for the next run; one modified within the last second is not,
+// since with coarse timestamps a later change could leave its mtime
+// unchanged. With a journal, each listing is logged with its files, and a
+// directory the interrupted run already listed is not read again: its
+// uncompleted files are emitted and its recorded subdirectories visited.
+size_t walk_source_tree(const fs::path& src_directory, const OutputDirectoryRegistry& output_directories,
+                        DirectorySnapshot* snapshot, MoveJournal* journal, unsigned threads, size_t batch_size,
+                        const std::function<void(FileTable&&)>& emit, size_t& skipped_directories,
+                        uint64_t& skipped_entries) {
+    ParallelWalk walk(src_directory, output_directories, snapshot, journal, batch_size, emit);
+    return walk.run(threads, skipped_directories, skipped_entries);
+}
+
+// Function to report a file whose metadata could not be read
+static void report_metadata_error(const fs::path& file_path, int err, OrganizerContext& ctx) {
+    if (err != ENOENT) {
+        record_error(file_path, ctx);
+    }
+    std::lock_guard<std::mutex> lock(output_mutex);
+    if (err == ENOENT) {
+        // A vanished file is skipped quietly
+        if (ctx.options.verbose) {
+            std::cout << "Skipping: \"" << file_path << "\" does not exist.\n";
+        }
+    } else {
+        std::cerr << "Error: Unable to read metadata for \"" << file_path 
+                  << "\": " << strerror(err) << "\n";
+    }
+}
+
+// Function to create a target directory and its parents if they don't exist
+static bool ensure_target_directory(const std::string& target_directory, const fs::path& source_file,
+                                    OrganizerContext& ctx) {
+    bool created = false;
+    int error = 0;
+    if (!ctx.directories->ensure(target_directory, ctx.options.dry_run, created, error)) {
+        record_error(source_file, ctx);
+        std::lock_guard<std::mutex> lock(output_mutex);
+        std::cerr << "Error: Unable to create directory \"" << fs::path(target_directory) 
+                  << "\": " << strerror(error) << "\n";
+        return false;
+    }
+    if (created && ctx.options.verbose) {
+        std::lock_guard<std::mutex> lock(output_mutex);
+        if (ctx.options.dry_run) {
+            std::cout << "[Dry-Run] Would create directory: \"" << fs::path(target_directory) << "\"\n";
+        } else {
+            std::cout << "Created directory: \"" << fs::path(target_directory) << "\"\n";
+        }
+    }
+    return true;
+}
+
+// Function to decide where a file belongs and make sure its target directory
+// exists. Returns false when the file should stay where it is.
+bool classify_file(const fs::path& file_path, const FileMetadata& meta, OrganizerContext& ctx,
+                   fs::path& target_file_path, std::optional<uint64_t>& content_hash) {
+    // Copies still in flight to another filesystem are not the user's files
+    if (!S_ISREG(meta.mode) ||
+        file_path.filename().native().compare(0, copy_temp_prefix.size(), copy_temp_prefix) == 0) {
+        return false;
+    }
+
+    // With dedup every file's hash is needed so it can be matched and
+    // recorded; it is read from the index while the file is unchanged. A file
+    // whose contents already live elsewhere in the organized tree stays put.
+    if (ctx.options.dedup) {
+        uint64_t hash;
+        int64_t mtime_ns = to_nanoseconds(meta.mtime);
+        if (!ctx.index->lookup(file_path, meta.size, mtime_ns, hash) && !hash_file(file_path, hash)) {
+            record_error(file_path, ctx);
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cerr << "Error: Unable to hash \"" << file_path << "\": " << strerror(errno) << "\n";
+            return false;
+        }
+        content_hash = hash;
+        if (ctx.index->has_size(meta.size)) {
+            for (const auto& candidate : ctx.index->find_content(meta.size, hash)) {
+                FileMetadata candidate_meta;
+                uint64_t candidate_hash;
+                if (candidate == file_path || !get_file_metadata(candidate, candidate_meta) ||
+                    !ctx.index->lookup(candidate, candidate_meta.size, to_nanoseconds(candidate_meta.mtime),
+                                       candidate_hash) ||
+                    candidate_hash != hash) {
+                    continue;
+                }
+                // Remembered so the next run doesn't read the duplicate again
+                ctx.index->record_duplicate(file_path, meta.size, mtime_ns, hash);
+                if (ctx.options.verbose) {
+                    std::lock_guard<std::mutex> lock(output_mutex);
+                    std::cout << "Skipping: \"" << file_path << "\" duplicates \"" << candidate << "\".\n";
+                }
+                count_outcome(Outcome::SkippedDuplicate);
+                return false;
+            }
+        }
+    }
+
+    const ExtensionInfo& extension = ctx.extensions->lookup(file_path.filename().native());
+    count_extension(extension.id, meta.size);
+
+    // Build <src>/<layout or matching rule> in a per-thread buffer whose
+    // capacity is reused, so the common path doesn't allocate
+    thread_local std::string target_directory;
+    target_directory.assign(ctx.extensions->root());
+    ctx.rules->append(file_path, meta, extension.bucket, extension.rule_mask, target_directory);
+
+    // Define target file path
+    target_file_path = target_directory;
+    target_file_path /= file_path.filename();
+
+    // Create target directories if they don't exist
+    return ensure_target_directory(target_directory, file_path, ctx);
+}
+
+// Function to record a planned move instead of performing it
+static void plan_file(const fs::path& file_path, const FileMetadata& meta, const fs::path& target_file_path,
+                      const std::optional<uint64_t>& content_hash, OrganizerContext& ctx) {
+    bool in_place = file_path == target_file_path;
+    ctx.plan->add(file_path, target_file_path, in_place ? PlanAction::InPlace : PlanAction::Move, meta, content_hash);
+    count_outcome(in_place ? Outcome::SkippedInPlace : Outcome::Moved);
+    if (ctx.options.verbose && !in_place) {
+        std::lock_guard<std::mutex> lock(output_mutex);
+        std::cout << "Planned: \"" << file_path << "\" -> \"" << target_file_path << "\"\n";
+    }
+}
 
-// Function to retrieve file creation time using statx
-bool get_creation_time(const fs::path& file_path, std::chrono::system_clock::time_point& creation_time) {
-    struct statx stx;
-    memset(&stx, 0, sizeof(stx));
+// Classify file i of a batch and move it into its extension/metadata directory
+void organize_file(const FileTable& files, size_t i, OrganizerContext& ctx) {
+    // Fetch all metadata in one call relative to the cached parent directory
+    FileMetadata meta;
+    DirectoryFdCache::Handle parent = ctx.dir_fds->acquire(files.directory(i));
+    if (!parent || !get_file_metadata_at(parent->get(), files.name(i), meta)) {
+        int err = errno;
+        report_metadata_error(files.path(i), err, ctx);
+        return;
+    }
 
-    int flags = AT_STATX_SYNC_TYPE;
-    unsigned int mask = STATX_BTIME;
+    const fs::path file_path = files.path(i);
+    fs::path target_file_path;
+    std::optional<uint64_t> content_hash;
+    if (!classify_file(file_path, meta, ctx, target_file_path, content_hash)) {
+        return;
+    }
+    if (ctx.plan != nullptr) {
+        plan_file(file_path, meta, target_file_path, content_hash, ctx);
+        return;
+    }
 
-    // Convert fs::path to string
-    std::string path_str = file_path.string();
+    // Move the file
+    move_file(file_path, meta, target_file_path, content_hash, ctx);
+}
 
-    // Call statx syscall
-    int ret = syscall(SYS_statx, AT_FDCWD, path_str.c_str(), flags, mask, &stx);
-    if (ret == 0) {
-        if (stx.stx_mask & STATX_BTIME) {
-            // Convert stx_btime to time_point
-            creation_time = std::chrono::system_clock::time_point(
-                std::chrono::seconds(stx.stx_btime.tv_sec) +
-                std::chrono::nanoseconds(stx.stx_btime.tv_nsec));
-            return true;
+#if FILE_ORGANIZER_IO_URING
+// Minimal io_uring submission/completion ring driven through raw syscalls.
+// Each worker thread owns one; it is used to issue a whole batch of
+// independent statx or renameat operations with a single io_uring_enter.
+class IoUring {
+public:
+    // Set up a ring, or return null when the kernel doesn't allow io_uring
+    static std::unique_ptr<IoUring> create(unsigned entries) {
+        std::unique_ptr<IoUring> ring(new IoUring());
+        if (!ring->setup(entries)) {
+            return nullptr;
         }
+        return ring;
     }
 
-    // If statx failed or birth time not available, return false
-    return false;
-}
-#endif
+    ~IoUring() {
+        if (sqes_ != nullptr) {
+            munmap(sqes_, sqes_size_);
+        }
+        if (cq_ptr_ != nullptr && cq_ptr_ != sq_ptr_) {
+            munmap(cq_ptr_, cq_size_);
+        }
+        if (sq_ptr_ != nullptr) {
+            munmap(sq_ptr_, sq_size_);
+        }
+        if (ring_fd_ >= 0) {
+            close(ring_fd_);
+        }
+    }
 
-// Function to retrieve file time based on user choice
-std::chrono::system_clock::time_point get_file_time(const fs::path& file_path, TimeAttribute attr) {
-    std::chrono::system_clock::time_point file_time;
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
 
-    switch (attr) {
-        case TimeAttribute::Creation:
-#if HAS_STATX
-            {
-                bool success = get_creation_time(file_path, file_time);
-                if (!success) {
-                    std::cerr << "Warning: Creation time not available for \"" << file_path 
-                              << "\". Falling back to last modification time.\n";
-                }
-                else {
-                    return file_time;
-                }
-            }
-#endif
-            // Fallback to modification time
-            // No break; continue to modification time
-        case TimeAttribute::Modification:
-            {
-                std::error_code ec;
-                auto ftime = fs::last_write_time(file_path, ec);
-                if (ec) {
-                    std::cerr << "Error: Unable to get modification time for \"" << file_path 
-                              << "\": " << ec.message() << "\n";
-                    return std::chrono::system_clock::now();
-                }
+    unsigned capacity() const {
+        return sq_entries_;
+    }
 
-                // Convert to time_point
-                file_time = std::chrono::time_point_cast<std::chrono::system_clock::duration>(
-                    ftime - fs::file_time_type::clock::now() + std::chrono::system_clock::now()
-                );
-                return file_time;
-            }
-            break;
-        case TimeAttribute::Access:
-            {
-                struct stat sb;
-                if (stat(file_path.c_str(), &sb) == 0) {
-                    file_time = std::chrono::system_clock::time_point(
-                        std::chrono::seconds(sb.st_atime) +
-                        std::chrono::nanoseconds(sb.st_atim.tv_nsec));
-                    return file_time;
-                } else {
-                    std::cerr << "Error: Unable to get access time for \"" << file_path 
-                              << "\": " << strerror(errno) << "\n";
-                    return std::chrono::system_clock::now();
+    // Next free submission entry, zeroed and tagged; null if the ring is full
+    io_uring_sqe* prepare(uint64_t user_data) {
+        unsigned head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+        if (sqe_tail_ - head >= sq_entries_) {
+            return nullptr;
+        }
+        unsigned index = sqe_tail_ & *sq_mask_;
+        io_uring_sqe* sqe = &sqes_[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->user_data = user_data;
+        sq_array_[index] = index;
+        ++sqe_tail_;
+        ++unsubmitted_;
+        return sqe;
+    }
+
+    // Submit everything prepared and wait for all of it. results[user_data]
+    // receives each operation's result (negative errno on failure). Returns
+    // false if the ring itself failed, in which case no result is meaningful.
+    bool submit_and_wait(std::vector<int>& results) {
+        __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+        unsigned outstanding = unsubmitted_;
+        while (outstanding > 0) {
+            int ret = static_cast<int>(syscall(__NR_io_uring_enter, ring_fd_, unsubmitted_, 1,
+                                               IORING_ENTER_GETEVENTS, nullptr, 0));
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
                 }
+                return false;
             }
-            break;
-        default:
-            // Default to modification time
-            {
-                std::error_code ec;
-                auto ftime = fs::last_write_time(file_path, ec);
-                if (ec) {
-                    std::cerr << "Error: Unable to get modification time for \"" << file_path 
-                              << "\": " << ec.message() << "\n";
-                    return std::chrono::system_clock::now();
-                }
+            unsubmitted_ -= static_cast<unsigned>(ret);
 
-                // Convert to time_point
-                file_time = std::chrono::time_point_cast<std::chrono::system_clock::duration>(
-                    ftime - fs::file_time_type::clock::now() + std::chrono::system_clock::now()
-                );
-                return file_time;
+            unsigned head = *cq_head_;
+            unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head) {
+                const io_uring_cqe& cqe = cqes_[head & *cq_mask_];
+                if (cqe.user_data < results.size()) {
+                    results[cqe.user_data] = cqe.res;
+                }
+                --outstanding;
             }
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+        }
+        return true;
     }
-}
 
-// Function to get metadata-based directory path
-std::string get_metadata_based_dir(const fs::path& file_path, TimeAttribute attr, const SizeThresholds& thresholds) {
-    // Get the desired file time
-    std::chrono::system_clock::time_point file_time = get_file_time(file_path, attr);
+private:
+    IoUring() = default;
 
-    // Convert to time_t for easy manipulation
-    std::time_t cftime = std::chrono::system_clock::to_time_t(file_time);
-    std::tm tm_ptr;
-    localtime_r(&cftime, &tm_ptr); // Thread-safe version
+    bool setup(unsigned entries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ring_fd_ = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (ring_fd_ < 0) {
+            return false;
+        }
 
-    // Format date as YYYY/MM/DD
-    std::ostringstream date_stream;
-    date_stream << std::put_time(&tm_ptr, "%Y/%m/%d");
+        sq_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap) {
+            sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+        }
 
-    // Get file size
-    std::error_code ec;
-    uintmax_t file_size = fs::file_size(file_path, ec);
-    if (ec) {
-        std::cerr << "Error: Unable to get file size for \"" << file_path 
-                  << "\": " << ec.message() << "\n";
-        file_size = 0;
-    }
+        void* sq = mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring_fd_, IORING_OFF_SQ_RING);
+        if (sq == MAP_FAILED) {
+            return false;
+        }
+        sq_ptr_ = static_cast<char*>(sq);
 
-    // Categorize size
-    std::string size_category = categorize_size(file_size, thresholds);
+        if (single_mmap) {
+            cq_ptr_ = sq_ptr_;
+        } else {
+            void* cq = mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring_fd_, IORING_OFF_CQ_RING);
+            if (cq == MAP_FAILED) {
+                return false;
+            }
+            cq_ptr_ = static_cast<char*>(cq);
+        }
 
-    // Construct metadata-based directory path
-    fs::path metadata_subdir = fs::path(date_stream.str()) / size_category;
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqes = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          ring_fd_, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED) {
+            return false;
+        }
+        sqes_ = static_cast<io_uring_sqe*>(sqes);
 
-    return metadata_subdir.string();
-}
+        sq_entries_ = params.sq_entries;
+        sq_head_ = reinterpret_cast<unsigned*>(sq_ptr_ + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq_ptr_ + params.sq_off.tail);
+        sq_mask_ = reinterpret_cast<unsigned*>(sq_ptr_ + params.sq_off.ring_mask);
+        sq_array_ = reinterpret_cast<unsigned*>(sq_ptr_ + params.sq_off.array);
+        cq_head_ = reinterpret_cast<unsigned*>(cq_ptr_ + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq_ptr_ + params.cq_off.tail);
+        cq_mask_ = reinterpret_cast<unsigned*>(cq_ptr_ + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq_ptr_ + params.cq_off.cqes);
+        sqe_tail_ = *sq_tail_;
+        return true;
+    }
 
-// Function to display usage information
-void print_usage(const char* program_name) {
-    std::cout << "Usage: " << program_name << " [OPTIONS] <source_directory>\n\n"
-              << "Options:\n"
-              << "  -h, --help                 Show this help message and exit\n"
-              << "  -v, --verbose              Enable verbose output\n"
-              << "  -d, --dry-run              Perform a trial run with no changes made\n"
-              << "  -t, --time [creation|modification|access]\n"
-              << "                             Specify the time attribute to organize by (default: creation)\n"
-              << "  --small <size_in_MB>       Define the threshold for 'small' files (default: 1)\n"
-              << "  --medium <size_in_MB>      Define the threshold for 'medium' files (default: 10)\n"
-              << "\nExamples:\n"
-              << "  " << program_name << " -v /path/to/source\n"
-              << "  " << program_name << " --dry-run --time modification --small 2 --medium 20 /path/to/source\n";
+    int ring_fd_ = -1;
+    char* sq_ptr_ = nullptr;
+    char* cq_ptr_ = nullptr;
+    io_uring_sqe* sqes_ = nullptr;
+    size_t sq_size_ = 0;
+    size_t cq_size_ = 0;
+    size_t sqes_size_ = 0;
+    unsigned sq_entries_ = 0;
+    unsigned* sq_head_ = nullptr;
+    unsigned* sq_tail_ = nullptr;
+    unsigned* sq_mask_ = nullptr;
+    unsigned* sq_array_ = nullptr;
+    unsigned* cq_head_ = nullptr;
+    unsigned* cq_tail_ = nullptr;
+    unsigned* cq_mask_ = nullptr;
+    io_uring_cqe* cqes_ = nullptr;
+    unsigned sqe_tail_ = 0;
+    unsigned unsubmitted_ = 0;
+};
+
+// The calling worker's ring, created on first use; null means use the sync path
+static IoUring* worker_ring(unsigned entries) {
+    thread_local bool attempted = false;
+    thread_local std::unique_ptr<IoUring> ring;
+    if (!attempted) {
+        attempted = true;
+        ring = IoUring::create(entries);
+    }
+    return ring.get();
 }
 
-// Function to parse size from string (in MB)
-bool parse_size(const std::string& str, uintmax_t& size_out) {
-    try {
-        size_out = std::stoull(str) * 1024 * 1024;
-        return true;
-    } catch (...) {
+// Organize a batch with io_uring: one submission for every statx, then one
+// for every rename that doesn't need collision handling. Anything the ring
+// can't do (unsupported opcode, EEXIST, dry run) goes through the sync path.
+static bool organize_batch_io_uring(const FileTable& batch, OrganizerContext& ctx) {
+    IoUring* ring = worker_ring(static_cast<unsigned>(organize_batch_size));
+    if (ring == nullptr || ring->capacity() < batch.size()) {
         return false;
     }
-}
 
-// Function to move a single file
-bool move_file(const fs::path& source_file, const fs::path& target_file, bool dry_run, bool verbose) {
-    if (source_file == target_file) {
-        if (verbose) {
-            std::cout << "Skipping: \"" << source_file << "\" is already in the correct location.\n";
+    const size_t n = batch.size();
+    std::vector<DirectoryFdCache::Handle> parents(n);
+    std::vector<struct statx> stx(n);
+    std::vector<int> results(n, -ECANCELED);
+
+    for (size_t i = 0; i < n; ++i) {
+        parents[i] = ctx.dir_fds->acquire(batch.directory(i));
+        if (!parents[i]) {
+            results[i] = -errno;
+            continue;
         }
-        return true;
+        io_uring_sqe* sqe = ring->prepare(i);
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = parents[i]->get();
+        sqe->addr = reinterpret_cast<uint64_t>(batch.name(i));
+        sqe->len = file_metadata_statx_mask;
+        sqe->off = reinterpret_cast<uint64_t>(&stx[i]);
+        sqe->statx_flags = AT_STATX_SYNC_AS_STAT;
+    }
+    bool submitted;
+    {
+        OpTimer timer(OpClass::UringStatxBatch);
+        submitted = ring->submit_and_wait(results);
+    }
+    if (!submitted) {
+        return false;
     }
 
-    fs::path final_target = target_file;
+    // Classify each file; plain moves are queued for one batched rename
+    struct PendingMove {
+        size_t index;
+        fs::path source_file;
+        FileMetadata meta;
+        fs::path target_file;
+        std::optional<uint64_t> content_hash;
+        DirectoryFdCache::Handle target_dir;
+        std::string target_name;
+        std::unique_ptr<ReservationGuard> guard;
+    };
+    std::vector<PendingMove> pending;
+    std::vector<PendingMove> deferred;
+    pending.reserve(n);
 
-    // Check if the target file already exists
-    if (fs::exists(target_file)) {
-        // Compare contents
-        std::ifstream source_stream(source_file, std::ios::binary);
-        std::ifstream target_stream(target_file, std::ios::binary);
+    for (size_t i = 0; i < n; ++i) {
+        FileMetadata meta;
+        if (results[i] == 0) {
+            fill_file_metadata(stx[i], meta);
+        } else if (results[i] == -EINVAL && parents[i]) {
+            // Opcode unsupported by this kernel; fall back to a direct statx
+            if (!get_file_metadata_at(parents[i]->get(), batch.name(i), meta)) {
+                int err = errno;
+                report_metadata_error(batch.path(i), err, ctx);
+                continue;
+            }
+        } else {
+            report_metadata_error(batch.path(i), -results[i], ctx);
+            continue;
+        }
 
-        std::ostringstream source_contents;
-        std::ostringstream target_contents;
+        PendingMove move{i, batch.path(i), meta, {}, {}, nullptr, {}, nullptr};
+        if (!classify_file(move.source_file, meta, ctx, move.target_file, move.content_hash)) {
+            continue;
+        }
+        if (ctx.plan != nullptr) {
+            plan_file(move.source_file, meta, move.target_file, move.content_hash, ctx);
+            continue;
+        }
+        if (ctx.options.dry_run || move.target_file == move.source_file) {
+            move_file(move.source_file, meta, move.target_file, move.content_hash, ctx);
+            continue;
+        }
+        move.guard = std::make_unique<ReservationGuard>(ctx.reservations);
+        move.target_dir = ctx.dir_fds->acquire(move.target_file.parent_path().string());
+        if (!move.target_dir || !move.guard->try_acquire(move.target_file.string())) {
+            // Another file in flight wants this name; resolve it afterwards
+            move.guard.reset();
+            deferred.push_back(std::move(move));
+            continue;
+        }
+        move.target_name = move.target_file.filename().string();
+        expect_arrival(move.target_file, ctx);
+        pending.push_back(std::move(move));
+    }
 
-        source_contents << source_stream.rdbuf();
-        target_contents << target_stream.rdbuf();
+    std::vector<int> rename_results(pending.size(), -ECANCELED);
+    for (size_t k = 0; k < pending.size(); ++k) {
+        const PendingMove& move = pending[k];
+        io_uring_sqe* sqe = ring->prepare(k);
+        sqe->opcode = IORING_OP_RENAMEAT;
+        sqe->fd = parents[move.index]->get();
+        sqe->addr = reinterpret_cast<uint64_t>(batch.name(move.index));
+        sqe->len = static_cast<uint32_t>(move.target_dir->get());
+        sqe->addr2 = reinterpret_cast<uint64_t>(move.target_name.c_str());
+        sqe->rename_flags = RENAME_NOREPLACE;
+    }
+    if (!pending.empty()) {
+        // On ring failure, entries without a completion stay -ECANCELED
+        OpTimer timer(OpClass::UringRenameBatch);
+        ring->submit_and_wait(rename_results);
+    }
 
-        if (source_contents.str() != target_contents.str()) {
-            // File contents differ, create a unique name
-            int counter = 1;
-            do {
-                final_target = target_file.parent_path() /
-                               (target_file.stem().string() + "_" + std::to_string(counter) + target_file.extension().string());
-                counter++;
-            } while (fs::exists(final_target));
+    for (size_t k = 0; k < pending.size(); ++k) {
+        PendingMove& move = pending[k];
+        const fs::path& source_file = move.source_file;
+        int res = rename_results[k];
+        move.guard.reset();
+        if (res == 0) {
+            count_outcome(Outcome::Moved);
+            finish_move(source_file, move.meta, move.target_file, move.content_hash, ctx);
+            continue;
+        }
+        if (res == -EEXIST || res == -EINVAL || res == -ECANCELED || res == -EXDEV) {
+            // Collision, unsupported flag/opcode, ring failure or another
+            // filesystem: sync path
+            move_file(source_file, move.meta, move.target_file, move.content_hash, ctx);
         } else {
-            if (verbose) {
-                std::cout << "Skipping: \"" << source_file << "\" as it matches the existing file.\n";
-            }
-            return true; // Skip moving as the contents are identical
+            record_error(source_file, ctx);
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cerr << "Error: Unable to move \"" << source_file << "\" -> \"" << move.target_file 
+                      << "\": " << strerror(-res) << "\n";
         }
     }
-
-    if (dry_run) {
-        std::cout << "[Dry-Run] Would move: \"" << source_file << "\" -> \"" << final_target << "\"\n";
-        return true;
+    for (auto& move : deferred) {
+        move_file(move.source_file, move.meta, move.target_file, move.content_hash, ctx);
     }
+    return true;
+}
+#endif
 
-    try {
-        fs::rename(source_file, final_target);
-        if (verbose) {
-            std::cout << "Moved: \"" << source_file << "\" -> \"" << final_target << "\"\n";
-        }
-        return true;
-    } catch (const fs::filesystem_error& e) {
-        std::cerr << "Error: Unable to move \"" << source_file << "\" -> \"" << final_target 
-                  << "\": " << e.what() << "\n";
-        return false;
+// Organize one batch handed over by the walker
+void organize_batch(const FileTable& batch, OrganizerContext& ctx) {
+#if FILE_ORGANIZER_IO_URING
+    if (organize_batch_io_uring(batch, ctx)) {
+        return;
+    }
+#endif
+    for (size_t i = 0; i < batch.size(); ++i) {
+        organize_file(batch, i, ctx);
     }
 }
 
+// inotify watches on every directory of the source tree. Files are reported
+// once their writer closes them or when they are renamed in, so half-written
+// uploads are never moved. New directories are watched as they appear.
+class TreeWatcher {
+public:
+    TreeWatcher() : fd_(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) {}
 
-// Function to collect all files first
-std::vector<fs::path> collect_all_files(const fs::path& src_directory, bool verbose) {
-    std::vector<fs::path> files;
-    try {
-        for (auto const& entry : fs::recursive_directory_iterator(src_directory, fs::directory_options::skip_permission_denied)) {
-            if (fs::is_regular_file(entry.status())) {
-                files.emplace_back(entry.path());
+    bool valid() const { return fd_.valid(); }
+    int fd() const { return fd_.get(); }
+
+    // Watch directory and every directory below it. Regular files already
+    // inside are appended to found, since they may predate the watch.
+    void add_tree(const fs::path& directory, std::vector<fs::path>* found) {
+        if (!add_watch(directory)) {
+            return;
+        }
+        std::error_code ec;
+        fs::recursive_directory_iterator it(directory, fs::directory_options::skip_permission_denied, ec);
+        for (auto end = fs::recursive_directory_iterator(); !ec && it != end; it.increment(ec)) {
+            std::error_code type_ec;
+            if (it->is_directory(type_ec) && !it->is_symlink(type_ec)) {
+                if (!add_watch(it->path())) {
+                    it.disable_recursion_pending();
+                }
+            } else if (found != nullptr && it->is_regular_file(type_ec)) {
+                found->push_back(it->path());
+            }
+        }
+    }
+
+    // Drain pending events. Arrived files go to arrivals, directories that
+    // disappeared from their path go to gone. Returns false if the kernel
+    // queue overflowed and events were lost.
+    bool read_events(std::vector<fs::path>& arrivals, std::vector<fs::path>& gone) {
+        alignas(struct inotify_event) char buffer[64 * 1024];
+        bool complete = true;
+        for (;;) {
+            ssize_t n = read(fd_.get(), buffer, sizeof(buffer));
+            if (n <= 0) {
+                return complete; // EAGAIN: drained
+            }
+            for (char* p = buffer; p < buffer + n;) {
+                const auto* event = reinterpret_cast<const struct inotify_event*>(p);
+                p += sizeof(struct inotify_event) + event->len;
+                if (event->mask & IN_Q_OVERFLOW) {
+                    complete = false;
+                    continue;
+                }
+                auto it = directories_.find(event->wd);
+                if (it == directories_.end()) {
+                    continue;
+                }
+                if (event->mask & IN_IGNORED) {
+                    directories_.erase(it);
+                    continue;
+                }
+                if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                    gone.push_back(it->second);
+                    continue;
+                }
+                if (event->len == 0) {
+                    continue;
+                }
+                fs::path path = it->second / event->name;
+                if (event->mask & IN_ISDIR) {
+                    if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+                        add_tree(path, &arrivals);
+                    } else if (event->mask & IN_MOVED_FROM) {
+                        gone.push_back(path);
+                    }
+                } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                    arrivals.push_back(std::move(path));
+                }
             }
         }
-    } catch (const fs::filesystem_error& e) {
-        std::cerr << "Error during file collection: " << e.what() << "\n";
     }
 
-    if (verbose) {
-        std::cout << "Collected " << files.size() << " files for processing.\n";
+private:
+    static constexpr uint32_t watch_mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE |
+                                           IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_EXCL_UNLINK;
+
+    bool add_watch(const fs::path& directory) {
+        int wd = inotify_add_watch(fd_.get(), directory.c_str(), watch_mask);
+        if (wd < 0) {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cerr << "Error: Unable to watch \"" << directory << "\": " << strerror(errno)
+                      << (errno == ENOSPC ? " (raise fs.inotify.max_user_watches)" : "") << "\n";
+            return false;
+        }
+        directories_[wd] = directory; // A directory renamed within the tree keeps its wd
+        return true;
     }
 
-    return files;
-}
+    ScopedFd fd_;
+    std::unordered_map<int, fs::path> directories_;
+};
 
-// Main function to move files based on extension and metadata
-void move_files_by_extension_and_metadata(const fs::path& src_directory, TimeAttribute attr, 
-                                         const SizeThresholds& thresholds, bool dry_run, bool verbose) {
-    // Collect all files first
-    std::vector<fs::path> files = collect_all_files(src_directory, verbose);
+// Quiet period that ends an event burst, and the longest any arrival waits
+constexpr std::chrono::milliseconds watch_quiet_period(50);
+constexpr std::chrono::milliseconds watch_max_delay(250);
+// How long the watcher ignores events for a name this process moved into place
+constexpr std::chrono::seconds recent_move_lifetime(30);
 
-    // Iterate over collected files
-    for (const auto& file_path : files) {
-        // Skip if the file no longer exists
-        if (!fs::exists(file_path)) {
-            if (verbose) {
-                std::cout << "Skipping: \"" << file_path << "\" does not exist.\n";
+// Function to organize arrivals reported by the watcher until SIGINT or
+// SIGTERM arrives on signal_fd. Bursts are coalesced (a file written and then
+// renamed is organized once) and fed to the pool in walker-sized batches.
+// Returns the number of files handed to the pool.
+static size_t watch_source_tree(TreeWatcher& watcher, int signal_fd, OrganizerContext& ctx, WorkStealingPool& pool) {
+    using clock = std::chrono::steady_clock;
+    size_t count = 0;
+    std::vector<fs::path> arrivals;
+    std::vector<fs::path> gone;
+    std::vector<fs::path> batch;
+    std::unordered_set<std::string> queued;
+    clock::time_point first_arrival;
+    clock::time_point last_event;
+    clock::time_point last_expiry = clock::now();
+
+    auto flush = [&] {
+        for (size_t begin = 0; begin < batch.size(); begin += organize_batch_size) {
+            size_t end = std::min(batch.size(), begin + organize_batch_size);
+            FileTable chunk;
+            for (size_t i = begin; i < end; ++i) {
+                chunk.add(batch[i].native());
             }
-            continue;
+            pool.submit([&ctx, chunk = std::move(chunk)] {
+                organize_batch(chunk, ctx);
+            });
+        }
+        count += batch.size();
+        batch.clear();
+        queued.clear();
+    };
+
+    for (;;) {
+        int timeout = -1;
+        if (!batch.empty()) {
+            auto now = clock::now();
+            auto deadline = std::min(last_event + watch_quiet_period, first_arrival + watch_max_delay);
+            timeout = deadline <= now ? 0 : static_cast<int>(
+                std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count() + 1);
         }
 
-        std::string file_extension = file_path.has_extension() ? 
-                                     file_path.extension().string().substr(1) : 
-                                     "no_extension";
+        struct pollfd fds[2] = {{watcher.fd(), POLLIN, 0}, {signal_fd, POLLIN, 0}};
+        int ready = poll(fds, 2, timeout);
+        if (ready < 0 && errno != EINTR) {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cerr << "Error: Unable to wait for filesystem events: " << strerror(errno) << "\n";
+            break;
+        }
+        if (ready > 0 && (fds[1].revents & POLLIN)) {
+            break;
+        }
 
-        // Define the extension directory
-        fs::path extension_directory = src_directory / file_extension;
+        if (ready > 0 && (fds[0].revents & POLLIN)) {
+            arrivals.clear();
+            gone.clear();
+            bool complete = watcher.read_events(arrivals, gone);
+            for (const auto& directory : gone) {
+                ctx.dir_fds->forget_tree(directory.native());
+                ctx.directories->forget_tree(directory.native());
+            }
+            if (!complete) {
+                // Events were lost; a single rescan finds whatever they announced
+                {
+                    std::lock_guard<std::mutex> lock(output_mutex);
+                    std::cerr << "Warning: Filesystem event queue overflowed; rescanning \"" << ctx.src_directory
+                              << "\".\n";
+                }
+                watcher.add_tree(ctx.src_directory, &arrivals);
+            }
+            auto now = clock::now();
+            for (auto& path : arrivals) {
+                if (path.parent_path() == ctx.src_directory &&
+                    path.filename().string().rfind(state_file_prefix, 0) == 0) {
+                    continue; // The organizer's own index and journal files
+                }
+                if (ctx.recent_moves->contains(path.native()) || !queued.insert(path.native()).second) {
+                    continue;
+                }
+                if (batch.empty()) {
+                    first_arrival = now;
+                }
+                batch.push_back(std::move(path));
+            }
+            last_event = now;
+            if (now >= last_expiry + recent_move_lifetime) {
+                ctx.recent_moves->expire(now - recent_move_lifetime);
+                last_expiry = now;
+            }
+        }
 
-        // Get metadata-based subdirectory
-        std::string metadata_subdir = get_metadata_based_dir(file_path, attr, thresholds);
-        fs::path target_directory = extension_directory / metadata_subdir;
+        if (!batch.empty()) {
+            auto now = clock::now();
+            if (now >= last_event + watch_quiet_period || now >= first_arrival + watch_max_delay) {
+                flush();
+            }
+        }
+    }
 
-        // Define target file path
-        fs::path target_file_path = target_directory / file_path.filename();
+    flush();
+    return count;
+}
 
-        // Create target directories if they don't exist
-        std::error_code ec;
-        if (!fs::exists(target_directory)) {
-            if (dry_run) {
-                if (verbose) {
-                    std::cout << "[Dry-Run] Would create directory: \"" << target_directory << "\"\n";
-                }
-            } else {
-                if (!fs::create_directories(target_directory, ec)) {
-                    std::cerr << "Error: Unable to create directory \"" << target_directory 
-                              << "\": " << ec.message() << "\n";
+// Function to queue every entry of a loaded plan on the pool. No traversal or
+// stat is repeated: the planner's size and mtime stand in for the metadata,
+// and collisions are still resolved against the tree as it is now.
+static size_t apply_plan(const OrganizePlan& plan, OrganizerContext& ctx, WorkStealingPool& pool) {
+    const size_t count = plan.size();
+    for (size_t begin = 0; begin < count; begin += organize_batch_size) {
+        size_t end = std::min(count, begin + organize_batch_size);
+        pool.submit([&plan, &ctx, begin, end] {
+            OrganizePlan::Entry entry;
+            for (size_t i = begin; i < end; ++i) {
+                plan.entry(i, entry);
+                if (entry.action != PlanAction::InPlace &&
+                    !ensure_target_directory(entry.target.parent_path().native(), entry.source, ctx)) {
                     continue;
-                } else if (verbose) {
-                    std::cout << "Created directory: \"" << target_directory << "\"\n";
                 }
+                move_file(entry.source, entry.meta, entry.target, entry.content_hash, ctx);
             }
+        });
+    }
+    return count;
+}
+
+// Main function to move files based on extension and metadata. With a plan
+// to apply, its entries replace the walk; returns false if a plan or index
+// requested by the options could not be written.
+bool move_files_by_extension_and_metadata(const fs::path& src_directory, const OrganizerOptions& options,
+                                          const BucketRules& rules, const OrganizePlan* plan_to_apply = nullptr) {
+    stats_enabled = options.stats || !options.stats_json.empty();
+    const auto start_time = std::chrono::steady_clock::now();
+
+    OrganizerContext ctx;
+    ctx.src_directory = src_directory;
+    ctx.options = options;
+
+    // Planning is a dry run whose decisions are collected instead of printed
+    std::unique_ptr<OrganizePlan> plan;
+    if (!options.plan_file.empty()) {
+        plan = std::make_unique<OrganizePlan>(src_directory);
+        ctx.plan = plan.get();
+        ctx.options.dry_run = true;
+    }
+    ctx.dir_fds = std::make_unique<DirectoryFdCache>(directory_fd_capacity());
+    ctx.rules = &rules;
+    ctx.extensions = std::make_unique<ExtensionTable>(src_directory, options.fold_case, options.categories, rules);
+    ctx.directories = std::make_unique<DirectoryCache>(src_directory, ctx.output_directories, *ctx.dir_fds);
+    if (options.use_index || options.dedup) {
+        ctx.index = std::make_unique<ContentIndex>(src_directory);
+        ctx.index->load();
+    }
+    if (options.incremental && plan_to_apply == nullptr) {
+        ctx.snapshot = std::make_unique<DirectorySnapshot>(src_directory);
+        ctx.snapshot->load();
+    }
+    if ((options.journal || options.resume) && !options.dry_run) {
+        ctx.journal = std::make_unique<MoveJournal>(src_directory);
+        if ((options.resume && !ctx.journal->load()) || !ctx.journal->open_for_append(options.resume)) {
+            return false;
+        }
+    }
+
+    // In watch mode the termination signals are blocked before any worker
+    // starts, so they are only ever delivered through signal_fd
+    ScopedFd signal_fd;
+    std::unique_ptr<TreeWatcher> watcher;
+    if (options.watch) {
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+        signal_fd = ScopedFd(signalfd(-1, &signals, SFD_CLOEXEC));
+        watcher = std::make_unique<TreeWatcher>();
+        if (!signal_fd.valid() || !watcher->valid()) {
+            std::cerr << "Error: Unable to watch \"" << src_directory << "\": " << strerror(errno) << "\n";
+            return false;
+        }
+        // Watch before the initial pass so nothing arriving during it is missed
+        ctx.recent_moves = std::make_unique<RecentMoves>();
+        watcher->add_tree(src_directory, nullptr);
+    }
+
+    // Files found by the walker are organized while the walk continues. The
+    // pool bound caps how many batches are in flight, which keeps memory flat.
+    WorkStealingPool pool(options.jobs, static_cast<size_t>(options.jobs) * 4);
+    if (!ctx.options.dry_run) {
+        // Bounded so that workers stall rather than queue unbounded copies
+        ctx.copies = std::make_unique<WorkStealingPool>(options.copy_jobs, static_cast<size_t>(options.copy_jobs) * 2);
+    }
+    auto submit_batch = [&](FileTable&& batch) {
+        pool.submit([&ctx, batch = std::move(batch)] {
+            organize_batch(batch, ctx);
+        });
+    };
+    size_t count;
+    size_t skipped_directories = 0;
+    uint64_t skipped_entries = 0;
+    if (plan_to_apply != nullptr) {
+        count = apply_plan(*plan_to_apply, ctx, pool);
+    } else {
+        count = walk_source_tree(src_directory, ctx.output_directories, ctx.snapshot.get(), ctx.journal.get(),
+                                 options.walk_jobs, organize_batch_size, submit_batch, skipped_directories,
+                                 skipped_entries);
+    }
+    if (watcher) {
+        if (options.verbose) {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            std::cout << "Watching \"" << src_directory << "\" for new files.\n";
         }
+        count += watch_source_tree(*watcher, signal_fd.get(), ctx, pool);
+    }
+    pool.wait();
+    if (ctx.copies) {
+        ctx.copies->wait();
+    }
+
+    bool ok = true;
+    if (ctx.index && !ctx.options.dry_run) {
+        ok = ctx.index->save();
+    }
+    if (plan) {
+        ok = plan->save(options.plan_file) && ok;
+    }
+    if (ctx.snapshot && !ctx.options.dry_run) {
+        ok = ctx.snapshot->save() && ok;
+    }
+    if (ctx.journal) {
+        ok = ctx.journal->finish() && ok;
+    }
+
+    if (options.verbose) {
+        std::lock_guard<std::mutex> lock(output_mutex);
+        std::cout << "Processed " << count << " files.\n";
+        if (ctx.snapshot || ctx.journal) {
+            std::cout << "Skipped " << skipped_directories << " unchanged directories (" << skipped_entries
+                      << " entries).\n";
+        }
+    }
 
-        // Move the file
-        move_file(file_path, target_file_path, dry_run, verbose);
+    if (stats_enabled) {
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        if (options.stats) {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            print_stats_text(std::cout, elapsed, ctx.extensions->names());
+        }
+        if (options.stats_json == "-") {
+            std::lock_guard<std::mutex> lock(output_mutex);
+            print_stats_json(std::cout, elapsed, ctx.extensions->names());
+        } else if (!options.stats_json.empty()) {
+            std::ofstream out(options.stats_json, std::ios::trunc);
+            if (out) {
+                print_stats_json(out, elapsed, ctx.extensions->names());
+            }
+            if (!out) {
+                std::cerr << "Error: Unable to write statistics to \"" << options.stats_json << "\"\n";
+            }
+        }
     }
+    return ok;
 }
 
 int main(int argc, char* argv[]) {
     // Default settings
-    bool verbose = false;
-    bool dry_run = false;
-    TimeAttribute attr = TimeAttribute::Creation;
-    SizeThresholds thresholds;
+    OrganizerOptions options;
 
     // Define long options
     static struct option long_options[] = {
@@ -365,8 +4714,24 @@ int main(int argc, char* argv[]) {
         {"verbose",     no_argument,       0, 'v'},
         {"dry-run",     no_argument,       0, 'd'},
         {"time",        required_argument, 0, 't'},
+        {"jobs",        required_argument, 0, 'j'},
         {"small",       required_argument, 0,  1 },
         {"medium",      required_argument, 0,  2 },
+        {"index",       no_argument,       0,  3 },
+        {"dedup",       no_argument,       0,  4 },
+        {"stats",       no_argument,       0,  5 },
+        {"stats-json",  required_argument, 0,  6 },
+        {"plan",        required_argument, 0,  7 },
+        {"apply",       required_argument, 0,  8 },
+        {"incremental", no_argument,       0,  9 },
+        {"watch",       no_argument,       0, 10 },
+        {"fold-case",   no_argument,       0, 11 },
+        {"category",    required_argument, 0, 12 },
+        {"rules",       required_argument, 0, 13 },
+        {"copy-jobs",   required_argument, 0, 14 },
+        {"journal",     no_argument,       0, 15 },
+        {"resume",      no_argument,       0, 16 },
+        {"walk-jobs",   required_argument, 0, 17 },
         {0, 0, 0, 0}
     };
 
@@ -374,62 +4739,167 @@ int main(int argc, char* argv[]) {
     int option_index = 0;
 
     // Parse command-line arguments
-    while ((opt = getopt_long(argc, argv, "hvdt:", long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "hvdt:j:", long_options, &option_index)) != -1) {
         switch (opt) {
             case 'h':
                 print_usage(argv[0]);
                 return 0;
             case 'v':
-                verbose = true;
+                options.verbose = true;
                 break;
             case 'd':
-                dry_run = true;
+                options.dry_run = true;
                 break;
             case 't':
                 if (std::string(optarg) == "creation") {
-                    attr = TimeAttribute::Creation;
+                    options.attr = TimeAttribute::Creation;
                 } else if (std::string(optarg) == "modification") {
-                    attr = TimeAttribute::Modification;
+                    options.attr = TimeAttribute::Modification;
                 } else if (std::string(optarg) == "access") {
-                    attr = TimeAttribute::Access;
+                    options.attr = TimeAttribute::Access;
                 } else {
                     std::cerr << "Error: Invalid time attribute \"" << optarg << "\". Choose from creation, modification, access.\n";
                     return 1;
                 }
                 break;
+            case 'j':
+                if (!parse_jobs(optarg, options.jobs)) {
+                    std::cerr << "Error: Invalid worker count for --jobs: \"" << optarg << "\"\n";
+                    return 1;
+                }
+                break;
             case 1: // --small
-                if (!parse_size(optarg, thresholds.small)) {
+                if (!parse_size(optarg, options.thresholds.small)) {
                     std::cerr << "Error: Invalid size for --small: \"" << optarg << "\"\n";
                     return 1;
                 }
                 break;
             case 2: // --medium
-                if (!parse_size(optarg, thresholds.medium)) {
+                if (!parse_size(optarg, options.thresholds.medium)) {
                     std::cerr << "Error: Invalid size for --medium: \"" << optarg << "\"\n";
                     return 1;
                 }
                 break;
+            case 3: // --index
+                options.use_index = true;
+                break;
+            case 4: // --dedup
+                options.dedup = true;
+                break;
+            case 5: // --stats
+                options.stats = true;
+                break;
+            case 6: // --stats-json
+                options.stats_json = optarg;
+                break;
+            case 7: // --plan
+                options.plan_file = optarg;
+                break;
+            case 8: // --apply
+                options.apply_file = optarg;
+                break;
+            case 9: // --incremental
+                options.incremental = true;
+                break;
+            case 10: // --watch
+                options.watch = true;
+                break;
+            case 11: // --fold-case
+                options.fold_case = true;
+                break;
+            case 12: // --category
+                if (!parse_category(optarg, options.categories)) {
+                    std::cerr << "Error: Invalid category mapping \"" << optarg
+                              << "\". Expected a form like \"jpg,png=images\".\n";
+                    return 1;
+                }
+                break;
+            case 13: // --rules
+                options.rules_file = optarg;
+                break;
+            case 14: // --copy-jobs
+                if (!parse_jobs(optarg, options.copy_jobs)) {
+                    std::cerr << "Error: Invalid worker count for --copy-jobs: \"" << optarg << "\"\n";
+                    return 1;
+                }
+                break;
+            case 15: // --journal
+                options.journal = true;
+                break;
+            case 16: // --resume
+                options.resume = true;
+                break;
+            case 17: // --walk-jobs
+                if (!parse_jobs(optarg, options.walk_jobs)) {
+                    std::cerr << "Error: Invalid worker count for --walk-jobs: \"" << optarg << "\"\n";
+                    return 1;
+                }
+                break;
             default:
                 print_usage(argv[0]);
                 return 1;
         }
     }
 
+    if (options.walk_jobs == 0) {
+        options.walk_jobs = options.jobs;
+    }
+
+    if (!options.plan_file.empty() && !options.apply_file.empty()) {
+        std::cerr << "Error: --plan and --apply cannot be used together.\n";
+        return 1;
+    }
+    if (options.watch && (!options.plan_file.empty() || !options.apply_file.empty())) {
+        std::cerr << "Error: --watch cannot be combined with --plan or --apply.\n";
+        return 1;
+    }
+    if ((options.journal || options.resume) &&
+        (options.watch || options.dry_run || !options.plan_file.empty() || !options.apply_file.empty())) {
+        std::cerr << "Error: --journal and --resume cannot be combined with --watch, --dry-run, --plan or --apply.\n";
+        return 1;
+    }
+
+    // Compile the bucketing rules once; every file is then laid out from them
+    BucketRules rules(options.attr, options.thresholds);
+    std::string rules_error;
+    if (!options.rules_file.empty() && !rules.load(options.rules_file, rules_error)) {
+        std::cerr << "Error: Invalid rules file: " << rules_error << "\n";
+        return 1;
+    }
+
+    // A plan carries its own source directory
+    OrganizePlan plan_to_apply;
+    if (!options.apply_file.empty() && !plan_to_apply.load(options.apply_file)) {
+        return 1;
+    }
+
     // Check for source directory argument
-    if (optind >= argc) {
+    if (optind >= argc && options.apply_file.empty()) {
         std::cerr << "Error: Source directory not specified.\n\n";
         print_usage(argv[0]);
         return 1;
     }
 
-    fs::path src_directory = fs::absolute(argv[optind]);
+    // Normalize so that paths derived from the root compare equal to it
+    fs::path src_directory = optind < argc ? fs::absolute(argv[optind]).lexically_normal() : plan_to_apply.root();
+    if (!src_directory.has_filename() && src_directory.has_relative_path()) {
+        src_directory = src_directory.parent_path();
+    }
+    if (!options.apply_file.empty() && src_directory != plan_to_apply.root()) {
+        std::cerr << "Error: Plan \"" << options.apply_file << "\" was made for \"" << plan_to_apply.root()
+                  << "\", not \"" << src_directory << "\".\n";
+        return 1;
+    }
 
-    if (verbose) {
+    if (options.verbose) {
         std::cout << "Source Directory: \"" << src_directory << "\"\n";
-        std::cout << "Verbose Mode: " << (verbose ? "Enabled" : "Disabled") << "\n";
-        std::cout << "Dry-Run Mode: " << (dry_run ? "Enabled" : "Disabled") << "\n";
+        std::cout << "Verbose Mode: " << (options.verbose ? "Enabled" : "Disabled") << "\n";
+        std::cout << "Dry-Run Mode: " << (options.dry_run ? "Enabled" : "Disabled") << "\n";
+        std::cout << "Worker Threads: " << options.jobs << "\n";
+        std::cout << "Walker Threads: " << options.walk_jobs << "\n";
+        std::cout << "Copy Threads: " << options.copy_jobs << "\n";
         std::cout << "Time Attribute: ";
-        switch (attr) {
+        switch (options.attr) {
             case TimeAttribute::Creation:
                 std::cout << "Creation Time\n";
                 break;
@@ -440,14 +4910,27 @@ int main(int argc, char* argv[]) {
                 std::cout << "Access Time\n";
                 break;
         }
-        std::cout << "Size Thresholds: Small < " << (thresholds.small / (1024 * 1024)) 
-                  << " MB, Medium < " << (thresholds.medium / (1024 * 1024)) << " MB\n";
+        std::cout << "Size Thresholds: Small < " << (options.thresholds.small / (1024 * 1024)) 
+                  << " MB, Medium < " << (options.thresholds.medium / (1024 * 1024)) << " MB\n";
+        std::cout << "Content Index: " << (options.use_index || options.dedup ? "Enabled" : "Disabled")
+                  << (options.dedup ? " (cross-bucket dedup)" : "") << "\n";
+        std::cout << "Extension Case: " << (options.fold_case ? "Folded" : "Preserved") << "\n";
+        for (const auto& mapping : options.categories) {
+            std::cout << "Category: " << mapping.first << " -> " << mapping.second << "\n";
+        }
+        if (!options.rules_file.empty()) {
+            std::cout << "Bucketing Rules: \"" << options.rules_file << "\" (" << rules.rule_count()
+                      << " rules, " << rules.tier_count() << " size tiers)\n";
+        }
     }
 
     // Start organizing files
-    move_files_by_extension_and_metadata(src_directory, attr, thresholds, dry_run, verbose);
+    if (!move_files_by_extension_and_metadata(src_directory, options, rules,
+                                              options.apply_file.empty() ? nullptr : &plan_to_apply)) {
+        return 1;
+    }
 
-    if (verbose) {
+    if (options.verbose) {
         std::cout << "File organization completed.\n";
     }
 